@@ -0,0 +1,435 @@
+// Microbenchmarks for the engine's hot paths.
+//
+// Every benchmark reports ns/op (Time), ops/s (items_per_second) and heap allocations per
+// op (allocs/op). The engine is driven through step(), which never sleeps, so the results
+// do not depend on the tick interval.
+
+// The replaced operator new/delete below are a matching malloc/free pair; GCC cannot tell
+// once they are inlined into the standard containers.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+#include <benchmark/benchmark.h>
+
+#include <cstdlib>
+#include <new>
+
+#include "state_machine/batch_sm.h"
+#include "state_machine/blackboard.h"
+#include "state_machine/loader.h"
+#include "state_machine/sm.h"
+#include "state_machine/state.h"
+
+namespace {
+
+// per thread: in multi-threaded runs every thread reports only its own allocations, which
+// Google Benchmark then sums, instead of each one reporting everybody's
+thread_local uint64_t allocations = 0;
+
+/// Counts the allocations the calling thread makes between construction and report(); create
+/// it right before the timed loop.
+class AllocationCounter {
+ public:
+  AllocationCounter() : start_(allocations) {}
+
+  void report(benchmark::State& state) {
+    state.counters["allocs/op"] = benchmark::Counter(static_cast<double>(allocations - start_),
+                                                     benchmark::Counter::kAvgIterations);
+    state.SetItemsProcessed(state.iterations());
+  }
+
+ private:
+  uint64_t start_;
+};
+
+}  // namespace
+
+void* operator new(std::size_t size) {
+  allocations++;
+  if (void* p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+namespace sm {
+
+class BenchState : public StateBase {
+ public:
+  BenchState(const std::string& id) : StateBase(id) {}
+
+  virtual void UpdateImpl() override {}
+  virtual void onEnterImpl() override {}
+  virtual void onLeaveImpl() override {}
+};
+
+/// Two states whose single event always fires: every step is a transition.
+static void BM_Transition(benchmark::State& state) {
+  StateMachineEngine engine;
+  engine.addState<BenchState>("ping");
+  engine.addState<BenchState>("pong");
+  engine.getState("ping")->registerEvent<10>("go", "pong", [] { return true; });
+  engine.getState("pong")->registerEvent<10>("go", "ping", [] { return true; });
+  engine.setInitialStateID("ping");
+  engine.step();
+
+  AllocationCounter counter;
+  for (auto _ : state) {
+    engine.spinUntilStateChange();
+  }
+  counter.report(state);
+}
+BENCHMARK(BM_Transition);
+
+/// Like BM_Transition, but the transitions are taken by posted events instead of guards.
+static void BM_PostedTransition(benchmark::State& state) {
+  StateMachineEngine engine;
+  engine.addState<BenchState>("ping");
+  engine.addState<BenchState>("pong");
+  engine.getState("ping")->registerEvent<10>("go", "pong");
+  engine.getState("pong")->registerEvent<10>("go", "ping");
+  engine.setInitialStateID("ping");
+  engine.step();
+  Handle go = engine.getEventHandle("go");
+
+  AllocationCounter counter;
+  for (auto _ : state) {
+    engine.post(go);
+    engine.step();  // takes the transition
+    engine.step();  // enters the next state
+  }
+  counter.report(state);
+}
+BENCHMARK(BM_PostedTransition);
+
+/// One state with N events that never fire: every step checks all of them.
+static void BM_CheckCondition(benchmark::State& state) {
+  StateMachineEngine engine;
+  engine.addState<BenchState>("idle");
+  auto idle = engine.getState("idle");
+  for (int64_t i = 0; i < state.range(0); i++) {
+    idle->registerEvent<10>("event_" + std::to_string(i), "idle", [] { return false; });
+  }
+  engine.setInitialStateID("idle");
+  engine.step();
+
+  AllocationCounter counter;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(engine.step());
+  }
+  counter.report(state);
+}
+BENCHMARK(BM_CheckCondition)->RangeMultiplier(4)->Range(1, 256);
+
+// The same guard three ways: "speed > 10 && (mode == 2 || !armed)".
+static void BM_GuardByKey(benchmark::State& state) {
+  auto bb = TypedBlackboard::create();
+  bb->set<double>("speed", 5.0);
+  bb->set<int32_t>("mode", 2);
+  bb->set<bool>("armed", false);
+  std::function<bool()> guard = [bb] {
+    return bb->get<double>("speed") > 10 &&
+           (bb->get<int32_t>("mode") == 2 || !bb->get<bool>("armed"));
+  };
+
+  AllocationCounter counter;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(guard());
+  }
+  counter.report(state);
+}
+BENCHMARK(BM_GuardByKey);
+
+static void BM_GuardByEntry(benchmark::State& state) {
+  auto bb = TypedBlackboard::create();
+  auto speed = bb->entry<double>("speed");
+  auto mode = bb->entry<int32_t>("mode");
+  auto armed = bb->entry<bool>("armed");
+  speed.set(5.0);
+  mode.set(2);
+  std::function<bool()> guard = [speed, mode, armed] {
+    return speed.get() > 10 && (mode.get() == 2 || !armed.get());
+  };
+
+  AllocationCounter counter;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(guard());
+  }
+  counter.report(state);
+}
+BENCHMARK(BM_GuardByEntry);
+
+static void BM_GuardExpression(benchmark::State& state) {
+  auto bb = TypedBlackboard::create();
+  bb->set<double>("speed", 5.0);
+  bb->set<int32_t>("mode", 2);
+  bb->set<bool>("armed", false);
+  auto guard = GuardExpression::compile("speed > 10 && (mode == 2 || !armed)", *bb);
+
+  AllocationCounter counter;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(guard->evaluate());
+  }
+  counter.report(state);
+}
+BENCHMARK(BM_GuardExpression);
+
+/// N separate engines with one threshold guard each, stepped one after another.
+static void BM_StepEngines(benchmark::State& state) {
+  std::vector<std::unique_ptr<StateMachineEngine>> engines;
+  for (int64_t i = 0; i < state.range(0); i++) {
+    engines.emplace_back(new StateMachineEngine());
+    auto& engine = *engines.back();
+    engine.addState<BenchState>("idle");
+    engine.addState<BenchState>("moving");
+    auto speed = engine.getTypedBlackboard()->entry<float>("speed");
+    engine.getState("idle")->registerEvent<10>("start", "moving",
+                                               [speed] { return speed.get() > 0.5f; });
+    engine.setInitialStateID("idle");
+    engine.step();
+  }
+
+  AllocationCounter counter;
+  for (auto _ : state) {
+    for (auto& engine : engines) {
+      benchmark::DoNotOptimize(engine->step());
+    }
+  }
+  counter.report(state);
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_StepEngines)->RangeMultiplier(8)->Range(8, 4096);
+
+/// The same machine as BM_StepEngines, N instances in one BatchStateMachine.
+static void BM_StepBatch(benchmark::State& state) {
+  auto definition = std::make_shared<BatchDefinition>();
+  definition->addState("idle");
+  definition->addState("moving");
+  definition->addTransition<10>("start", "idle", "moving", "speed", Compare::Greater, 0.5f);
+  BatchStateMachine batch(definition, state.range(0), "idle");
+
+  AllocationCounter counter;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(batch.step(std::chrono::milliseconds(10)));
+  }
+  counter.report(state);
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_StepBatch)->RangeMultiplier(8)->Range(8, 4096);
+
+/// A ring of N states, each with an expression guard and a deadline to the next one.
+static MachineImage ringImage(int64_t states) {
+  std::string text;
+  for (int64_t i = 0; i < states; i++) {
+    text += "state s" + std::to_string(i) + " Bench\n";
+  }
+  for (int64_t i = 0; i < states; i++) {
+    std::string from = "s" + std::to_string(i), to = "s" + std::to_string((i + 1) % states);
+    text += "transition " + from + " go " + to + " 50 if speed > " + std::to_string(i) + "\n";
+    text += "transition " + from + " timeout " + to + " 40 use deadline 1s\n";
+  }
+  return MachineImage::compile(MachineDefinition::parse(text));
+}
+
+static void BM_BuildFromImage(benchmark::State& state) {
+  MachineFactory factory;
+  factory.registerState<BenchState>("Bench");
+  auto image = ringImage(state.range(0));
+
+  AllocationCounter counter;
+  for (auto _ : state) {
+    StateMachineEngine engine;
+    factory.build(image, engine);
+    benchmark::DoNotOptimize(engine.StateNumber());
+  }
+  counter.report(state);
+}
+BENCHMARK(BM_BuildFromImage)->RangeMultiplier(8)->Range(8, 512)->Unit(benchmark::kMicrosecond);
+
+static void BM_FindStateInImage(benchmark::State& state) {
+  auto image = ringImage(state.range(0));
+  std::string id = "s" + std::to_string(state.range(0) / 2);
+
+  AllocationCounter counter;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(image.findState(id));
+  }
+  counter.report(state);
+}
+BENCHMARK(BM_FindStateInImage)->RangeMultiplier(8)->Range(8, 512);
+
+/// Create and destroy a machine of 16 states, on the heap (0) or in a MachineArena (1).
+static void BM_CreateMachine(benchmark::State& state) {
+  auto arena = state.range(0) ? MachineArena::create() : nullptr;
+  std::vector<std::string> ids;
+  for (int i = 0; i < 16; i++) {
+    ids.push_back("state_" + std::to_string(i));
+  }
+
+  AllocationCounter counter;
+  for (auto _ : state) {
+    auto engine = arena ? arena->make<StateMachineEngine>(arena)
+                        : std::make_shared<StateMachineEngine>();
+    for (const auto& id : ids) {
+      engine->addState<BenchState>(id);
+    }
+    benchmark::DoNotOptimize(engine->StateNumber());
+  }
+  counter.report(state);
+}
+BENCHMARK(BM_CreateMachine)->Arg(0)->Arg(1)->Unit(benchmark::kMicrosecond);
+
+/// The same machine stamped out from a prototype, on the heap (0) or in a MachineArena (1).
+static void BM_CloneMachine(benchmark::State& state) {
+  auto arena = state.range(0) ? MachineArena::create() : nullptr;
+  StateMachineEngine prototype;
+  for (int i = 0; i < 16; i++) {
+    prototype.addState<BenchState>("state_" + std::to_string(i));
+  }
+
+  AllocationCounter counter;
+  for (auto _ : state) {
+    auto engine = prototype.clone(arena);
+    benchmark::DoNotOptimize(engine->StateNumber());
+  }
+  counter.report(state);
+}
+BENCHMARK(BM_CloneMachine)->Arg(0)->Arg(1)->Unit(benchmark::kMicrosecond);
+
+// Shared by all threads of a run. Setup and Teardown run once per run, outside the threads.
+static std::unique_ptr<ResourceKeeper<std::string, BenchState>> keeper;
+
+static void SetupKeeper(const benchmark::State&) {
+  keeper.reset(new ResourceKeeper<std::string, BenchState>());
+  for (int i = 0; i < 64; i++) {
+    keeper->addResource<BenchState>("state_" + std::to_string(i));
+  }
+}
+
+static void TeardownKeeper(const benchmark::State&) { keeper.reset(); }
+
+static void BM_GetResourceByID(benchmark::State& state) {
+  std::string id = "state_" + std::to_string(state.thread_index() % 64);
+
+  AllocationCounter counter;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(keeper->getResource(id));
+  }
+  counter.report(state);
+}
+BENCHMARK(BM_GetResourceByID)
+    ->Setup(SetupKeeper)
+    ->Teardown(TeardownKeeper)
+    ->ThreadRange(1, 64)
+    ->UseRealTime();
+
+static void BM_GetResourceByHandle(benchmark::State& state) {
+  Handle handle = static_cast<Handle>(state.thread_index() % 64);
+
+  AllocationCounter counter;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(keeper->getResource(handle));
+  }
+  counter.report(state);
+}
+BENCHMARK(BM_GetResourceByHandle)
+    ->Setup(SetupKeeper)
+    ->Teardown(TeardownKeeper)
+    ->ThreadRange(1, 64)
+    ->UseRealTime();
+
+// Blackboards shared by all threads of a run; every thread reads and writes its own key.
+
+static BlackboardType::Ptr bt_blackboard;
+static Blackboard::Ptr sm_blackboard;
+static TypedBlackboard::SharedPtr typed_blackboard;
+
+static std::string threadKey(int index) { return "key_" + std::to_string(index); }
+
+static void SetupBlackboards(const benchmark::State& state) {
+  bt_blackboard = BlackboardType::create();
+  sm_blackboard = Blackboard::create();
+  typed_blackboard = TypedBlackboard::create();
+  for (int i = 0; i < state.threads(); i++) {
+    bt_blackboard->set<int>(threadKey(i), 0);
+    sm_blackboard->set<int>(threadKey(i), 0);
+    typed_blackboard->set<int>(threadKey(i), 0);
+  }
+}
+
+static void TeardownBlackboards(const benchmark::State&) {
+  bt_blackboard.reset();
+  sm_blackboard.reset();
+  typed_blackboard.reset();
+}
+
+static void BM_BTBlackboardGetSet(benchmark::State& state) {
+  std::string key = threadKey(state.thread_index());
+
+  AllocationCounter counter;
+  int value = 0;
+  for (auto _ : state) {
+    bt_blackboard->set<int>(key, ++value);
+    benchmark::DoNotOptimize(bt_blackboard->get<int>(key));
+  }
+  counter.report(state);
+}
+BENCHMARK(BM_BTBlackboardGetSet)
+    ->Setup(SetupBlackboards)
+    ->Teardown(TeardownBlackboards)
+    ->ThreadRange(1, 64)
+    ->UseRealTime();
+
+static void BM_SmBlackboardGetSet(benchmark::State& state) {
+  std::string key = threadKey(state.thread_index());
+
+  AllocationCounter counter;
+  int value = 0;
+  for (auto _ : state) {
+    sm_blackboard->set<int>(key, ++value);
+    benchmark::DoNotOptimize(sm_blackboard->get<int>(key));
+  }
+  counter.report(state);
+}
+BENCHMARK(BM_SmBlackboardGetSet)
+    ->Setup(SetupBlackboards)
+    ->Teardown(TeardownBlackboards)
+    ->ThreadRange(1, 64)
+    ->UseRealTime();
+
+static void BM_TypedBlackboardGetSet(benchmark::State& state) {
+  // entries are resolved once, outside the timed loop, as hot-path code would
+  Entry<int> entry = typed_blackboard->entry<int>(threadKey(state.thread_index()));
+
+  AllocationCounter counter;
+  int value = 0;
+  for (auto _ : state) {
+    entry.set(++value);
+    benchmark::DoNotOptimize(entry.get());
+  }
+  counter.report(state);
+}
+BENCHMARK(BM_TypedBlackboardGetSet)
+    ->Setup(SetupBlackboards)
+    ->Teardown(TeardownBlackboards)
+    ->ThreadRange(1, 64)
+    ->UseRealTime();
+
+}  // namespace sm
+
+int main(int argc, char** argv) {
+  // measure the engine, not the formatting of its log records
+  sm::logging::Logger::instance().setLevel(sm::LogLevel::Warn);
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+
+namespace sm {
+
+/**
+ * @brief Pooled memory for the engines, states and events of many machines.
+ *
+ *   auto arena = MachineArena::create();
+ *   auto engine = arena->make<StateMachineEngine>(arena);
+ *
+ * Blocks are kept in pools by size and reused once freed, so creating and destroying
+ * machines of the same shape stops reaching the system allocator after the first few, and
+ * the objects of one machine are carved from the same chunks. Everything allocated from
+ * the arena keeps it alive, so it may be dropped before them. Thread-safe.
+ */
+class MachineArena : public std::enable_shared_from_this<MachineArena> {
+ public:
+  typedef std::shared_ptr<MachineArena> SharedPtr;
+
+  /// Allocator over the arena, for std::allocate_shared and containers.
+  template <typename T>
+  class Allocator {
+   public:
+    typedef T value_type;
+
+    explicit Allocator(SharedPtr arena) : arena_(std::move(arena)) {}
+
+    template <typename U>
+    Allocator(const Allocator<U>& other) : arena_(other.arena()) {}
+
+    T* allocate(size_t n) {
+      std::lock_guard<std::mutex> lock(arena_->mtx_);
+      return static_cast<T*>(arena_->pool_.allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, size_t n) {
+      std::lock_guard<std::mutex> lock(arena_->mtx_);
+      arena_->pool_.deallocate(p, n * sizeof(T), alignof(T));
+    }
+
+    inline const SharedPtr& arena() const { return arena_; }
+
+    template <typename U>
+    bool operator==(const Allocator<U>& other) const { return arena_ == other.arena(); }
+
+    template <typename U>
+    bool operator!=(const Allocator<U>& other) const { return arena_ != other.arena(); }
+
+   private:
+    SharedPtr arena_;
+  };
+
+  static SharedPtr create() { return SharedPtr(new MachineArena()); }
+
+  MachineArena(const MachineArena&) = delete;
+  MachineArena& operator=(const MachineArena&) = delete;
+
+  /// Construct a T and its reference count in one block of the arena.
+  template <typename T, typename... Args>
+  std::shared_ptr<T> make(Args&&... args) {
+    return std::allocate_shared<T>(Allocator<T>(shared_from_this()),
+                                   std::forward<Args>(args)...);
+  }
+
+ private:
+  MachineArena() = default;
+
+  std::mutex mtx_;
+  std::pmr::unsynchronized_pool_resource pool_;
+};
+
+}  // namespace sm
@@ -0,0 +1,135 @@
+#pragma once
+
+#include "state_machine/util.h"
+#include "state_machine/exception.h"
+#include "state_machine/event.h"
+
+namespace sm {
+
+enum class Compare : uint8_t { Less, LessEqual, Greater, GreaterEqual, Equal, NotEqual };
+
+/**
+ * @brief States, numeric inputs and threshold transitions of a BatchStateMachine.
+ *
+ * A definition is built once and shared by any number of batches. Every transition
+ * compares one input against a constant; the seconds spent in the current state are the
+ * built-in input "elapsed", so timeouts are transitions on it as well.
+ */
+class BatchDefinition {
+ public:
+  typedef std::shared_ptr<BatchDefinition> SharedPtr;
+
+  static constexpr Handle kElapsed = 0;
+
+  struct Row {
+    Handle from, to, input, event;
+    Compare op;
+    float threshold;
+    Priority priority;
+  };
+
+  BatchDefinition();
+
+  Handle addState(const std::string& name) { return states_->intern(name); }
+
+  Handle addInput(const std::string& name) { return inputs_->intern(name); }
+
+  /**
+   * @brief Leave from for to once input op threshold holds. Among the transitions that
+   * hold, the one with the highest priority is taken; ties keep registration order.
+   */
+  template <int priority>
+  void addTransition(const std::string& event, const std::string& from, const std::string& to,
+                     const std::string& input, Compare op, float threshold) {
+    static_assert((priority >= 0) && (priority <= 100),
+                  "Priority should be int type with value in range [0, 100]");
+    addRow(event, from, to, input, op, threshold, priority);
+  }
+
+  /// Leave from for to after timeout in it.
+  template <int priority>
+  void addTimeout(const std::string& event, const std::string& from, const std::string& to,
+                  const DurationType& timeout) {
+    addTransition<priority>(event, from, to, "elapsed", Compare::GreaterEqual,
+                            std::chrono::duration<float>(timeout).count());
+  }
+
+  inline const NameTable::SharedPtr& getStateIdTable() const { return states_; }
+  inline const NameTable::SharedPtr& getInputIdTable() const { return inputs_; }
+  inline const NameTable::SharedPtr& getEventIdTable() const { return events_; }
+
+  /// Transitions sorted by descending priority.
+  inline const std::vector<Row>& rows() const { return rows_; }
+
+ private:
+  void addRow(const std::string& event, const std::string& from, const std::string& to,
+              const std::string& input, Compare op, float threshold, Priority priority);
+
+  NameTable::SharedPtr states_, inputs_, events_;
+  std::vector<Row> rows_;
+};
+
+/**
+ * @brief Many instances of one BatchDefinition, stepped together.
+ *
+ * Instance data is kept in struct-of-arrays form: one array of current states, one of
+ * seconds in state and one per input, each indexed by instance. step() walks the
+ * transition table once and, per transition, runs a branchless loop over the contiguous
+ * arrays that the compiler turns into SIMD code, instead of chasing one state object per
+ * instance. Each instance takes at most one transition per step, like
+ * StateMachineEngine::step().
+ */
+class BatchStateMachine {
+ public:
+  typedef std::shared_ptr<BatchStateMachine> SharedPtr;
+
+  /// size instances, all in initial_state.
+  BatchStateMachine(const BatchDefinition::SharedPtr& definition, size_t size,
+                    const std::string& initial_state);
+
+  inline size_t size() const { return states_.size(); }
+
+  inline Handle getState(size_t instance) const { return states_[instance]; }
+
+  inline const std::string& getStateID(size_t instance) const {
+    return definition_->getStateIdTable()->name(states_[instance]);
+  }
+
+  void setState(size_t instance, const std::string& state_id);
+
+  /// Contiguous values of input for all instances; write them in place between steps.
+  float* input(const std::string& input);
+
+  inline void setInput(size_t instance, Handle input, float value) {
+    inputs_[input][instance] = value;
+  }
+
+  /// Seconds instance has spent in its current state.
+  inline float getElapsed(size_t instance) const {
+    return inputs_[BatchDefinition::kElapsed][instance];
+  }
+
+  /**
+   * @brief Advance every instance by dt, then take the first transition that holds.
+   * @return the number of instances that changed state; see changed().
+   */
+  size_t step(const DurationType& dt);
+
+  /// Instances that changed state in the latest step(), in ascending order.
+  inline const std::vector<uint32_t>& changed() const { return changed_; }
+
+  /// Event that moved instance in the latest step(), kInvalidHandle if it stayed.
+  inline Handle getTriggerEvent(size_t instance) const { return fired_[instance]; }
+
+ private:
+  void addColumns();
+
+  BatchDefinition::SharedPtr definition_;
+  std::vector<Handle> states_;
+  std::vector<Handle> fired_;               // row event taken per instance in this step
+  std::vector<Handle> next_;                // row target taken per instance in this step
+  std::vector<std::vector<float>> inputs_;  // one column per input, elapsed first
+  std::vector<uint32_t> changed_;
+};
+
+}  // namespace sm
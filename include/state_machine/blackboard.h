@@ -13,6 +13,9 @@
 
 #include <behaviortree_cpp_v3/blackboard.h>
 
+#include "state_machine/exception.h"
+#include "state_machine/typed_blackboard.h"
+
 namespace sm {
 
 using Any = BT::Any;
@@ -29,7 +32,7 @@ class Blackboard {
   /** Use this static method to create an instance of the BlackBoard
    *   to share among all your NodeTrees.
    */
-  static Blackboard::Ptr create() { return std::shared_ptr<Blackboard>(); }
+  static Blackboard::Ptr create() { return std::shared_ptr<Blackboard>(new Blackboard()); }
 
   virtual ~Blackboard() = default;
 
@@ -58,7 +61,7 @@ class Blackboard {
   bool get(const std::string& key, T& value) const {
     const Any* val = getAny(key);
     if (val) {
-      value = std::any_cast<T>(*val);
+      value = val->cast<T>();
     }
     return (bool)val;
   }
@@ -70,34 +73,29 @@ class Blackboard {
   T get(const std::string& key) const {
     const Any* val = getAny(key);
     if (val) {
-      return std::any_cast<T>(*val);
-    } else {
-      // throw RuntimeError("Blackboard::get() error. Missing key [", key, "]");
+      return val->cast<T>();
     }
+    throw RuntimeError("Blackboard::get() error. Missing key [" + key + "]");
   }
 
   /// Update the entry with the given key
   template <typename T>
   void set(const std::string& key, const T& value) {
-      std::cout << "!!!" << std::endl;
     std::unique_lock<std::mutex> lock(mutex_);
-      std::cout << "!!!" << std::endl;
     const auto& it = storage_.find(key);
-      std::cout << "!!" << std::endl;
 
     if (it != storage_.end())  // already there. check the type
     {
-      std::cout << "2" << std::endl;
       auto& previous_any = it->second;
       Any temp(value);
       previous_any = std::move(temp);
     } else {  // create for the first time without any info
-      std::cout << "1" << std::endl;
       storage_.emplace(key, value);
     }
   }
 
   std::vector<std::string_view> getKeys() const {
+    std::unique_lock<std::mutex> lock(mutex_);
     if (storage_.empty()) {
       return {};
     }
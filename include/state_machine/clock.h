@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+
+#include "state_machine/signal.h"
+#include "state_machine/util.h"
+
+namespace sm {
+
+/**
+ * @brief Source of time for an engine, its states and their events.
+ *
+ * Everything that decides when something happens (time in state, timeouts, timers, tick
+ * deadlines, `elapsed` in guard expressions) reads now() and waits through sleepUntil().
+ * Metrics keep measuring on the steady clock, since they time the code, not the machine.
+ * The Executor schedules engines on the steady clock as well.
+ */
+class Clock {
+ public:
+  typedef std::shared_ptr<Clock> SharedPtr;
+
+  virtual ~Clock() = default;
+
+  virtual TimePoint now() const = 0;
+
+  /// Block until deadline, or until wakeup (if not nullptr) is notified.
+  virtual void sleepUntil(const TimePoint& deadline, WakeupSignal* wakeup) = 0;
+
+  /// The shared SteadyClock used when no clock is set.
+  static const SharedPtr& steady();
+};
+
+/// std::chrono::steady_clock.
+class SteadyClock final : public Clock {
+ public:
+  TimePoint now() const override { return std::chrono::steady_clock::now(); }
+
+  void sleepUntil(const TimePoint& deadline, WakeupSignal* wakeup) override {
+    if (wakeup) {
+      wakeup->waitUntil(deadline);
+    } else {
+      std::this_thread::sleep_until(deadline);
+    }
+  }
+};
+
+inline const Clock::SharedPtr& Clock::steady() {
+  static const SharedPtr clock = std::make_shared<SteadyClock>();
+  return clock;
+}
+
+/**
+ * @brief Simulated time that only moves when told to.
+ *
+ * sleepUntil() jumps straight to the deadline instead of waiting, so an engine spun on a
+ * VirtualClock runs from one deadline to the next as fast as its states allow, with the
+ * same result every run. A notification pending on the wakeup signal returns it without
+ * moving time. Time never goes backwards.
+ */
+class VirtualClock final : public Clock {
+ public:
+  typedef std::shared_ptr<VirtualClock> SharedPtr;
+
+  explicit VirtualClock(const TimePoint& start = TimePoint())
+      : ticks_(start.time_since_epoch().count()) {}
+
+  TimePoint now() const override {
+    return TimePoint(TimePoint::duration(ticks_.load(std::memory_order_acquire)));
+  }
+
+  void sleepUntil(const TimePoint& deadline, WakeupSignal* wakeup) override {
+    if (wakeup && wakeup->waitUntil(TimePoint::min())) {
+      return;
+    }
+    advanceTo(deadline);
+  }
+
+  void advance(const DurationType& duration) { advanceTo(now() + duration); }
+
+  /// Move to time unless it is in the past.
+  void advanceTo(const TimePoint& time) {
+    auto target = time.time_since_epoch().count();
+    auto current = ticks_.load(std::memory_order_relaxed);
+    while (current < target &&
+           !ticks_.compare_exchange_weak(current, target, std::memory_order_acq_rel)) {
+    }
+  }
+
+ private:
+  std::atomic<TimePoint::rep> ticks_;
+};
+
+}  // namespace sm
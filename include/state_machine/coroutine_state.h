@@ -0,0 +1,193 @@
+#pragma once
+
+#include "state_machine/state.h"
+
+// Header-only: the library itself is built as C++17, code that includes this header must
+// enable C++20 coroutines on its own.
+#if !defined(__cpp_impl_coroutine) || !__has_include(<coroutine>)
+#error "state_machine/coroutine_state.h needs C++20 coroutines, build with -std=c++20"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <future>
+
+namespace sm {
+
+/// Return type of CoroutineState::run().
+class StateTask {
+ public:
+  struct promise_type {
+    std::exception_ptr error;
+
+    StateTask get_return_object() {
+      return StateTask(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { error = std::current_exception(); }
+  };
+
+  StateTask() = default;
+  explicit StateTask(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+  StateTask(StateTask&& other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+  StateTask& operator=(StateTask&& other) noexcept {
+    if (this != &other) {
+      reset();
+      handle_ = std::exchange(other.handle_, {});
+    }
+    return *this;
+  }
+  StateTask(const StateTask&) = delete;
+  StateTask& operator=(const StateTask&) = delete;
+  ~StateTask() { reset(); }
+
+  inline bool valid() const { return static_cast<bool>(handle_); }
+  inline bool done() const { return handle_ && handle_.done(); }
+
+  /// Run the body up to its next co_await; rethrow what escaped from it.
+  void resume() {
+    handle_.resume();
+    if (handle_.promise().error) {
+      std::rethrow_exception(std::exchange(handle_.promise().error, nullptr));
+    }
+  }
+
+  void reset() {
+    if (handle_) {
+      handle_.destroy();
+      handle_ = {};
+    }
+  }
+
+ private:
+  std::coroutine_handle<promise_type> handle_;
+};
+
+/**
+ * @brief State whose update is a coroutine that can wait without blocking the tick loop.
+ *
+ *   StateTask run() override {
+ *     co_await sleepFor(std::chrono::milliseconds(100));
+ *     co_await changed(goal_);              // a TypedBlackboard Entry
+ *     auto path = co_await result(planned_);  // a std::future
+ *     ...
+ *   }
+ *
+ * run() starts on the first tick after the state is entered. While it waits, each tick
+ * only checks whether the awaited thing is ready, one inline call, and resumes the body
+ * when it is; events are checked as usual. Sleeps are timers in the engine's timing wheel
+ * and blackboard writes wake the engine, so in event-driven mode a waiting state costs
+ * nothing between wakeups. Leaving the state destroys the coroutine wherever it is. Once
+ * run() returns, finished() is true; register an event on it to move on.
+ */
+class CoroutineState : public StateBase {
+ public:
+  CoroutineState(const std::string& id) : StateBase(id), timer_(kInvalidTimer) {}
+  virtual ~CoroutineState() { cancelTimer(); }
+
+  /// True once run() returned during the current visit.
+  inline bool finished() const { return task_.done(); }
+
+ protected:
+  /// Suspends the coroutine until ready() is true.
+  struct Awaiter {
+    CoroutineState* state;
+    Guard ready;
+
+    bool await_ready() { return ready(); }
+    void await_suspend(std::coroutine_handle<>) { state->ready_ = std::move(ready); }
+    void await_resume() {}
+  };
+
+  template <typename T>
+  struct FutureAwaiter {
+    CoroutineState* state;
+    std::future<T>* future;
+
+    bool await_ready() const { return isReady(future); }
+    void await_suspend(std::coroutine_handle<>) {
+      auto f = future;
+      state->ready_ = Guard([f]() { return isReady(f); });
+    }
+    T await_resume() { return future->get(); }
+
+    static bool isReady(std::future<T>* f) {
+      return f->wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+  };
+
+  /// The state's work; runs across ticks, suspended at every co_await.
+  virtual StateTask run() = 0;
+
+  /// Hooks around a visit, after the coroutine is created and before it is destroyed.
+  virtual void onStart() {}
+  virtual void onStop() {}
+
+  Awaiter sleepFor(const DurationType& duration) {
+    auto deadline = clock_->now() + duration;
+    if (timers_) {
+      // only wakes the engine in time; readiness is the deadline itself
+      cancelTimer();
+      timer_ = timers_->schedule(deadline, &CoroutineState::expire, this);
+    }
+    return Awaiter{this, Guard([this, deadline]() { return clock_->now() >= deadline; })};
+  }
+
+  /// Wait until condition is true; it is checked once per tick.
+  Awaiter waitUntil(Guard condition) { return Awaiter{this, std::move(condition)}; }
+
+  /// Wait for the next write to entry.
+  template <typename T>
+  Awaiter changed(const Entry<T>& entry) {
+    uint64_t version = entry.version();
+    return Awaiter{this, Guard([entry, version]() { return entry.version() != version; })};
+  }
+
+  /// Wait for future and return its value. The producer should call notify() when done
+  /// to resume the state without waiting for the next tick.
+  template <typename T>
+  FutureAwaiter<T> result(std::future<T>& future) {
+    return FutureAwaiter<T>{this, &future};
+  }
+
+  void onEnterImpl() final {
+    task_ = run();
+    ready_ = Guard();
+    onStart();
+  }
+
+  void UpdateImpl() final {
+    if (!task_.valid() || task_.done() || (ready_ && !ready_())) {
+      return;
+    }
+    ready_ = Guard();
+    task_.resume();
+  }
+
+  void onLeaveImpl() final {
+    onStop();
+    cancelTimer();
+    ready_ = Guard();
+    task_.reset();
+  }
+
+ private:
+  static void expire(void* context) {
+    static_cast<CoroutineState*>(context)->timer_ = kInvalidTimer;
+  }
+
+  void cancelTimer() {
+    if (timers_ && timer_ != kInvalidTimer) {
+      timers_->cancel(timer_);
+    }
+    timer_ = kInvalidTimer;
+  }
+
+  StateTask task_;
+  Guard ready_;  // what the coroutine waits for, empty to resume on the next tick
+  TimerId timer_;
+};
+
+}  // namespace sm
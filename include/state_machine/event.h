@@ -4,6 +4,9 @@
 #include "state_machine/util.h"
 #include "state_machine/exception.h"
 #include "state_machine/blackboard.h"
+#include "state_machine/clock.h"
+#include "state_machine/signal.h"
+#include "state_machine/timing_wheel.h"
 
 namespace sm {
 
@@ -12,18 +15,92 @@ using BlackboardType = BT::Blackboard;
 typedef std::function<bool()> EventFunction;
 typedef uint16_t Priority;
 
+class StateBase;
+
 class EventBase {
  public:
   EventBase();
   virtual ~EventBase() = default;
   inline void setBlackBoard(const BlackboardType::Ptr& blackboard) { blackboard_ = blackboard; }
+  inline void setTypedBlackboard(const TypedBlackboard::SharedPtr& blackboard) {
+    typed_blackboard_ = blackboard;
+  }
+  inline void setWakeupSignal(const WakeupSignal::SharedPtr& wakeup) { wakeup_ = wakeup; }
+  inline void setTimingWheel(const TimingWheel::SharedPtr& timers) { timers_ = timers; }
+  inline void setClock(const Clock::SharedPtr& clock) { clock_ = clock; }
+  /// Raised by invalidate(), so the owning state checks its events again.
+  inline void setDirtyFlag(const DirtyFlag& dirty) { dirty_ = dirty; }
   virtual bool update();
 
+  /// Unique among the events of the process, assigned in construction order.
+  inline uint64_t getId() const { return id_; }
+
+  /// Wake the owning state so update() is evaluated without waiting for the next tick.
+  void notify();
+
+  /**
+   * @brief Declare the TypedBlackboard keys update() reads. update() is then called again
+   * only after one of them was written or invalidate() was called; otherwise the owning
+   * state reuses its last result.
+   */
+  void dependsOn(const std::vector<std::string>& keys);
+
+  inline bool isTracked() const { return tracked_; }
+  inline const std::vector<std::string>& getInputs() const { return inputs_; }
+  inline uint64_t getRevision() const { return revision_; }
+
  protected:
+  /// Make the next check call update() again, e.g. when a timer changed its result.
+  inline void invalidate() {
+    revision_++;
+    if (dirty_) {
+      dirty_->store(true, std::memory_order_release);
+    }
+  }
+
+  // called by the owning state when it is entered and left
+  friend class StateBase;
   virtual void onStart();
   virtual void onLeave();
-  std::string uuid_;
+  /// After onStart(), when a restored state continues a visit that began at entered.
+  virtual void onResume(const TimePoint& entered);
+  uint64_t id_;
   BlackboardType::Ptr blackboard_;
+  TypedBlackboard::SharedPtr typed_blackboard_;
+  WakeupSignal::SharedPtr wakeup_;
+  TimingWheel::SharedPtr timers_;
+  Clock::SharedPtr clock_;  // the owning state's, the steady clock until registered
+  DirtyFlag dirty_;
+  bool tracked_;
+  std::vector<std::string> inputs_;
+  uint64_t revision_;
+};
+
+/**
+ * @brief Fires once timeout has elapsed since the owning state was entered.
+ *
+ * The expiry is registered once in the engine's timing wheel, so update() reads a flag
+ * instead of the clock and the engine knows exactly when to wake up. It depends on no
+ * blackboard key: update() runs again only once the timer expired.
+ */
+class DeadlineEvent : public EventBase {
+ public:
+  explicit DeadlineEvent(const DurationType& timeout);
+  virtual ~DeadlineEvent();
+
+  bool update() override;
+
+  void onStart() override;
+  void onLeave() override;
+  void onResume(const TimePoint& entered) override;
+
+ private:
+  static void expire(void* context);
+
+  DurationType timeout_;
+  TimePoint start_;
+  TimerId timer_;
+  bool fired_;
 };
 
 }  // namespace sm
\ No newline at end of file
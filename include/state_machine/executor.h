@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <queue>
+
+#include "state_machine/sm.h"
+
+namespace sm {
+
+/**
+ * @brief Runs many StateMachineEngines on a fixed pool of worker threads.
+ *
+ * Each worker owns a run queue of engines that are due and a heap of sleeping engines
+ * ordered by the deadline step() returned. An engine is woken early when its WakeupSignal
+ * is notified. Idle workers steal due engines from the other queues, so a few threads can
+ * serve hundreds of machines.
+ */
+class Executor {
+ public:
+  typedef std::shared_ptr<Executor> SharedPtr;
+
+  /// pin_workers binds worker i to CPU i modulo the number of CPUs.
+  explicit Executor(size_t threads = std::max(1u, std::thread::hardware_concurrency()),
+                    bool pin_workers = false);
+  virtual ~Executor();
+
+  Executor(const Executor&) = delete;
+  Executor& operator=(const Executor&) = delete;
+
+  /// Schedule engine; it is stepped as soon as a worker is free.
+  void add(const StateMachineEngine::SharedPtr& engine);
+
+  /// Launch the workers. Throws RuntimeError if they were to be pinned and cannot be.
+  void start();
+
+  /// Stop and join the workers. Engines keep their state and can be started again.
+  void stop();
+
+  inline size_t WorkerNumber() const { return workers_.size(); }
+
+  size_t EngineNumber() const;
+
+ private:
+  enum Status : int { kReady = 0, kRunning = 1, kRunningNotified = 2, kSleeping = 3 };
+
+  struct Task {
+    StateMachineEngine::SharedPtr engine;
+    Executor* executor;
+    std::atomic<int> status;
+    std::atomic<size_t> home;      // worker whose queues hold the task
+    std::atomic<uint64_t> epoch;   // bumped on every sleep, stale heap entries are skipped
+  };
+
+  struct Sleeper {
+    TimePoint deadline;
+    Task* task;
+    uint64_t epoch;
+    bool operator>(const Sleeper& other) const { return deadline > other.deadline; }
+  };
+
+  struct Worker {
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<Task*> ready;
+    std::priority_queue<Sleeper, std::vector<Sleeper>, std::greater<Sleeper>> sleepers;
+    std::thread thread;
+    bool idle = false;
+    bool poked = false;
+  };
+
+  static void wake(void* context);
+  void run(size_t index);
+  void execute(Task* task, size_t index);
+  Task* steal(size_t index);
+  void pushReady(Task* task, size_t index, bool front);
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::unique_ptr<Task>> tasks_;
+  mutable std::mutex tasks_mtx_;
+  std::atomic<bool> running_;
+  std::atomic<int> idle_workers_;
+  size_t next_worker_;
+  bool pin_workers_;
+};
+
+}  // namespace sm
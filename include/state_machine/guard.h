@@ -0,0 +1,155 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace sm {
+
+namespace detail {
+
+template <typename T>
+struct IsStdFunction : std::false_type {};
+
+template <typename R, typename... Args>
+struct IsStdFunction<std::function<R(Args...)>> : std::true_type {};
+
+}  // namespace detail
+
+/**
+ * @brief Type-erased bool() callable stored inline, never on the heap.
+ *
+ * A Guard holds a lambda, function pointer, std::bind result or std::function of at most
+ * kCapacity bytes in its own buffer and calls it through one plain function pointer.
+ * Invoking it never copies or allocates. Trivially copyable callables (stateless lambdas,
+ * lambdas capturing pointers, function pointers) are copied with memcpy.
+ *
+ * Guard::bind<&Class::method>(object) calls a member function with the method fixed at
+ * compile time, so the call is direct (and inlinable) instead of through a member pointer.
+ */
+class Guard {
+ public:
+  static constexpr size_t kCapacity = 48;
+
+  Guard() noexcept : invoke_(nullptr), manage_(nullptr) {}
+
+  template <typename F, typename Callable = std::decay_t<F>,
+            typename = std::enable_if_t<!std::is_same<Callable, Guard>::value &&
+                                        std::is_invocable_r<bool, Callable&>::value>>
+  Guard(F&& f) : Guard() {
+    static_assert(sizeof(Callable) <= kCapacity,
+                  "guard does not fit the inline buffer, capture by reference or pointer");
+    static_assert(alignof(Callable) <= alignof(std::max_align_t), "over-aligned guard");
+    if constexpr (std::is_pointer<Callable>::value || detail::IsStdFunction<Callable>::value) {
+      if (!f) {
+        return;
+      }
+    }
+    ::new (static_cast<void*>(storage_)) Callable(std::forward<F>(f));
+    invoke_ = [](void* storage) -> bool { return (*static_cast<Callable*>(storage))(); };
+    if constexpr (!std::is_trivially_copyable<Callable>::value) {
+      manage_ = &manage<Callable>;
+    }
+  }
+
+  /// Call method on object, e.g. Guard::bind<&MyState::isReady>(this).
+  template <auto Method, typename C>
+  static Guard bind(C* object) {
+    static_assert(std::is_member_function_pointer<decltype(Method)>::value,
+                  "Method must be a pointer to member function");
+    Guard guard;
+    std::memcpy(guard.storage_, &object, sizeof(object));
+    guard.invoke_ = [](void* storage) -> bool {
+      C* self;
+      std::memcpy(&self, storage, sizeof(self));
+      return (self->*Method)();
+    };
+    return guard;
+  }
+
+  Guard(const Guard& other) : invoke_(other.invoke_), manage_(other.manage_) {
+    copyFrom(other);
+  }
+
+  Guard(Guard&& other) noexcept : invoke_(other.invoke_), manage_(other.manage_) {
+    moveFrom(other);
+  }
+
+  Guard& operator=(const Guard& other) {
+    if (this != &other) {
+      clear();
+      invoke_ = other.invoke_;
+      manage_ = other.manage_;
+      copyFrom(other);
+    }
+    return *this;
+  }
+
+  Guard& operator=(Guard&& other) noexcept {
+    if (this != &other) {
+      clear();
+      invoke_ = other.invoke_;
+      manage_ = other.manage_;
+      moveFrom(other);
+    }
+    return *this;
+  }
+
+  ~Guard() { clear(); }
+
+  explicit operator bool() const { return invoke_ != nullptr; }
+
+  /// Evaluate the guard. Must not be called on an empty Guard.
+  inline bool operator()() { return invoke_(storage_); }
+
+ private:
+  enum class Op { Copy, Move, Destroy };
+
+  template <typename Callable>
+  static void manage(Op op, void* self, void* other) {
+    switch (op) {
+      case Op::Copy:
+        ::new (self) Callable(*static_cast<const Callable*>(other));
+        break;
+      case Op::Move:
+        ::new (self) Callable(std::move(*static_cast<Callable*>(other)));
+        break;
+      case Op::Destroy:
+        static_cast<Callable*>(self)->~Callable();
+        break;
+    }
+  }
+
+  void copyFrom(const Guard& other) {
+    if (manage_) {
+      manage_(Op::Copy, storage_, const_cast<unsigned char*>(other.storage_));
+    } else if (invoke_) {
+      std::memcpy(storage_, other.storage_, kCapacity);
+    }
+  }
+
+  void moveFrom(Guard& other) {
+    if (manage_) {
+      manage_(Op::Move, storage_, other.storage_);
+    } else if (invoke_) {
+      std::memcpy(storage_, other.storage_, kCapacity);
+    }
+  }
+
+  void clear() {
+    if (manage_) {
+      manage_(Op::Destroy, storage_, nullptr);
+    }
+    invoke_ = nullptr;
+    manage_ = nullptr;
+  }
+
+  alignas(std::max_align_t) unsigned char storage_[kCapacity];
+  bool (*invoke_)(void* storage);
+  void (*manage_)(Op op, void* self, void* other);
+};
+
+}  // namespace sm
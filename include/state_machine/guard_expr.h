@@ -0,0 +1,96 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "state_machine/clock.h"
+#include "state_machine/exception.h"
+#include "state_machine/typed_blackboard.h"
+
+namespace sm {
+
+/**
+ * @brief Guard written as an expression over TypedBlackboard entries, compiled to bytecode.
+ *
+ *   speed > 10.0 && (mode == 2 || !armed) && elapsed >= 1.5
+ *
+ * Supported are numbers, true and false, entry keys, `elapsed` (seconds since the owning
+ * state was entered), the arithmetic operators + - * /, comparisons < <= > >= == !=, and
+ * ! && || with short-circuit evaluation. All values are doubles; a guard fires when the
+ * result is not zero.
+ *
+ * Keys are resolved to their slots once, at compile time; a key without an entry gets a
+ * double entry. Entries of type double, float, bool and the 8 to 64 bit integers can be
+ * read. Constant subexpressions are folded, so `speed > 2 * 5` compiles to one comparison.
+ */
+class GuardExpression {
+ public:
+  typedef std::shared_ptr<const GuardExpression> SharedPtr;
+  using TimePoint = std::chrono::steady_clock::time_point;
+
+  /**
+   * @brief Compile source against blackboard. since is the time `elapsed` counts from and
+   * has to outlive the expression; it may be nullptr if source does not use `elapsed`,
+   * which is read from clock (the steady clock if nullptr).
+   * Throws LogicError on a syntax error, an unsupported entry type or a missing since.
+   */
+  static SharedPtr compile(const std::string& source, TypedBlackboard& blackboard,
+                           const TimePoint* since = nullptr,
+                           const Clock::SharedPtr& clock = nullptr);
+
+  bool evaluate() const;
+
+  inline bool operator()() const { return evaluate(); }
+
+  inline const std::string& source() const { return source_; }
+
+  /// Keys of the entries the expression reads, in order of first use.
+  inline const std::vector<std::string>& inputs() const { return inputs_; }
+
+  /// True if the result depends on time through `elapsed`, not only on inputs().
+  inline bool usesElapsed() const { return uses_elapsed_; }
+
+  /// The compiled bytecode, one instruction per line.
+  std::string disassemble() const;
+
+  enum class Op : uint8_t {
+    kConst,
+    kLoadDouble, kLoadFloat, kLoadBool,
+    kLoadInt8, kLoadInt16, kLoadInt32, kLoadInt64,
+    kLoadUInt8, kLoadUInt16, kLoadUInt32, kLoadUInt64,
+    kElapsed,
+    kNeg, kNot,
+    kAdd, kSub, kMul, kDiv,
+    kLess, kLessEqual, kGreater, kGreaterEqual, kEqual, kNotEqual,
+    kJumpIfFalse,  // keep the top if it is false and jump, pop it otherwise
+    kJumpIfTrue,   // keep the top if it is true and jump, pop it otherwise
+  };
+
+  struct Instruction {
+    Op op;
+    bool immediate;   // binary operators: the right operand is constant, not on the stack
+    uint32_t target;  // jumps only
+    union {
+      double constant;
+      const SlotBase* slot;
+    };
+  };
+
+  static constexpr size_t kMaxDepth = 32;
+
+ private:
+  friend class ExpressionCompiler;
+
+  GuardExpression() : since_(nullptr), uses_elapsed_(false) {}
+
+  std::string source_;
+  std::vector<Instruction> code_;
+  std::vector<std::string> inputs_;
+  const TimePoint* since_;
+  Clock::SharedPtr clock_;
+  bool uses_elapsed_;
+};
+
+}  // namespace sm
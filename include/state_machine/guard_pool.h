@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sm {
+
+/**
+ * @brief True while the calling guard runs on a GuardPool and a higher priority guard of
+ * the same check has already fired. Long guards may poll it and return early.
+ */
+bool guardCancelled();
+
+/**
+ * @brief Worker threads that evaluate the guards of one state concurrently.
+ *
+ * Guards are claimed in priority order by the workers and by the calling thread. The
+ * result is the same as checking them one after another: the first guard, in priority
+ * order, that returns true. Once a guard fires, guards after it are not started any more,
+ * and the ones still running can see guardCancelled(). evaluate() returns only after every
+ * started guard has finished, so guards never outlive the check that started them.
+ */
+class GuardPool {
+ public:
+  typedef std::shared_ptr<GuardPool> SharedPtr;
+  typedef bool (*Evaluator)(void* context, size_t index);
+
+  /// State of one evaluate() call; reuse it across calls to avoid allocating.
+  class Batch {
+   public:
+    Batch() : size_(0), evaluate_(nullptr), context_(nullptr), next_(0), cutoff_(0), joined_(0) {}
+
+   private:
+    friend class GuardPool;
+    enum Result : uint8_t { kPending = 0, kFalse = 1, kTrue = 2 };
+
+    void reset(size_t size, Evaluator evaluate, void* context);
+    void drain();
+    bool waitFor(size_t index);
+
+    size_t size_;
+    Evaluator evaluate_;
+    void* context_;
+    std::atomic<size_t> next_;    // next guard to claim
+    std::atomic<size_t> cutoff_;  // lowest index known to have fired, size_ if none
+    std::atomic<int> joined_;     // workers currently helping
+    std::unique_ptr<std::atomic<uint8_t>[]> results_;
+    size_t capacity_ = 0;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+  };
+
+  explicit GuardPool(size_t threads = std::max(1u, std::thread::hardware_concurrency()));
+  virtual ~GuardPool();
+
+  GuardPool(const GuardPool&) = delete;
+  GuardPool& operator=(const GuardPool&) = delete;
+
+  /**
+   * @brief Call evaluate(context, i) for the guards i in [0, size), which are in priority
+   * order. Return the index of the first one that is true, or -1 if none is.
+   */
+  int evaluate(Batch& batch, size_t size, Evaluator evaluate, void* context);
+
+  inline size_t WorkerNumber() const { return threads_.size(); }
+
+ private:
+  void run();
+
+  std::vector<std::thread> threads_;
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  std::deque<Batch*> requests_;  // one entry per worker asked to help
+  bool running_;
+};
+
+}  // namespace sm
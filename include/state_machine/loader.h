@@ -0,0 +1,149 @@
+#pragma once
+
+#include <string_view>
+
+#include "state_machine/sm.h"
+
+namespace sm {
+
+/**
+ * @brief A machine definition as written in a text file.
+ *
+ *   # comments run to the end of the line
+ *   state idle Idle
+ *   state active Idle
+ *   state moving Drive active                      # optional parent state
+ *   initial idle
+ *   transition idle start moving 50 if speed > 1 && armed
+ *   transition moving stop idle 40 use deadline 2s
+ *
+ * `state <id> <type> [parent]` adds a state whose class is registered under type in a
+ * MachineFactory. `transition <from> <event> <to> <priority>` adds an event to from, with
+ * either a GuardExpression after `if` or an event class registered in the factory after
+ * `use`, followed by an optional argument for it.
+ */
+struct MachineDefinition {
+  struct State {
+    std::string id, type, parent;
+  };
+
+  struct Transition {
+    std::string from, event, to;
+    Priority priority;
+    std::string expression;           // guard expression, empty for class events
+    std::string event_type, argument;  // class event from the factory
+  };
+
+  std::vector<State> states;
+  std::vector<Transition> transitions;
+  std::string initial;
+
+  /// Throws LogicError naming the line of the first error.
+  static MachineDefinition parse(const std::string& text);
+};
+
+/**
+ * @brief Precompiled, memory-mappable form of a MachineDefinition.
+ *
+ * States and transitions are fixed-size records that refer to each other by index, and
+ * all names live in one string table, so nothing is parsed or hashed at load time. State
+ * names are found through a perfect hash stored in the image: findState() costs one hash,
+ * two array reads and one string compare.
+ */
+class MachineImage {
+ public:
+  struct StateView {
+    std::string_view id, type;
+    Handle parent;  // index of the parent state, kInvalidHandle if none
+  };
+
+  struct TransitionView {
+    Handle from, to;
+    Priority priority;
+    std::string_view event, expression, event_type, argument;
+  };
+
+  MachineImage(const MachineImage&) = delete;
+  MachineImage& operator=(const MachineImage&) = delete;
+  MachineImage(MachineImage&& other) noexcept;
+  ~MachineImage();
+
+  /// Throws LogicError if definition refers to states it does not define.
+  static MachineImage compile(const MachineDefinition& definition);
+
+  /// Map a file written by save(). Throws RuntimeError if it is not a valid image.
+  static MachineImage load(const std::string& path);
+
+  void save(const std::string& path) const;
+
+  size_t stateNumber() const;
+  StateView state(Handle index) const;
+  size_t transitionNumber() const;
+  TransitionView transition(size_t index) const;
+  Handle initial() const;
+
+  /// Index of the state named id, kInvalidHandle if there is none.
+  Handle findState(std::string_view id) const;
+
+  inline const char* data() const { return data_; }
+  inline size_t size() const { return size_; }
+
+ private:
+  struct Header;
+  struct StateRecord;
+  struct TransitionRecord;
+
+  MachineImage() : data_(nullptr), size_(0), mapped_(false) {}
+  void validate() const;
+  const Header& header() const;
+  std::string_view string(uint32_t offset) const;
+
+  const char* data_;
+  size_t size_;
+  bool mapped_;
+  std::string buffer_;  // owns the data unless it is mapped
+};
+
+/**
+ * @brief Registry of state and event classes by type name, used to build engines from
+ * MachineDefinitions and MachineImages.
+ *
+ * The event type "deadline" (a DeadlineEvent whose argument is a duration like 250ms or
+ * 2s) is registered from the start.
+ */
+class MachineFactory {
+ public:
+  typedef std::function<std::unique_ptr<EventBase>(const std::string& argument)> EventCreator;
+
+  MachineFactory();
+
+  template <typename T>
+  void registerState(const std::string& type) {
+    static_assert(std::is_base_of<StateBase, T>::value,
+                  "Accepts only classed derived from StateBase");
+    states_[type] = [](StateMachineEngine& engine, const std::string& id) {
+      engine.addState<T>(id);
+    };
+  }
+
+  void registerEvent(const std::string& type, EventCreator creator) {
+    events_[type] = std::move(creator);
+  }
+
+  /// Add the states and transitions of image to engine and set its initial state.
+  void build(const MachineImage& image, StateMachineEngine& engine) const;
+
+  void build(const MachineDefinition& definition, StateMachineEngine& engine) const {
+    build(MachineImage::compile(definition), engine);
+  }
+
+ private:
+  std::unordered_map<std::string, std::function<void(StateMachineEngine&, const std::string&)>>
+      states_;
+  std::unordered_map<std::string, EventCreator> events_;
+};
+
+/// Parse a duration such as 250ms, 2s, 1.5s or 500us. Throws LogicError.
+DurationType parseDuration(const std::string& text);
+
+}  // namespace sm
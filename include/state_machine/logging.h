@@ -0,0 +1,229 @@
+#pragma once
+
+#ifndef FMT_HEADER_ONLY
+#define FMT_HEADER_ONLY
+#endif
+
+#include <fmt/core.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#define SM_LOG_LEVEL_TRACE 0
+#define SM_LOG_LEVEL_DEBUG 1
+#define SM_LOG_LEVEL_INFO 2
+#define SM_LOG_LEVEL_WARN 3
+#define SM_LOG_LEVEL_ERROR 4
+#define SM_LOG_LEVEL_OFF 5
+
+// Records below this level are compiled out entirely.
+#ifndef SM_LOG_LEVEL
+#define SM_LOG_LEVEL SM_LOG_LEVEL_INFO
+#endif
+
+namespace sm {
+
+enum class LogLevel : uint8_t { Trace = 0, Debug = 1, Info = 2, Warn = 3, Error = 4 };
+
+namespace logging {
+
+/**
+ * Arguments are stored in binary form and only formatted by the backend thread.
+ * Arithmetic values, enums and pointers are copied as-is; strings are copied as bytes and
+ * handed to fmt as std::string_view.
+ */
+template <typename T, typename = void>
+struct Codec {
+  static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value ||
+                    std::is_pointer<T>::value,
+                "log arguments must be arithmetic, enum, pointer or string");
+  using Decoded = T;
+  static size_t size(const T&) { return sizeof(T); }
+  static void encode(uint8_t*& out, const T& value) {
+    std::memcpy(out, &value, sizeof(T));
+    out += sizeof(T);
+  }
+  static T decode(const uint8_t*& in) {
+    T value;
+    std::memcpy(&value, in, sizeof(T));
+    in += sizeof(T);
+    return value;
+  }
+};
+
+struct StringCodec {
+  using Decoded = std::string_view;
+  static size_t size(std::string_view value) { return sizeof(uint32_t) + value.size(); }
+  static void encode(uint8_t*& out, std::string_view value) {
+    uint32_t length = static_cast<uint32_t>(value.size());
+    std::memcpy(out, &length, sizeof(length));
+    std::memcpy(out + sizeof(length), value.data(), length);
+    out += sizeof(length) + length;
+  }
+  static std::string_view decode(const uint8_t*& in) {
+    uint32_t length;
+    std::memcpy(&length, in, sizeof(length));
+    std::string_view value(reinterpret_cast<const char*>(in + sizeof(length)), length);
+    in += sizeof(length) + length;
+    return value;
+  }
+};
+
+template <>
+struct Codec<std::string> : StringCodec {};
+template <>
+struct Codec<std::string_view> : StringCodec {};
+template <>
+struct Codec<const char*> : StringCodec {};
+template <>
+struct Codec<char*> : StringCodec {};
+
+typedef std::string (*Decoder)(const char* format, const uint8_t* data);
+
+struct RecordHeader {
+  uint32_t size;  // whole record, header included, multiple of 8
+  uint32_t level;  // 0xffffffff marks padding up to the end of the ring
+  Decoder decoder;
+  const char* format;
+  int64_t timestamp;  // steady clock, ns
+};
+
+template <typename... Args>
+std::string decodeRecord(const char* format, const uint8_t* data) {
+  // braced initialization evaluates the decoders left to right
+  std::tuple<typename Codec<Args>::Decoded...> values{Codec<Args>::decode(data)...};
+  (void)data;
+  return std::apply(
+      [format](const auto&... v) { return fmt::format(fmt::runtime(format), v...); }, values);
+}
+
+/// Single-producer single-consumer byte ring owned by one logging thread.
+class LogRing {
+ public:
+  explicit LogRing(size_t capacity);
+
+  /// Producer side. Return nullptr (and count a drop) if the record does not fit.
+  uint8_t* reserve(size_t size);
+  void commit(size_t size);
+
+  /// Consumer side. Call sink for every committed record, return the number drained.
+  size_t drain(const std::function<void(const RecordHeader&, const std::string&)>& sink);
+
+  inline uint64_t droppedNumber() const { return dropped_.load(std::memory_order_relaxed); }
+  inline bool empty() const {
+    return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+  }
+
+  std::atomic<bool> orphaned;  // owning thread exited
+
+ private:
+  std::vector<uint64_t> buffer_;  // uint64_t keeps records 8-byte aligned
+  size_t capacity_, mask_;
+  size_t reserved_;
+  std::atomic<size_t> head_, tail_;
+  std::atomic<uint64_t> dropped_;
+};
+
+typedef std::function<void(LogLevel level, int64_t timestamp, const std::string& message)> Sink;
+
+/**
+ * @brief Asynchronous logging backend.
+ *
+ * Every thread writes binary records into its own LogRing without locks or formatting; a
+ * background thread drains the rings, formats the records and hands them to the sink.
+ * Records are dropped, never blocked on, when a ring is full.
+ */
+class Logger {
+ public:
+  static Logger& instance();
+
+  ~Logger();
+
+  /// Replace the output (stdout by default). Passing nullptr restores the default.
+  void setSink(const Sink& sink);
+
+  inline void setLevel(LogLevel level) { level_.store(static_cast<uint8_t>(level)); }
+  inline bool enabled(LogLevel level) const {
+    return static_cast<uint8_t>(level) >= level_.load(std::memory_order_relaxed);
+  }
+
+  void setFlushInterval(const std::chrono::milliseconds& interval);
+
+  /// Format and emit everything logged so far. Return the number of records written.
+  size_t flush();
+
+  uint64_t droppedNumber();
+
+  LogRing& localRing();
+
+ private:
+  Logger();
+  void run();
+
+  std::mutex rings_mtx_;
+  std::vector<std::shared_ptr<LogRing>> rings_;
+  std::mutex drain_mtx_;
+  Sink sink_;
+  std::atomic<uint8_t> level_;
+  std::atomic<int64_t> interval_ms_;
+  std::atomic<bool> running_;
+  std::thread thread_;
+};
+
+template <typename... Args>
+void write(LogLevel level, const char* format, const Args&... args) {
+  Logger& logger = Logger::instance();
+  if (!logger.enabled(level)) {
+    return;
+  }
+  size_t size = sizeof(RecordHeader);
+  ((size += Codec<std::decay_t<Args>>::size(args)), ...);
+  size = (size + 7) & ~static_cast<size_t>(7);
+
+  LogRing& ring = logger.localRing();
+  uint8_t* record = ring.reserve(size);
+  if (!record) {
+    return;
+  }
+  RecordHeader header;
+  header.size = static_cast<uint32_t>(size);
+  header.level = static_cast<uint32_t>(level);
+  header.decoder = &decodeRecord<std::decay_t<Args>...>;
+  header.format = format;
+  header.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::steady_clock::now().time_since_epoch())
+                         .count();
+  std::memcpy(record, &header, sizeof(header));
+  uint8_t* out = record + sizeof(header);
+  (Codec<std::decay_t<Args>>::encode(out, args), ...);
+  ring.commit(size);
+}
+
+}  // namespace logging
+
+}  // namespace sm
+
+// The format string must be a literal: only its address is stored in the record.
+#define SM_LOG_AT(level_value, level, ...)      \
+  do {                                          \
+    if (SM_LOG_LEVEL <= level_value) {          \
+      ::sm::logging::write(level, __VA_ARGS__); \
+    }                                           \
+  } while (0)
+
+#define SM_LOG_TRACE(...) SM_LOG_AT(SM_LOG_LEVEL_TRACE, ::sm::LogLevel::Trace, __VA_ARGS__)
+#define SM_LOG_DEBUG(...) SM_LOG_AT(SM_LOG_LEVEL_DEBUG, ::sm::LogLevel::Debug, __VA_ARGS__)
+#define SM_LOG_INFO(...) SM_LOG_AT(SM_LOG_LEVEL_INFO, ::sm::LogLevel::Info, __VA_ARGS__)
+#define SM_LOG_WARN(...) SM_LOG_AT(SM_LOG_LEVEL_WARN, ::sm::LogLevel::Warn, __VA_ARGS__)
+#define SM_LOG_ERROR(...) SM_LOG_AT(SM_LOG_LEVEL_ERROR, ::sm::LogLevel::Error, __VA_ARGS__)
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "state_machine/util.h"
+
+namespace sm {
+
+/**
+ * @brief Lock-free log-linear latency histogram, in nanoseconds.
+ *
+ * Every power of two is split into 16 sub-buckets, so a reported percentile is at most
+ * 6.25% above the real value. Values above 2^41 ns (about 36 minutes) land in the last
+ * bucket. record() is a handful of relaxed atomic operations and never allocates; readers
+ * on other threads may query while it is being recorded to.
+ */
+class LatencyHistogram {
+ public:
+  static constexpr int kSubBucketBits = 4;
+  static constexpr int kMaxExponent = 40;
+  static constexpr size_t kBucketNumber = (kMaxExponent - kSubBucketBits + 2)
+                                          << kSubBucketBits;
+
+  LatencyHistogram();
+
+  LatencyHistogram(const LatencyHistogram&) = delete;
+  LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+  void record(int64_t nanoseconds);
+
+  template <typename Rep, typename Period>
+  inline void record(const std::chrono::duration<Rep, Period>& value) {
+    record(std::chrono::duration_cast<std::chrono::nanoseconds>(value).count());
+  }
+
+  inline uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+
+  /// 0 if nothing was recorded.
+  int64_t min() const;
+  int64_t max() const;
+  double mean() const;
+
+  /// Value below which percent% of the samples fall, e.g. percentile(99).
+  int64_t percentile(double percent) const;
+
+  void reset();
+
+ private:
+  static size_t bucketIndex(uint64_t value);
+  static uint64_t bucketUpperBound(size_t index);
+
+  std::atomic<uint64_t> buckets_[kBucketNumber];
+  std::atomic<uint64_t> count_, sum_;
+  std::atomic<int64_t> min_, max_;
+};
+
+/**
+ * @brief Instrumentation of one state, enabled by StateMachineEngine::enableMetrics().
+ *
+ * tick_period is the time between the starts of two ticks of the state, tick_lateness how
+ * far past its deadline a timer-driven tick started. overruns counts the ticks whose own
+ * work took longer than the tick interval. Everything may be read from other threads while
+ * the state records to it.
+ */
+struct StateMetrics {
+  typedef std::shared_ptr<StateMetrics> SharedPtr;
+
+  struct EventMetrics {
+    explicit EventMetrics(Handle event) : event(event) {}
+    const Handle event;
+    LatencyHistogram condition;  // time to evaluate the event's condition
+  };
+
+  StateMetrics() : overruns(0) {}
+
+  /// Condition histogram of event, created on first use.
+  LatencyHistogram& condition(Handle event);
+
+  /// nullptr if event was never registered while metrics were enabled.
+  const LatencyHistogram* findCondition(Handle event) const;
+
+  /// The condition histograms created so far, in creation order.
+  std::vector<const EventMetrics*> events() const;
+
+  void reset();
+
+  LatencyHistogram time_in_state, update, enter, leave;
+  LatencyHistogram tick_period, tick_lateness;
+  std::atomic<uint64_t> overruns;
+
+ private:
+  mutable std::mutex events_mtx_;
+  std::deque<EventMetrics> events_;  // deque: histograms never move
+};
+
+}  // namespace sm
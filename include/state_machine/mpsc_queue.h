@@ -0,0 +1,86 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+
+#include "state_machine/exception.h"
+
+namespace sm {
+
+/**
+ * @brief Bounded lock-free queue with many producers and one consumer.
+ *
+ * Every cell carries a sequence number that tells producers whether it is free and the
+ * consumer whether it is filled, so push() is a single CAS on the tail and pop() needs no
+ * read-modify-write at all. Nothing is allocated after construction: push() fails, and
+ * counts a drop, when the queue is full.
+ */
+template <typename T>
+class MpscQueue {
+ public:
+  /// capacity must be a power of two.
+  explicit MpscQueue(size_t capacity)
+      : cells_(new Cell[capacity]), mask_(capacity - 1), tail_(0), head_(0), dropped_(0) {
+    if (capacity == 0 || (capacity & mask_) != 0) {
+      throw LogicError("queue capacity must be a power of two");
+    }
+    for (size_t i = 0; i < capacity; i++) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  /// Any thread. Return false if the queue is full.
+  bool push(const T& value) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &cells_[tail & mask_];
+      size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      auto lag = static_cast<std::ptrdiff_t>(sequence - tail);
+      if (lag == 0) {
+        if (tail_.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (lag < 0) {
+        // the consumer has not freed this cell yet
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      } else {
+        tail = tail_.load(std::memory_order_relaxed);
+      }
+    }
+    cell->value = value;
+    cell->sequence.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// The consumer thread only. Return false if the queue is empty.
+  bool pop(T& value) {
+    Cell& cell = cells_[head_ & mask_];
+    if (cell.sequence.load(std::memory_order_acquire) != head_ + 1) {
+      return false;
+    }
+    value = cell.value;
+    cell.sequence.store(head_ + mask_ + 1, std::memory_order_release);
+    head_++;
+    return true;
+  }
+
+  inline size_t capacity() const { return mask_ + 1; }
+
+  inline uint64_t droppedNumber() const { return dropped_.load(std::memory_order_relaxed); }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  std::unique_ptr<Cell[]> cells_;
+  size_t mask_;
+  alignas(64) std::atomic<size_t> tail_;  // producers
+  alignas(64) size_t head_;               // consumer
+  std::atomic<uint64_t> dropped_;
+};
+
+}  // namespace sm
@@ -0,0 +1,14 @@
+#pragma once
+
+namespace sm {
+
+/**
+ * @brief Run the calling thread under SCHED_FIFO at priority (1 to 99) and, if cpu is not
+ * negative, pin it to that CPU.
+ *
+ * Needs CAP_SYS_NICE or an rtprio limit; throws RuntimeError naming the failed call
+ * otherwise. Linux only.
+ */
+void setRealtimeScheduling(int priority, int cpu = -1);
+
+}  // namespace sm
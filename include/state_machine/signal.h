@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace sm {
+
+/**
+ * @brief Wakes a sleeping state loop as soon as something it may react to has changed.
+ *
+ * A notification that arrives while nobody is waiting is kept pending, so the next
+ * waitUntil() returns immediately instead of losing the wakeup. notify() is lock-free
+ * unless a thread is parked in waitUntil(); only then does it take the mutex, once, to
+ * wake it. Notifications while one is already pending do not touch the mutex at all.
+ */
+class WakeupSignal {
+ public:
+  typedef std::shared_ptr<WakeupSignal> SharedPtr;
+  typedef void (*Observer)(void* context);
+  using Clock = std::chrono::steady_clock;
+
+  WakeupSignal()
+      : pending_(false), waiters_(0), observer_(nullptr), context_(nullptr), calling_(0) {}
+
+  void notify() {
+    // a waiter registers before it checks pending_ and the notifier sets pending_ before
+    // it checks for waiters, so one of the two always sees the other
+    if (!pending_.exchange(true, std::memory_order_seq_cst) &&
+        waiters_.load(std::memory_order_seq_cst) > 0) {
+      { std::lock_guard<std::mutex> lock(mtx_); }
+      cv_.notify_all();
+    }
+    calling_.fetch_add(1, std::memory_order_seq_cst);
+    Observer observer = observer_.load(std::memory_order_seq_cst);
+    if (observer) {
+      observer(context_.load(std::memory_order_seq_cst));
+    }
+    calling_.fetch_sub(1, std::memory_order_release);
+  }
+
+  /// Also call observer(context) on every notify(), e.g. to reschedule on an executor.
+  /// The observer must itself be cheap and non-blocking. Return only once no notify() is
+  /// still calling the previous observer, so its context may be freed afterwards.
+  void setObserver(Observer observer, void* context) {
+    observer_.store(nullptr, std::memory_order_seq_cst);
+    while (calling_.load(std::memory_order_seq_cst) != 0) {
+      std::this_thread::yield();
+    }
+    context_.store(context, std::memory_order_seq_cst);
+    observer_.store(observer, std::memory_order_seq_cst);
+  }
+
+  /// Block until notified or until deadline. Return true if woken by notify().
+  bool waitUntil(const Clock::time_point& deadline) {
+    std::unique_lock<std::mutex> lock(mtx_);
+    waiters_.fetch_add(1, std::memory_order_seq_cst);
+    cv_.wait_until(lock, deadline,
+                   [this] { return pending_.load(std::memory_order_seq_cst); });
+    waiters_.fetch_sub(1, std::memory_order_relaxed);
+    return pending_.exchange(false, std::memory_order_acq_rel);
+  }
+
+ private:
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  std::atomic<bool> pending_;
+  std::atomic<uint32_t> waiters_;
+  std::atomic<Observer> observer_;
+  std::atomic<void*> context_;
+  std::atomic<uint32_t> calling_;  // notify() calls that may be inside the observer
+};
+
+}  // namespace sm
@@ -1,18 +1,38 @@
 #pragma once
 
+#include <atomic>
+
 #include "state_machine/basic_struct.h"
 #include "state_machine/util.h"
 #include "state_machine/exception.h"
 #include "state_machine/blackboard.h"
 #include "state_machine/event.h"
+#include "state_machine/mpsc_queue.h"
+#include "state_machine/signal.h"
+#include "state_machine/snapshot.h"
 #include "state_machine/state.h"
+#include "state_machine/timing_wheel.h"
+#include "state_machine/trace.h"
 
 namespace sm {
 
+/// What a fixed-rate engine does after a tick ran past the start of the next period.
+enum class OverrunPolicy {
+  kSkip,     // drop the missed periods and continue on the next one still ahead
+  kCatchUp,  // run the missed ticks back to back until it is on schedule again
+};
+
 class StateMachineEngine {
  public:
   typedef std::shared_ptr<StateMachineEngine> SharedPtr;
   StateMachineEngine();
+
+  /// Allocate states and the events they emplace from arena, see MachineArena.
+  explicit StateMachineEngine(const MachineArena::SharedPtr& arena);
+
+  /// A fresh instance of prototype, allocated from arena if it is set; see clone().
+  StateMachineEngine(const StateMachineEngine& prototype, const MachineArena::SharedPtr& arena);
+
   virtual ~StateMachineEngine();
 
   template <typename T>
@@ -21,35 +41,315 @@ class StateMachineEngine {
                   "Accepts only classed derived from StateBase");
     static_assert(!std::is_abstract<T>::value, "Some methods are pure virtual. ");
     state_keeper_.addResource<T>(state_id);
-    state_keeper_.getResource(state_id)->setBlackBoard(blackboard_);
-    state_keeper_.getResource(state_id)->setTickInterval(tick_interval_);
+    auto state = state_keeper_.getResource(state_id);
+    creators_.emplace_back(state_id, &StateMachineEngine::createState<T>);
+    state->setIdTables(state_ids_, event_ids_);
+    state->setBlackBoard(blackboard_);
+    state->setTypedBlackboard(typed_blackboard_);
+    state->setTickInterval(tick_interval_);
+    state->setWakeupSignal(wakeup_);
+    state->setEventDriven(event_driven_);
+    state->setTimingWheel(timers_);
+    state->setClock(clock_);
+    state->setArena(arena_);
+    state->registerEvents();
+    if (metrics_enabled_) {
+      state->enableMetrics();
+    }
+    state->setGuardPool(guard_pool_);
     return *this;
   }
 
+  /**
+   * @brief Add state_id as a substate of parent_id, which must be added as well.
+   *
+   * The parent's events are checked once per tick for its whole subtree, before the events
+   * of the active substate. Entering the parent enters its initial substate, the first
+   * child added unless setInitialSubstate() says otherwise.
+   */
+  template <typename T>
+  StateMachineEngine& addState(const std::string& state_id, const std::string& parent_id) {
+    addState<T>(state_id);
+    setParent(state_id, parent_id);
+    return *this;
+  }
+
+  void setParent(const std::string& state_id, const std::string& parent_id);
+
+  void setInitialSubstate(const std::string& parent_id, const std::string& state_id);
+
+  /// kInvalidHandle for top-level states.
+  inline Handle getParent(Handle state) const {
+    return state < parents_.size() ? parents_[state] : kInvalidHandle;
+  }
+
+  /// True if state_id is the active state or one of its ancestors.
+  bool isInState(const std::string& state_id) const;
+
   int StateNumber() const { return state_keeper_.getResourceSize(); }
 
   BlackboardType::Ptr getBlackboard() { return blackboard_; }
 
+  /// Lock-free blackboard for hot-path data; writes to it wake the active state.
+  const TypedBlackboard::SharedPtr& getTypedBlackboard() const { return typed_blackboard_; }
+
+  const TimingWheel::SharedPtr& getTimingWheel() const { return timers_; }
+
+  /**
+   * @brief Run the engine, its states and their events on clock instead of the steady
+   * clock, e.g. a VirtualClock to simulate faster than real time. Call it before adding
+   * states; throws LogicError otherwise.
+   */
+  void setClock(const Clock::SharedPtr& clock);
+
+  inline const Clock::SharedPtr& getClock() const { return clock_; }
+
   std::shared_ptr<StateBase> getState(const std::string& name);
 
-  inline std::string getCurrentStateID() const { return active_state_id_ ; }
+  std::shared_ptr<StateBase> getState(Handle handle);
+
+  std::string getCurrentStateID() const;
+
+  inline Handle getCurrentState() const { return active_state_; }
+
+  inline Handle getStateHandle(const std::string& state_id) const {
+    return state_ids_->find(state_id);
+  }
+
+  inline const NameTable::SharedPtr& getStateIdTable() const { return state_ids_; }
+
+  inline const NameTable::SharedPtr& getEventIdTable() const { return event_ids_; }
 
-  inline void setInitialStateID(const std::string& state_id) { active_state_id_ = state_id; }
+  inline void setInitialStateID(const std::string& state_id) {
+    active_state_ = initial_state_ = state_ids_->intern(state_id);
+  }
+
+  /**
+   * @brief New engine with the states, transitions and hierarchy of this one, in its
+   * initial state.
+   *
+   * Build one engine as a prototype and stamp out instances from it. They share its name
+   * tables, so handles agree across all of them, and its precomputed hierarchy tables;
+   * each has its own state objects, blackboards, timers and trace. State classes are
+   * constructed again and register their events in registerEventsImpl() as usual. The
+   * transitions MachineFactory added are added again: expressions are compiled against
+   * the clone's TypedBlackboard and events are made anew by their factory creators. Any
+   * other event registered on a state from outside its own hooks cannot be repeated, and
+   * clone() throws LogicError instead of returning an engine without it. The settings set
+   * so far (tick interval, event-driven mode, metrics, guard pool, trace capacity) are
+   * copied too.
+   */
+  SharedPtr clone(const MachineArena::SharedPtr& arena = nullptr) const;
 
   inline void setGlobalTickInterval(const DurationType& interval) { tick_interval_ = interval; }
 
+  /**
+   * @brief Block the active state between ticks until notify() is called or the tick
+   * interval elapses, instead of sleeping for the whole interval.
+   */
+  inline void setEventDriven(bool enable) { event_driven_ = enable; }
+
+  inline bool isEventDriven() const { return event_driven_; }
+
+  /**
+   * @brief Tick on absolute deadlines, the first tick plus whole tick intervals, instead of
+   * one interval after the previous tick started, so late wakeups do not add up to drift.
+   *
+   * Steps that run early (a timer, notify() or a transition) keep the phase. A tick that
+   * ends after the start of the next period is an overrun: it is counted and handled as
+   * policy says.
+   */
+  void setFixedRate(bool enable, OverrunPolicy policy = OverrunPolicy::kSkip);
+
+  inline bool isFixedRate() const { return fixed_rate_; }
+
+  /// Ticks of a fixed-rate engine that ran past the start of the next period.
+  inline uint64_t getOverrunCount() const { return overruns_; }
+
+  /**
+   * @brief Run spin() and spinUntilStateChange() under SCHED_FIFO at priority, pinned to
+   * cpu unless it is negative. Applied to the spinning thread when it starts spinning; see
+   * setRealtimeScheduling(). A priority of 0 leaves the thread as it is.
+   */
+  inline void setRealtime(int priority, int cpu = -1) {
+    realtime_priority_ = priority;
+    realtime_cpu_ = cpu;
+    realtime_thread_ = std::thread::id();
+  }
+
+  /// Wake the active state so its events are checked immediately.
+  inline void notify() { wakeup_->notify(); }
+
+  /**
+   * @brief Deliver event to the machine from any thread, without allocation.
+   *
+   * Posted events are drained in order at the start of step(). Each one takes the
+   * transition registered under its name in the active state or one of its ancestors,
+   * outermost first, without checking its guard; one that none of them has is dropped.
+   * A step takes at most one transition, so the events after it wait for the next step.
+   * Return false if the queue is full.
+   *
+   * Enqueuing is lock-free, and so is the wakeup while one is already pending or the
+   * engine is not parked. Only the post that wakes a parked engine thread takes the
+   * signal's mutex, once; on an Executor, the one that wakes a sleeping engine takes the
+   * lock of the worker queue it is put back on.
+   */
+  inline bool post(Handle event) {
+    if (!posted_->push(event)) {
+      return false;
+    }
+    notify();
+    return true;
+  }
+
+  /// Post the event named event; false if no state registered it. Resolve the handle once
+  /// with getEventHandle() where looking up the name is too slow.
+  bool post(const std::string& event);
+
+  inline Handle getEventHandle(const std::string& event) const { return event_ids_->find(event); }
+
+  /// Capacity of the post() queue, a power of two (1024 by default). Call before posting.
+  void setEventQueueCapacity(size_t capacity);
+
+  /// Events post() refused because the queue was full.
+  inline uint64_t getDroppedEventCount() const { return posted_->droppedNumber(); }
+
+  /// Write a blackboard entry and wake the active state to react to it.
+  template <typename T>
+  void writeBlackboard(const std::string& key, const T& value) {
+    blackboard_->set<T>(key, value);
+    notify();
+  }
+
+  inline const WakeupSignal::SharedPtr& getWakeupSignal() const { return wakeup_; }
+
+  /// Number of transitions taken so far.
+  inline uint64_t getTransitionCount() const { return transition_count_; }
+
   void spin();
 
   void spinUntilStateChange();
 
-  std::string generateFootprint(const std::list<std::string>& list);
+  /**
+   * @brief Run exactly one tick of the active state without blocking.
+   *
+   * Enters the active state on its first tick and takes at most one transition.
+   * @return the time the next step() is due; now if a transition was just taken.
+   */
+  TimePoint step();
+
+  /// Block until deadline on the engine's clock, returning early on notify() in
+  /// event-driven mode.
+  void waitUntil(const TimePoint& deadline);
+
+  /// Keep the last capacity transitions (1024 by default). Clears the kept records.
+  void setTraceCapacity(size_t capacity);
+
+  inline const TransitionTrace& getTrace() const { return trace_; }
+
+  /**
+   * @brief Also write every following transition to a memory-mapped file at path.
+   *
+   * The file keeps the last getTrace().capacity() records and the state and event names;
+   * read it with TraceFile::load() or the trace_reader tool.
+   */
+  void recordTrace(const std::string& path);
+
+  void stopRecordingTrace();
+
+  /// The kept transitions as "[state_a] -> [state_b] -> ...".
+  std::string generateFootprint() const;
+
+  /**
+   * @brief Time the hooks, UpdateImpl(), event conditions and ticks of every state.
+   *
+   * Off by default; disabled states take no timestamps beyond the ones step() needs.
+   * Turning metrics off and on again is an atomic flag per state, safe while the engine
+   * runs; reports may be read from any thread.
+   */
+  void enableMetrics(bool enable = true);
+
+  inline bool isMetricsEnabled() const { return metrics_enabled_.load(); }
+
+  /**
+   * @brief Evaluate the guards of every state concurrently on pool, keeping their priority
+   * order. Meant for states with several expensive guards; nullptr turns it off.
+   */
+  void setGuardPool(const GuardPool::SharedPtr& pool);
+
+  /**
+   * @brief Capture the active states, their time in state and the TypedBlackboard entries.
+   *
+   * Call it between steps from the thread that steps the engine. It copies a few values
+   * and does no I/O, so Snapshot::save() can run on another thread.
+   */
+  Snapshot snapshot() const;
+
+  /**
+   * @brief Continue where snapshot left off, e.g. after a restart.
+   *
+   * Writes the saved entries that exist with the same type, then enters the saved states.
+   * Their enter hooks run as usual, after which the states and their class-based events
+   * continue the visit from the saved time in state, so timeouts keep their deadlines.
+   * Throws LogicError if a saved state was not added.
+   */
+  void restore(const Snapshot& snapshot);
+
+  /// Metrics of state_id, nullptr while metrics are disabled.
+  StateMetrics::SharedPtr getMetrics(const std::string& state_id);
+
+  /// One table of count, p50, p99 and max per state and per event, in microseconds.
+  std::string metricsReport();
 
  private:
-  std::string active_state_id_;
+  StateBase* dispatch(Handle event);
+  TimePoint nextPeriod(const TimePoint& started);
+  void applyRealtime();
+
+  typedef void (*StateCreator)(StateMachineEngine& engine, const std::string& state_id);
+
+  template <typename T>
+  static void createState(StateMachineEngine& engine, const std::string& state_id) {
+    engine.addState<T>(state_id);
+  }
+
+  void buildHierarchy();
+  Handle descend(Handle state) const;
+  Handle exitBoundary(Handle source, Handle target) const;
+  void activate(Handle leaf);
+
+  NameTable::SharedPtr state_ids_, event_ids_;
+  Handle active_state_, initial_state_;
+  std::shared_ptr<StateBase> current_state_;  // cached state object of active_state_
+  std::atomic<uint64_t> transition_count_;
   DurationType tick_interval_;
+  bool event_driven_;
+  WakeupSignal::SharedPtr wakeup_;
+  Clock::SharedPtr clock_;
+  TimingWheel::SharedPtr timers_;
   ResourceKeeper<std::string, StateBase> state_keeper_;
-  std::list<std::string> state_footprint_;
+  TransitionTrace trace_;
+  TimePoint state_entered_;  // when the active state was entered
+  TimePoint next_tick_;      // deadline returned by the last step() without a transition
+  std::atomic<bool> metrics_enabled_;
+  GuardPool::SharedPtr guard_pool_;
+  // state hierarchy, indexed by state handle
+  std::vector<Handle> parents_, initial_substates_;
+  // lowest common ancestor of a and b at a * parents_.size() + b; shared with clones
+  std::shared_ptr<const std::vector<Handle>> lca_;
+  bool hierarchy_changed_;
+  std::vector<std::shared_ptr<StateBase>> active_path_;  // outermost state to active state
   BlackboardType::Ptr blackboard_;
+  TypedBlackboard::SharedPtr typed_blackboard_;
+  MachineArena::SharedPtr arena_;
+  std::vector<std::pair<std::string, StateCreator>> creators_;  // in the order added
+  bool fixed_rate_;
+  OverrunPolicy overrun_policy_;
+  TimePoint period_;  // start of the next fixed-rate period, unset before the first tick
+  std::atomic<uint64_t> overruns_;
+  int realtime_priority_, realtime_cpu_;
+  std::thread::id realtime_thread_;  // the thread realtime scheduling was applied to
+  std::unique_ptr<MpscQueue<Handle>> posted_;
 };
 
 }  // namespace sm
\ No newline at end of file
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "state_machine/util.h"
+
+namespace sm {
+
+/**
+ * @brief What a StateMachineEngine needs to resume after a restart.
+ *
+ * Taken with StateMachineEngine::snapshot() and applied with restore(). The active states
+ * are kept by name with the time spent in each, so a rebuilt engine may assign different
+ * handles. TypedBlackboard entries of arithmetic and enum types (see IsSnapshotSafe) are
+ * kept as raw bytes and tagged with their type; the BT blackboard holds arbitrary values
+ * and is not saved.
+ *
+ * The file format is a fixed header followed by length-prefixed records, in host byte
+ * order: a snapshot is read back on the machine that wrote it.
+ */
+struct Snapshot {
+  struct StateTime {
+    std::string state;
+    DurationType in_state;
+  };
+
+  struct Entry {
+    std::string key;
+    std::string type;   // std::type_info::name() of the entry
+    std::string value;  // raw bytes
+  };
+
+  std::chrono::system_clock::time_point taken;
+  uint64_t transition_count = 0;
+  std::vector<StateTime> path;  // active states, outermost first; empty before the first step
+  std::string last_state;
+  std::vector<Entry> entries;
+
+  std::string serialize() const;
+
+  /// Throws RuntimeError if data is not a complete snapshot.
+  static Snapshot parse(const char* data, size_t size);
+
+  /// Write to a temporary file next to path and rename it, so path is never half written.
+  void save(const std::string& path) const;
+
+  /// Read a snapshot written by save(), mapping the file instead of copying it.
+  static Snapshot load(const std::string& path);
+};
+
+}  // namespace sm
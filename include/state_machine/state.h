@@ -5,31 +5,85 @@
 #include "state_machine/exception.h"
 #include "state_machine/blackboard.h"
 #include "state_machine/event.h"
+#include "state_machine/guard.h"
+#include "state_machine/guard_expr.h"
+#include "state_machine/guard_pool.h"
+#include "state_machine/metrics.h"
+#include "state_machine/signal.h"
 
 namespace sm {
 
+/**
+ * @brief The entries one event of a state subscribed to, and the flag their writes raise.
+ *
+ * Shared by every EventPack the state registers under the same event id, so an event
+ * registered again on each visit (e.g. from onEnterImpl) subscribes to an entry only once.
+ */
+struct InputSubscription {
+  InputSubscription() : written(false) {}
+
+  std::atomic<bool> written;
+  std::vector<const SlotBase*> slots;  // touched by the ticking thread only
+};
+
 class EventPack {
  public:
-  EventPack(const std::string& name, const std::string& to_state, Priority priority,
-            const EventFunction& func)
-      : name_(name), to_state_(to_state), priority_(priority), func_(func) {}
+  EventPack(const std::string& name, Handle id, const std::string& to_state, Handle target,
+            Priority priority, Guard guard, EventBase* event = nullptr)
+      : name_(name), to_state_(to_state), id_(id), target_(target), priority_(priority),
+        guard_(std::move(guard)), event_(event) {}
 
-  EventPack(const std::string& name, const std::string& to_state, Priority priority,
-            EventBase* event)
-      : name_(name), to_state_(to_state), priority_(priority), event_(event) {}
-
-  std::string name() const { return name_; }
-  std::string to_state() const { return to_state_; }
+  const std::string& name() const { return name_; }
+  const std::string& to_state() const { return to_state_; }
+  Handle id() const { return id_; }
+  Handle target() const { return target_; }
   Priority priority() const { return priority_; }
-  std::optional<EventFunction> func() { return func_; }
+  /// Evaluate the event's condition. Class-based events are evaluated through it as well.
+  inline bool check() { return tracked_ ? checkTracked() : guard_(); }
   EventBase* event() const { return event_; }
 
+  /// Reuse the last result until one of the TypedBlackboard entries in inputs is written.
+  void track(const std::vector<std::string>& inputs);
+
+  inline bool isTracked() const { return tracked_; }
+
+  /**
+   * @brief Look up the input entries that did not exist yet and subscribe to them, so a
+   * write raises this event's flag and owner. Entries created later are looked up by the
+   * next check.
+   */
+  void resolveInputs(const TypedBlackboard* blackboard, const DirtyFlag& owner);
+
+  /// Subscribe through subscription instead of a subscription of the pack's own.
+  inline void shareSubscription(const std::shared_ptr<InputSubscription>& subscription) {
+    subscription_ = subscription;
+  }
+
+  /// Drop the cached result.
+  inline void forget() { cache_ = kUnknown; }
+
  private:
   std::string name_;
   std::string to_state_;
+  Handle id_;
+  Handle target_;
   Priority priority_;
-  std::optional<EventFunction> func_;
-  EventBase* event_;
+  Guard guard_;
+  EventBase* event_;  // set for class-based events, which also get onStart() and onLeave()
+
+  enum Cache : uint8_t { kUnknown, kFalse, kTrue };
+  bool checkTracked();
+
+  bool tracked_ = false;
+  std::vector<std::string> input_keys_;
+  std::vector<const SlotBase*> inputs_;  // nullptr until the entry exists
+  size_t unresolved_ = 0;
+  const TypedBlackboard* blackboard_ = nullptr;
+  size_t seen_entries_ = 0;  // blackboard size when unresolved inputs were last looked up
+  std::shared_ptr<InputSubscription> subscription_;
+  DirtyFlag owner_;  // the state's, raised along with the subscription's flag
+  uint64_t revision_ = 0;    // event revision the cached result was computed from
+  Cache cache_ = kUnknown;
 };
 
 class StateBase {
@@ -40,60 +94,326 @@ class StateBase {
 
   inline void setBlackBoard(const BlackboardType::Ptr& blackboard) { blackboard_ = blackboard; }
 
-  inline std::string getNextStateID() const { return next_state_id_; }
+  inline void setTypedBlackboard(const TypedBlackboard::SharedPtr& blackboard) {
+    typed_blackboard_ = blackboard;
+  }
+
+  /**
+   * @brief Share the engine's name tables so state and event handles are consistent across
+   * all states of one machine.
+   */
+  void setIdTables(const NameTable::SharedPtr& state_ids, const NameTable::SharedPtr& event_ids);
+
+  inline Handle getHandle() const { return handle_; }
+
+  inline Handle getNextState() const { return next_state_; }
+
+  inline Handle getTriggerEvent() const { return trigger_event_; }
+
+  std::string getNextStateID() const;
 
   inline void setPrev(const std::shared_ptr<StateBase>& another) { prev_ = another; }
 
   inline void setTickInterval(const DurationType& interval) { tick_interval_ = interval; }
 
-  inline void setLastStateID(const std::string& state_id) { last_state_id_ = state_id; }
+  inline void setWakeupSignal(const WakeupSignal::SharedPtr& wakeup) { wakeup_ = wakeup; }
+
+  inline void setEventDriven(bool enable) { event_driven_ = enable; }
+
+  inline void setTimingWheel(const TimingWheel::SharedPtr& timers) { timers_ = timers; }
+
+  /// Time source of the state and of the class-based events registered after this call.
+  inline void setClock(const Clock::SharedPtr& clock) { clock_ = clock; }
+
+  inline const Clock::SharedPtr& getClock() const { return clock_; }
 
-  inline double getDuration() const { return duration_; }
+  /// Allocate the events made by emplaceEvent() from arena; nullptr uses the heap.
+  inline void setArena(const MachineArena::SharedPtr& arena) { arena_ = arena; }
+
+  /// Wake the state loop so events are checked right away instead of at the next tick.
+  void notify();
+
+  inline void setLastState(Handle state) { last_state_ = state; }
+
+  inline void setLastStateID(const std::string& state_id) {
+    last_state_ = stateIds().intern(state_id);
+  }
 
+  /// Seconds spent in the state during its latest visit.
+  inline double getDuration() const {
+    return std::chrono::duration<double>(left_ - entered_).count();
+  }
+
+  /**
+   * @brief Evaluate the guards of this state concurrently on pool; nullptr evaluates them
+   * one after another on the ticking thread (the default). The guards must then be safe
+   * to run in parallel with each other.
+   */
+  inline void setGuardPool(const GuardPool::SharedPtr& pool) { guard_pool_ = pool; }
+
+  /**
+   * @brief Start (or stop, with false) timing the hooks, ticks and event conditions of this
+   * state. The first call allocates the metrics and belongs with the other setup; later
+   * ones only flip an atomic flag and may come from any thread. Stopping keeps what was
+   * recorded, and starting again adds to it.
+   */
+  void enableMetrics(bool enable = true);
+
+  /// nullptr unless metrics are enabled.
+  inline StateMetrics::SharedPtr getMetrics() const {
+    return metrics_enabled_.load(std::memory_order_acquire) ? metrics_ : nullptr;
+  }
+
+  /// Enter, tick until an event fires, then leave. Blocks the calling thread.
   void spin();
 
+  /// Run the enter hooks unless the state is already entered.
+  void enter();
+
+  /// Run one tick: advance timers, check events, and update if none fired.
+  /// Return true if an event fired; the state should then be left.
+  bool tick();
+
+  void leave();
+
+  inline bool isEntered() const { return is_enter_; }
+
+  inline const DurationType& getTickInterval() const { return tick_interval_; }
+
+  /// Latest time the next tick should run: one tick interval or the nearest timer deadline.
+  TimePoint nextDeadline(const TimePoint& now) const;
+
+  /**
+   * @brief Registration phase, run once by StateMachineEngine::addState after the blackboard
+   * and name tables are set. Calls registerEventsImpl() to build the transition table.
+   */
+  void registerEvents();
+
+  inline size_t EventNumber() const { return events_.size(); }
+
   std::string listEvents();
 
+  /**
+   * @brief Register an event whose condition is guard: a lambda, function pointer,
+   * std::function or Guard::bind<&Class::method>(object), stored inline in a Guard.
+   */
+  template <int priority>
+  constexpr void registerEvent(const std::string& name, const std::string& transit_to,
+                               Guard guard) {
+    static_assert((priority >= 0) && (priority <= 100),
+                  "Priority should be int type with value in range [0, 100]");
+    if (!guard) {
+      throw LogicError("Event [" + name + "] of state [" + id_ + "] has an empty condition");
+    }
+    addEvent(EventPack(name, eventIds().intern(name), transit_to,
+                       stateIds().intern(transit_to), priority, std::move(guard)));
+  }
+
+  /**
+   * @brief Register an event that is never polled and fires only when it is posted to the
+   * engine with StateMachineEngine::post().
+   */
+  template <int priority>
+  void registerEvent(const std::string& name, const std::string& transit_to) {
+    static_assert((priority >= 0) && (priority <= 100),
+                  "Priority should be int type with value in range [0, 100]");
+    EventPack pack(name, eventIds().intern(name), transit_to, stateIds().intern(transit_to),
+                   priority, Guard([]() { return false; }));
+    // without inputs the result is cached after the first check of a visit
+    pack.track({});
+    addEvent(std::move(pack));
+  }
+
+  /**
+   * @brief Register an event whose guard reads only the TypedBlackboard entries in inputs.
+   * The guard is evaluated again only after one of them was written; ticks in between reuse
+   * its last result.
+   */
   template <int priority>
   constexpr void registerEvent(const std::string& name, const std::string& transit_to,
-                               EventFunction func) {
+                               Guard guard, const std::vector<std::string>& inputs) {
     static_assert((priority >= 0) && (priority <= 100),
                   "Priority should be int type with value in range [0, 100]");
-    events_.emplace_back(name, transit_to, priority, func);
+    if (!guard) {
+      throw LogicError("Event [" + name + "] of state [" + id_ + "] has an empty condition");
+    }
+    EventPack pack(name, eventIds().intern(name), transit_to, stateIds().intern(transit_to),
+                   priority, std::move(guard));
+    pack.track(inputs);
+    addEvent(std::move(pack));
   }
 
+  /**
+   * @brief Register an event whose condition is a GuardExpression such as
+   * "speed > 10 && elapsed >= 2", compiled here against the state's TypedBlackboard.
+   * Unless it reads `elapsed`, it is evaluated again only after one of its entries changed.
+   */
   template <int priority>
+  void registerExpression(const std::string& name, const std::string& transit_to,
+                          const std::string& expression) {
+    static_assert((priority >= 0) && (priority <= 100),
+                  "Priority should be int type with value in range [0, 100]");
+    addExpression(name, transit_to, priority, expression);
+  }
+
+  /**
+   * @brief Register a class-based event. Its update() is called through the static type
+   * E, so declaring E final turns the virtual call into a direct one.
+   *
+   * The state drives the event's lifecycle: onStart() runs on every entry, after
+   * onEnterImpl() (so also for events registered there), and onLeave() after
+   * onLeaveImpl(). Do not call them from the state's own hooks as well.
+   */
+  template <int priority, typename E,
+            typename = std::enable_if_t<std::is_base_of<EventBase, E>::value>>
   constexpr void registerEvent(const std::string& name, const std::string& transit_to,
-                               EventBase* event) {
+                               E* event) {
     static_assert((priority >= 0) && (priority <= 100),
                   "Priority should be int type with value in range [0, 100]");
-    events_.emplace_back(name, transit_to, priority, event);
     assert(blackboard_);
-    events_.back().event()->setBlackBoard(blackboard_);
+    event->setBlackBoard(blackboard_);
+    event->setTypedBlackboard(typed_blackboard_);
+    event->setWakeupSignal(wakeup_);
+    event->setTimingWheel(timers_);
+    event->setClock(clock_);
+    event->setDirtyFlag(dirty_);
+    EventPack pack(name, eventIds().intern(name), transit_to, stateIds().intern(transit_to),
+                   priority, Guard([event]() { return event->update(); }), event);
+    if (event->isTracked()) {
+      pack.track(event->getInputs());
+    }
+    addEvent(std::move(pack));
+  }
+
+  /**
+   * @brief Construct a class-based event owned by the state, in the engine's MachineArena
+   * if it has one, and register it. The state frees it once an event of the same name
+   * replaces it, so emplacing from onEnterImpl() keeps one event, not one per visit.
+   */
+  template <int priority, typename E, typename... Args>
+  E* emplaceEvent(const std::string& name, const std::string& transit_to, Args&&... args) {
+    static_assert(std::is_base_of<EventBase, E>::value,
+                  "Accepts only classes derived from EventBase");
+    std::shared_ptr<E> event = arena_ ? arena_->make<E>(std::forward<Args>(args)...)
+                                      : std::make_shared<E>(std::forward<Args>(args)...);
+    registerEvent<priority>(name, transit_to, event.get());
+    owned_events_[eventIds().intern(name)] = event;
+    return event.get();
   }
 
  protected:
+  // the engine checks and updates the ancestors of the active state itself
+  friend class StateMachineEngine;
+  // registers the transitions of loaded definitions, whose priorities are only known at runtime
+  friend class MachineFactory;
+
   void reset();
 
+  // a state outside an engine makes its own name tables on first use
+  inline NameTable& stateIds() {
+    if (!state_ids_) {
+      makeIdTables();
+    }
+    return *state_ids_;
+  }
+  inline NameTable& eventIds() {
+    if (!event_ids_) {
+      makeIdTables();
+    }
+    return *event_ids_;
+  }
+  void makeIdTables();
+
+  /**
+   * @brief Take the highest-priority event whose condition is met, if any.
+   *
+   * Writes to the inputs of tracked events and invalidate() raise the state's dirty flag
+   * and the event's own. While no event is untracked and the flag is down, no event can
+   * have become true and nothing is walked. Otherwise only untracked events and tracked
+   * ones with a raised flag run their guards; the others answer from their cache.
+   */
   bool checkCondition();
+  /// Take the transition registered as event without checking its guard, if there is one.
+  bool dispatch(Handle event);
+  bool evaluate(EventPack& e);
+  static bool evaluateAt(void* self, size_t index);
+  void bindConditionMetrics();
+
+  typedef std::function<std::unique_ptr<EventBase>()> EventMaker;
+
+  /**
+   * @brief A transition added from outside the state's own hooks, e.g. by MachineFactory.
+   * Clones of the engine add it again to their instance; exactly one of expression and
+   * make is set.
+   */
+  struct AddedTransition {
+    std::string name, transit_to;
+    Priority priority;
+    std::string expression;
+    EventMaker make;
+  };
+
+  /// Registered from outside the state's hooks in a way a clone cannot repeat.
+  inline bool hasForeignEvents() const { return foreign_events_; }
 
-  void sortByPriority(std::vector<EventPack>& events);
+  inline const std::vector<AddedTransition>& getAddedTransitions() const { return added_; }
+
+  /// Add what another instance of this state had added from outside.
+  void addTransitions(const std::vector<AddedTransition>& transitions);
+
+  void addEvent(EventPack&& pack);
+  void addExpression(const std::string& name, const std::string& transit_to, Priority priority,
+                     const std::string& expression);
+  /// Register the event made by make, which the state then owns.
+  void adoptEvent(const std::string& name, const std::string& transit_to, Priority priority,
+                  const EventMaker& make);
+  /// Continue a visit that began at entered instead of now; called right after enter().
+  void resume(const TimePoint& entered);
   void onEnter();
   void onLeave();
   void update();
+  void waitForNextTick();
 
   virtual void UpdateImpl() = 0;
   virtual void onEnterImpl() = 0;
   virtual void onLeaveImpl() = 0;
 
-  bool is_enter_, is_terminate_;
+  /// Register the state's outgoing transitions. Events registered later (e.g. from
+  /// onEnterImpl) replace an entry of the same name instead of growing the table.
+  virtual void registerEventsImpl() {}
+
+  bool is_enter_, is_terminate_, event_driven_;
   DurationType tick_interval_;
+  WakeupSignal::SharedPtr wakeup_;
+  TimingWheel::SharedPtr timers_;
+  Clock::SharedPtr clock_;
   std::string id_;
-  std::string last_state_id_, next_state_id_, trigger_event_id_;
-  std::vector<EventPack> events_;
+  Handle handle_;
+  Handle last_state_, next_state_, trigger_event_;
+  NameTable::SharedPtr state_ids_, event_ids_;
+  std::vector<EventPack> events_;  // kept sorted by descending priority
+  size_t untracked_;               // events of events_ evaluated on every check
+  DirtyFlag dirty_;                // raised when a tracked event may have changed
+  std::unordered_map<Handle, std::shared_ptr<InputSubscription>> subscriptions_;  // by event
+  // by event id; registering another event under the id releases the owned one
+  std::unordered_map<Handle, std::shared_ptr<EventBase>> owned_events_;
+  int own_hooks_;  // hooks of the state running; what they register every instance repeats
+  std::vector<AddedTransition> added_;
+  bool foreign_events_;
+  MachineArena::SharedPtr arena_;
   std::weak_ptr<StateBase> prev_;
-  float tic_, toc_, duration_;
+  TimePoint entered_, left_, last_tick_, tick_started_;
+  // hot paths read metrics_ and condition_metrics_ only while the flag is set
+  inline StateMetrics* activeMetrics() const {
+    return metrics_enabled_.load(std::memory_order_acquire) ? metrics_.get() : nullptr;
+  }
+  std::atomic<bool> metrics_enabled_;
+  StateMetrics::SharedPtr metrics_;  // set once, by the first enableMetrics()
+  std::vector<LatencyHistogram*> condition_metrics_;  // parallel to events_ once allocated
+  GuardPool::SharedPtr guard_pool_;
+  GuardPool::Batch guard_batch_;
   BlackboardType::Ptr blackboard_;
+  TypedBlackboard::SharedPtr typed_blackboard_;
 };
 
 }  // namespace sm
\ No newline at end of file
@@ -0,0 +1,354 @@
+#pragma once
+
+#include "state_machine/basic_struct.h"
+#include "state_machine/util.h"
+#include "state_machine/exception.h"
+#include "state_machine/blackboard.h"
+#include "state_machine/event.h"
+
+namespace sm {
+
+/**
+ * Compile-time state machine.
+ *
+ * States, events and transitions are declared as types and the dispatch is resolved by the
+ * compiler: no virtual calls, no std::function, no name lookups and no heap allocation per
+ * transition. States keep the StateBase hook names (onEnterImpl / UpdateImpl / onLeaveImpl)
+ * and the same blackboard_, so a state can be moved over by changing its base class to
+ * StaticStateBase and dropping the `override` keywords.
+ *
+ *   using Table = TransitionTable<
+ *       Transition<StateA, CountTo<5>, StateB>,
+ *       Transition<StateB, Always, StateC, IsReady>,
+ *       Transition<StateC, Timeout, StateA>>;
+ *   StaticStateMachine<Table> machine;
+ *   machine.spinUntilStateChange(tick_interval);
+ *
+ * Rows are evaluated in declaration order and the first one that fires wins, so the table
+ * order is the priority order. An event type with a `bool update()` member is polled every
+ * tick like EventBase; any other event type is a tag that only fires through processEvent().
+ */
+
+/// Guard that always passes.
+struct NoGuard {
+  constexpr bool operator()(const BlackboardType::Ptr&) const { return true; }
+};
+
+/// Polled event that fires on every tick, for transitions driven by the guard alone.
+struct Always {
+  constexpr bool update() const { return true; }
+};
+
+template <typename Src, typename Event, typename Dst, typename Guard = NoGuard>
+struct Transition {
+  using Source = Src;
+  using EventType = Event;
+  using Target = Dst;
+  using GuardType = Guard;
+};
+
+template <typename... Rows>
+struct TransitionTable {};
+
+/// Optional base for states of a StaticStateMachine. Hooks are hidden, not overridden.
+class StaticStateBase {
+ public:
+  inline void setBlackBoard(const BlackboardType::Ptr& blackboard) { blackboard_ = blackboard; }
+
+  void onEnterImpl() {}
+  void UpdateImpl() {}
+  void onLeaveImpl() {}
+
+ protected:
+  BlackboardType::Ptr blackboard_;
+};
+
+namespace detail {
+
+template <typename... Ts>
+struct TypeList {};
+
+template <typename T, typename List>
+struct Contains;
+
+template <typename T, typename... Ts>
+struct Contains<T, TypeList<Ts...>> : std::disjunction<std::is_same<T, Ts>...> {};
+
+template <typename List, typename T, bool = Contains<T, List>::value>
+struct PushUnique;
+
+template <typename... Ts, typename T>
+struct PushUnique<TypeList<Ts...>, T, true> {
+  using type = TypeList<Ts...>;
+};
+
+template <typename... Ts, typename T>
+struct PushUnique<TypeList<Ts...>, T, false> {
+  using type = TypeList<Ts..., T>;
+};
+
+template <typename List, typename... Ts>
+struct Unique {
+  using type = List;
+};
+
+template <typename List, typename T, typename... Ts>
+struct Unique<List, T, Ts...> : Unique<typename PushUnique<List, T>::type, Ts...> {};
+
+template <typename T, typename List>
+struct IndexOf;
+
+template <typename T, typename... Ts>
+struct IndexOf<T, TypeList<T, Ts...>> : std::integral_constant<std::size_t, 0> {};
+
+template <typename T, typename U, typename... Ts>
+struct IndexOf<T, TypeList<U, Ts...>>
+    : std::integral_constant<std::size_t, 1 + IndexOf<T, TypeList<Ts...>>::value> {};
+
+template <typename List>
+struct ToTuple;
+
+template <typename... Ts>
+struct ToTuple<TypeList<Ts...>> {
+  using type = std::tuple<Ts...>;
+};
+
+template <typename List>
+struct Size;
+
+template <typename... Ts>
+struct Size<TypeList<Ts...>> : std::integral_constant<std::size_t, sizeof...(Ts)> {};
+
+template <std::size_t I, typename List>
+struct At;
+
+template <std::size_t I, typename... Ts>
+struct At<I, TypeList<Ts...>> {
+  using type = std::tuple_element_t<I, std::tuple<Ts...>>;
+};
+
+template <typename T, typename = void>
+struct IsPolled : std::false_type {};
+
+template <typename T>
+struct IsPolled<T, std::void_t<decltype(std::declval<T&>().update())>> : std::true_type {};
+
+template <typename T, typename = void>
+struct HasOnStart : std::false_type {};
+
+template <typename T>
+struct HasOnStart<T, std::void_t<decltype(std::declval<T&>().onStart())>> : std::true_type {};
+
+template <typename T, typename = void>
+struct HasOnLeave : std::false_type {};
+
+template <typename T>
+struct HasOnLeave<T, std::void_t<decltype(std::declval<T&>().onLeave())>> : std::true_type {};
+
+template <typename T, typename = void>
+struct HasBlackBoard : std::false_type {};
+
+template <typename T>
+struct HasBlackBoard<T, std::void_t<decltype(std::declval<T&>().setBlackBoard(
+                            std::declval<const BlackboardType::Ptr&>()))>> : std::true_type {};
+
+template <typename List, typename... Ts>
+struct PolledOnly {
+  using type = List;
+};
+
+template <typename List, typename T, typename... Ts>
+struct PolledOnly<List, T, Ts...>
+    : PolledOnly<std::conditional_t<IsPolled<T>::value, typename PushUnique<List, T>::type, List>,
+                 Ts...> {};
+
+template <typename Table>
+struct TableTraits;
+
+template <typename... Rows>
+struct TableTraits<TransitionTable<Rows...>> {
+  static_assert(sizeof...(Rows) > 0, "Transition table must not be empty");
+  using States =
+      typename Unique<TypeList<>, typename Rows::Source..., typename Rows::Target...>::type;
+  using Events = typename PolledOnly<TypeList<>, typename Rows::EventType...>::type;
+  using Initial = typename At<0, TypeList<typename Rows::Source...>>::type;
+};
+
+}  // namespace detail
+
+template <typename Table, typename Initial = typename detail::TableTraits<Table>::Initial>
+class StaticStateMachine;
+
+template <typename Initial, typename... Rows>
+class StaticStateMachine<TransitionTable<Rows...>, Initial> {
+  using Traits = detail::TableTraits<TransitionTable<Rows...>>;
+  using StateList = typename Traits::States;
+  using EventList = typename Traits::Events;
+  static constexpr std::size_t kStateNumber = detail::Size<StateList>::value;
+
+ public:
+  explicit StaticStateMachine(const BlackboardType::Ptr& blackboard = BlackboardType::create())
+      : active_(detail::IndexOf<Initial, StateList>::value), is_enter_(false),
+        blackboard_(blackboard) {
+    std::apply([this](auto&... s) { (setBlackBoard(s), ...); }, states_);
+    std::apply([this](auto&... e) { (setBlackBoard(e), ...); }, events_);
+  }
+
+  BlackboardType::Ptr getBlackboard() { return blackboard_; }
+
+  template <typename S>
+  S& state() {
+    return std::get<S>(states_);
+  }
+
+  template <typename E>
+  E& event() {
+    return std::get<E>(events_);
+  }
+
+  template <typename S>
+  bool isIn() const {
+    return active_ == detail::IndexOf<S, StateList>::value;
+  }
+
+  std::size_t getCurrentStateIndex() const { return active_; }
+
+  static constexpr std::size_t StateNumber() { return kStateNumber; }
+
+  /// Enter the initial state. Called by the first tick() if not done explicitly.
+  void start() {
+    if (!is_enter_) {
+      visit([this](auto index) { enter<index.value>(); });
+      is_enter_ = true;
+    }
+  }
+
+  /// Run one tick of the active state: poll its transitions, then update it if none fired.
+  /// Return true if the machine changed state.
+  bool tick() {
+    start();
+    bool transited = false;
+    visit([this, &transited](auto index) { transited = tickState<index.value>(); });
+    return transited;
+  }
+
+  /// Fire a tag event against the active state. Return true if a transition was taken.
+  template <typename E>
+  bool processEvent(const E&) {
+    start();
+    bool transited = false;
+    visit([this, &transited](auto index) {
+      using S = typename detail::At<index.value, StateList>::type;
+      transited = (tryTagged<S, E, Rows>() || ...);
+    });
+    return transited;
+  }
+
+  void spinUntilStateChange(const DurationType& tick_interval) {
+    while (!tick()) {
+      std::this_thread::sleep_for(tick_interval);
+    }
+  }
+
+ private:
+  template <typename T>
+  void setBlackBoard(T& obj) {
+    if constexpr (detail::HasBlackBoard<T>::value) {
+      obj.setBlackBoard(blackboard_);
+    }
+  }
+
+  template <typename F, std::size_t... I>
+  void visitImpl(F&& f, std::index_sequence<I...>) {
+    ((active_ == I ? (f(std::integral_constant<std::size_t, I>{}), true) : false) || ...);
+  }
+
+  template <typename F>
+  void visit(F&& f) {
+    visitImpl(std::forward<F>(f), std::make_index_sequence<kStateNumber>{});
+  }
+
+  template <std::size_t I>
+  bool tickState() {
+    using S = typename detail::At<I, StateList>::type;
+    if ((tryPolled<S, Rows>() || ...)) {
+      return true;
+    }
+    std::get<I>(states_).UpdateImpl();
+    return false;
+  }
+
+  template <typename S, typename Row>
+  bool tryPolled() {
+    using E = typename Row::EventType;
+    if constexpr (std::is_same<S, typename Row::Source>::value && detail::IsPolled<E>::value) {
+      if (std::get<E>(events_).E::update() && typename Row::GuardType{}(blackboard_)) {
+        transit<S, typename Row::Target>();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  template <typename S, typename E, typename Row>
+  bool tryTagged() {
+    if constexpr (std::is_same<S, typename Row::Source>::value &&
+                  std::is_same<E, typename Row::EventType>::value) {
+      if (typename Row::GuardType{}(blackboard_)) {
+        transit<S, typename Row::Target>();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  template <typename Src, typename Dst>
+  void transit() {
+    leave<detail::IndexOf<Src, StateList>::value>();
+    active_ = detail::IndexOf<Dst, StateList>::value;
+    enter<detail::IndexOf<Dst, StateList>::value>();
+  }
+
+  template <std::size_t I>
+  void enter() {
+    using S = typename detail::At<I, StateList>::type;
+    std::apply([](auto&... e) { (startEvent<S>(e), ...); }, events_);
+    std::get<I>(states_).S::onEnterImpl();
+  }
+
+  template <std::size_t I>
+  void leave() {
+    using S = typename detail::At<I, StateList>::type;
+    std::get<I>(states_).S::onLeaveImpl();
+    std::apply([](auto&... e) { (leaveEvent<S>(e), ...); }, events_);
+  }
+
+  /// True if some transition leaving S is driven by event type E.
+  template <typename S, typename E>
+  static constexpr bool polledBy() {
+    return ((std::is_same<S, typename Rows::Source>::value &&
+             std::is_same<E, typename Rows::EventType>::value) || ...);
+  }
+
+  template <typename S, typename E>
+  static void startEvent(E& event) {
+    if constexpr (polledBy<S, E>() && detail::HasOnStart<E>::value) {
+      event.E::onStart();
+    }
+  }
+
+  template <typename S, typename E>
+  static void leaveEvent(E& event) {
+    if constexpr (polledBy<S, E>() && detail::HasOnLeave<E>::value) {
+      event.E::onLeave();
+    }
+  }
+
+  typename detail::ToTuple<StateList>::type states_;
+  typename detail::ToTuple<EventList>::type events_;
+  std::size_t active_;
+  bool is_enter_;
+  BlackboardType::Ptr blackboard_;
+};
+
+}  // namespace sm
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "state_machine/util.h"
+
+namespace sm {
+
+typedef void (*TimerCallback)(void* context);
+typedef uint64_t TimerId;
+constexpr TimerId kInvalidTimer = 0;
+
+/**
+ * @brief Hierarchical timing wheel.
+ *
+ * Timers are hashed into kLevels wheels of kSlots slots each; level L has a granularity of
+ * kSlots^L ticks. Scheduling and cancelling are O(1), and advance() only visits ticks where a
+ * slot holds timers or a higher level must be cascaded, so an idle wheel costs nothing.
+ *
+ * The wheel is driven with explicit time points and is not thread-safe: it is meant to be
+ * advanced by the thread that runs the state machine. Callbacks must not call advance().
+ */
+class TimingWheel {
+ public:
+  typedef std::shared_ptr<TimingWheel> SharedPtr;
+  using Clock = std::chrono::steady_clock;
+  using TimePoint = Clock::time_point;
+
+  static constexpr int kLevelBits = 6;
+  static constexpr int kLevels = 4;
+  static constexpr uint64_t kSlots = 1ULL << kLevelBits;
+
+  explicit TimingWheel(const DurationType& resolution = std::chrono::milliseconds(1),
+                       const TimePoint& origin = Clock::now());
+
+  /// Call callback(context) from advance() once deadline has passed.
+  TimerId schedule(const TimePoint& deadline, TimerCallback callback, void* context);
+
+  /// Return false if the timer already fired or was cancelled.
+  bool cancel(TimerId id);
+
+  /// Fire every timer whose deadline is not after now. Return the number of timers fired.
+  size_t advance(const TimePoint& now);
+
+  /// Earliest time advance() has work to do, or TimePoint::max() if no timer is pending.
+  /// Timers on the upper levels report the time they are cascaded, which is never late.
+  TimePoint nextDeadline() const;
+
+  inline size_t pendingNumber() const { return pending_; }
+
+  inline const DurationType& getResolution() const { return resolution_; }
+
+ private:
+  struct Node {
+    uint64_t expiry;
+    TimerCallback callback;
+    void* context;
+    uint32_t generation;
+    uint32_t prev, next;
+    int16_t level;  // wheel level, kDueLevel, kFiringLevel, or -1 when free
+    uint16_t slot;
+  };
+
+  static constexpr uint32_t kNil = std::numeric_limits<uint32_t>::max();
+  static constexpr int kDueLevel = kLevels;
+  static constexpr int kFiringLevel = kLevels + 1;
+
+  uint64_t toTick(const TimePoint& time, bool round_up) const;
+  TimePoint toTime(uint64_t tick) const;
+  uint64_t nextEventTick() const;
+  void place(uint32_t index);
+  uint32_t& headOf(int level, uint16_t slot);
+  void link(uint32_t index, int level, uint16_t slot);
+  void unlink(uint32_t index);
+  void cascade(int level, uint16_t slot);
+  void release(uint32_t index);
+  size_t fire(int level, uint16_t slot);
+
+  DurationType resolution_;
+  TimePoint origin_;
+  uint64_t current_tick_;
+  size_t pending_;
+  std::vector<Node> nodes_;
+  uint32_t free_head_;
+  uint32_t due_head_;  // timers scheduled with a deadline that already passed
+  uint32_t firing_head_;
+  uint32_t heads_[kLevels][kSlots];
+  uint64_t occupied_[kLevels];  // bit s set iff heads_[level][s] is non-empty
+};
+
+}  // namespace sm
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "state_machine/util.h"
+
+namespace sm {
+
+/// One transition taken by a StateMachineEngine. Fixed-size so it can be copied to disk as is.
+struct TransitionRecord {
+  int64_t timestamp;  // steady clock, ns
+  int64_t duration;   // ns spent in the source state
+  Handle from;
+  Handle to;
+  Handle event;
+  uint32_t reserved;
+};
+static_assert(sizeof(TransitionRecord) == 32, "TransitionRecord is part of the file format");
+
+/// Trace file content, as read back by TraceFile::load().
+struct TraceContents {
+  std::vector<TransitionRecord> records;  // oldest first
+  std::vector<std::string> states, events;
+  uint64_t recorded = 0;  // transitions ever written, including overwritten ones
+
+  std::string stateName(Handle handle) const;
+  std::string eventName(Handle handle) const;
+
+  /// One human readable line per record.
+  std::string describe(const TransitionRecord& record) const;
+};
+
+/**
+ * @brief Memory-mapped ring of TransitionRecords.
+ *
+ * append() is a memcpy into the mapping and an atomic store of the record count, so the
+ * live machine never makes a system call for it. The names the handles refer to are
+ * written by writeNames(), after the record area.
+ */
+class TraceFile {
+ public:
+  typedef std::shared_ptr<TraceFile> SharedPtr;
+
+  /// Create (or truncate) path to hold the last capacity records. Throws on I/O errors.
+  TraceFile(const std::string& path, size_t capacity);
+  virtual ~TraceFile();
+
+  TraceFile(const TraceFile&) = delete;
+  TraceFile& operator=(const TraceFile&) = delete;
+
+  void append(const TransitionRecord& record);
+
+  /// Store the state and event names; call again once new ones were interned.
+  void writeNames(const NameTable& states, const NameTable& events);
+
+  inline const std::string& path() const { return path_; }
+
+  static TraceContents load(const std::string& path);
+
+ private:
+  struct Header;
+
+  std::string path_;
+  int fd_;
+  size_t capacity_;
+  size_t mapped_size_;
+  Header* header_;
+  TransitionRecord* records_;
+};
+
+/**
+ * @brief Fixed-capacity ring of the latest transitions.
+ *
+ * Memory use is bounded: once full, every record replaces the oldest one. Records can also
+ * be mirrored to a TraceFile for offline inspection. Only the thread stepping the engine
+ * may call record(); read it from that thread or while the engine is not stepped.
+ */
+class TransitionTrace {
+ public:
+  explicit TransitionTrace(size_t capacity = 1024);
+
+  inline void record(const TransitionRecord& record) {
+    ring_[count_ % ring_.size()] = record;
+    count_++;
+    if (file_) {
+      file_->append(record);
+    }
+  }
+
+  inline size_t capacity() const { return ring_.size(); }
+
+  /// Number of records currently kept.
+  inline size_t size() const { return count_ < ring_.size() ? count_ : ring_.size(); }
+
+  /// Transitions ever recorded, including the ones already overwritten.
+  inline uint64_t recordedNumber() const { return count_; }
+
+  /// Kept records, oldest first.
+  std::vector<TransitionRecord> records() const;
+
+  void clear();
+
+  /// Mirror every following record to file; nullptr stops mirroring.
+  inline void setFile(const TraceFile::SharedPtr& file) { file_ = file; }
+
+  inline const TraceFile::SharedPtr& getFile() const { return file_; }
+
+ private:
+  std::vector<TransitionRecord> ring_;
+  uint64_t count_;
+  TraceFile::SharedPtr file_;
+};
+
+}  // namespace sm
@@ -0,0 +1,380 @@
+#pragma once
+
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <typeindex>
+#include <unordered_map>
+
+#include "state_machine/exception.h"
+#include "state_machine/signal.h"
+
+namespace sm {
+
+namespace detail {
+
+/// Values that fit in one machine word: a single atomic, wait-free for readers and writers.
+template <typename T>
+struct WordStorage {
+  static_assert(sizeof(T) <= sizeof(uint64_t), "WordStorage holds at most 8 bytes");
+
+  WordStorage() : word_(0), version_(0) {}
+
+  T load() const {
+    uint64_t word = word_.load(std::memory_order_acquire);
+    T value;
+    std::memcpy(&value, &word, sizeof(T));
+    return value;
+  }
+
+  void store(const T& value) {
+    uint64_t word = 0;
+    std::memcpy(&word, &value, sizeof(T));
+    word_.store(word, std::memory_order_release);
+    version_.fetch_add(1, std::memory_order_release);
+  }
+
+  uint64_t version() const { return version_.load(std::memory_order_acquire); }
+
+ private:
+  std::atomic<uint64_t> word_;
+  std::atomic<uint64_t> version_;
+};
+
+/// Larger trivially copyable values: a seqlock over atomic words. Readers never block
+/// writers and retry only while a write is in flight; writers serialize per slot only.
+template <typename T>
+struct SeqlockStorage {
+  static constexpr size_t kWords = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+  SeqlockStorage() : seq_(0) {
+    for (auto& w : words_) {
+      w.store(0, std::memory_order_relaxed);
+    }
+    writer_.clear();
+  }
+
+  T load() const {
+    uint64_t buffer[kWords];
+    uint64_t before, after;
+    do {
+      before = seq_.load(std::memory_order_acquire);
+      while (before & 1) {
+        before = seq_.load(std::memory_order_acquire);
+      }
+      for (size_t i = 0; i < kWords; i++) {
+        buffer[i] = words_[i].load(std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      after = seq_.load(std::memory_order_relaxed);
+    } while (before != after);
+    T value;
+    std::memcpy(&value, buffer, sizeof(T));
+    return value;
+  }
+
+  void store(const T& value) {
+    uint64_t buffer[kWords] = {};
+    std::memcpy(buffer, &value, sizeof(T));
+    while (writer_.test_and_set(std::memory_order_acquire)) {
+    }
+    uint64_t seq = seq_.load(std::memory_order_relaxed);
+    seq_.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < kWords; i++) {
+      words_[i].store(buffer[i], std::memory_order_relaxed);
+    }
+    seq_.store(seq + 2, std::memory_order_release);
+    writer_.clear(std::memory_order_release);
+  }
+
+  uint64_t version() const { return seq_.load(std::memory_order_acquire) >> 1; }
+
+ private:
+  std::atomic<uint64_t> seq_;
+  std::atomic<uint64_t> words_[kWords];
+  std::atomic_flag writer_;
+};
+
+/// Everything else (strings, containers, shared pointers): read-copy-update. A write
+/// publishes a new immutable copy, readers keep whatever copy they loaded. Swapping and
+/// copying the pointer takes a per-slot spinlock held for one reference count update, so
+/// unlike the two storages above this one is not wait-free; slots do not contend with
+/// each other.
+template <typename T>
+struct RcuStorage {
+  RcuStorage() : value_(std::make_shared<const T>()), version_(0) { lock_.clear(); }
+
+  T load() const { return *snapshot(); }
+
+  std::shared_ptr<const T> snapshot() const {
+    lock();
+    std::shared_ptr<const T> value = value_;
+    lock_.clear(std::memory_order_release);
+    return value;
+  }
+
+  void store(const T& value) {
+    std::shared_ptr<const T> next = std::make_shared<const T>(value);
+    lock();
+    value_.swap(next);
+    lock_.clear(std::memory_order_release);
+    version_.fetch_add(1, std::memory_order_release);
+    // the previous copy, if this was its last reference, is freed here outside the lock
+  }
+
+  uint64_t version() const { return version_.load(std::memory_order_acquire); }
+
+ private:
+  void lock() const {
+    while (lock_.test_and_set(std::memory_order_acquire)) {
+    }
+  }
+
+  std::shared_ptr<const T> value_;
+  std::atomic<uint64_t> version_;
+  mutable std::atomic_flag lock_;
+};
+
+template <typename T>
+using SlotStorage = std::conditional_t<
+    std::is_trivially_copyable<T>::value && std::is_default_constructible<T>::value,
+    std::conditional_t<(sizeof(T) <= sizeof(uint64_t)), WordStorage<T>, SeqlockStorage<T>>,
+    RcuStorage<T>>;
+
+}  // namespace detail
+
+class TypedBlackboard;
+
+/**
+ * @brief Whether entries of type T are saved in snapshots as raw bytes.
+ *
+ * True for arithmetic and enum types. Trivially copyable alone is not enough: a pointer,
+ * or a struct holding one, would be restored pointing into the previous process.
+ * Specialize it to true for a plain struct of values to have it saved as well.
+ */
+template <typename T>
+struct IsSnapshotSafe
+    : std::integral_constant<bool, std::is_arithmetic<T>::value || std::is_enum<T>::value> {};
+
+/// Raised by whoever changed something a reader caches, cleared by the reader.
+typedef std::shared_ptr<std::atomic<bool>> DirtyFlag;
+
+struct SlotBase {
+  SlotBase(const std::string& key, std::type_index type, uint32_t index)
+      : key(key), type(type), index(index), subscribers_(nullptr) {}
+  virtual ~SlotBase() {
+    for (Subscriber* s = subscribers_.load(std::memory_order_acquire); s;) {
+      Subscriber* next = s->next;
+      delete s;
+      s = next;
+    }
+  }
+  virtual uint64_t version() const = 0;
+
+  /**
+   * @brief Raise reader and then owner after every write from now on.
+   *
+   * Subscribing is lock-free and lasts as long as the slot; a writer walks the list
+   * without locking either. The flags are shared, so one whose reader is gone is still
+   * safe to raise.
+   */
+  void subscribe(const DirtyFlag& reader, const DirtyFlag& owner) const {
+    Subscriber* node =
+        new Subscriber{reader, owner, subscribers_.load(std::memory_order_relaxed)};
+    while (!subscribers_.compare_exchange_weak(node->next, node, std::memory_order_release,
+                                               std::memory_order_relaxed)) {
+    }
+  }
+
+  size_t subscriberNumber() const {
+    size_t number = 0;
+    for (Subscriber* s = subscribers_.load(std::memory_order_acquire); s; s = s->next) {
+      number++;
+    }
+    return number;
+  }
+
+  /// Called after the value was stored, so a reader that clears its flag sees the value.
+  void markSubscribers() const {
+    for (Subscriber* s = subscribers_.load(std::memory_order_acquire); s; s = s->next) {
+      s->reader->store(true, std::memory_order_release);
+      s->owner->store(true, std::memory_order_release);
+    }
+  }
+
+  /// Size of the value as raw bytes for snapshots; 0 unless IsSnapshotSafe.
+  virtual size_t byteSize() const { return 0; }
+  virtual void readBytes(void*) const {}
+  virtual void writeBytes(const void*) {}
+
+  const std::string key;
+  const std::type_index type;
+  const uint32_t index;
+
+ private:
+  struct Subscriber {
+    DirtyFlag reader, owner;
+    Subscriber* next;
+  };
+  mutable std::atomic<Subscriber*> subscribers_;
+};
+
+template <typename T>
+struct Slot : public SlotBase {
+  Slot(const std::string& key, uint32_t index, WakeupSignal::SharedPtr* wakeup)
+      : SlotBase(key, typeid(T), index), wakeup(wakeup) {}
+  uint64_t version() const override { return storage.version(); }
+
+  static constexpr bool kSnapshotSafe = IsSnapshotSafe<T>::value;
+  static_assert(!kSnapshotSafe || (std::is_trivially_copyable<T>::value &&
+                                   std::is_default_constructible<T>::value),
+                "IsSnapshotSafe types must be trivially copyable and default constructible");
+
+  size_t byteSize() const override { return kSnapshotSafe ? sizeof(T) : 0; }
+
+  void readBytes(void* out) const override {
+    if constexpr (kSnapshotSafe) {
+      T value = storage.load();
+      std::memcpy(out, &value, sizeof(T));
+    }
+  }
+
+  void writeBytes(const void* in) override {
+    if constexpr (kSnapshotSafe) {
+      T value;
+      std::memcpy(&value, in, sizeof(T));
+      storage.store(value);
+      markSubscribers();
+    }
+  }
+
+  detail::SlotStorage<T> storage;
+  WakeupSignal::SharedPtr* wakeup;  // owned by the blackboard
+};
+
+/**
+ * @brief Typed handle to one TypedBlackboard entry.
+ *
+ * Resolve it once with TypedBlackboard::entry<T>(key); get() and set() then touch only the
+ * entry's own slot: no hashing, no any_cast and no shared lock.
+ */
+template <typename T>
+class Entry {
+ public:
+  Entry() : slot_(nullptr) {}
+  explicit Entry(Slot<T>* slot) : slot_(slot) {}
+
+  inline bool valid() const { return slot_ != nullptr; }
+
+  inline T get() const { return slot_->storage.load(); }
+
+  void set(const T& value) {
+    slot_->storage.store(value);
+    slot_->markSubscribers();
+    if (*slot_->wakeup) {
+      (*slot_->wakeup)->notify();
+    }
+  }
+
+  /// Incremented by every set(); 0 while the entry was never written.
+  inline uint64_t version() const { return slot_->storage.version(); }
+
+  inline bool isSet() const { return version() != 0; }
+
+  inline const std::string& key() const { return slot_->key; }
+
+  inline uint32_t index() const { return slot_->index; }
+
+ private:
+  Slot<T>* slot_;
+};
+
+/**
+ * @brief Blackboard with typed, pre-resolved entries for the hot path.
+ *
+ * Looking up a key takes a mutex and is meant for setup; the returned Entry<T> is valid for
+ * the blackboard's lifetime. Writers can wake a state machine through setWakeupSignal().
+ */
+class TypedBlackboard {
+ public:
+  typedef std::shared_ptr<TypedBlackboard> SharedPtr;
+
+  static SharedPtr create() { return SharedPtr(new TypedBlackboard()); }
+
+  virtual ~TypedBlackboard() = default;
+
+  /// Return the entry for key, creating it on first use. Throws if key holds another type.
+  template <typename T>
+  Entry<T> entry(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      if (it->second->type != std::type_index(typeid(T))) {
+        throw LogicError("TypedBlackboard entry [" + key + "] was created with another type");
+      }
+      return Entry<T>(static_cast<Slot<T>*>(it->second));
+    }
+    auto slot = new Slot<T>(key, static_cast<uint32_t>(slots_.size()), &wakeup_);
+    slots_.emplace_back(slot);
+    index_.emplace(key, slot);
+    size_.store(slots_.size(), std::memory_order_release);
+    return Entry<T>(slot);
+  }
+
+  /// Convenience accessors that resolve the key on every call.
+  template <typename T>
+  T get(const std::string& key) {
+    return entry<T>(key).get();
+  }
+
+  template <typename T>
+  void set(const std::string& key, const T& value) {
+    entry<T>(key).set(value);
+  }
+
+  bool has(const std::string& key) const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return index_.find(key) != index_.end();
+  }
+
+  /// Number of entries; lock-free, so readers can poll it for new ones.
+  size_t size() const { return size_.load(std::memory_order_acquire); }
+
+  /// Slot of key, nullptr if no entry was created for it yet.
+  const SlotBase* find(const std::string& key) const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto it = index_.find(key);
+    return it == index_.end() ? nullptr : it->second;
+  }
+
+  SlotBase* find(const std::string& key) {
+    return const_cast<SlotBase*>(static_cast<const TypedBlackboard*>(this)->find(key));
+  }
+
+  /// Slot by entry index, for code that tracks entries generically.
+  const SlotBase* slot(uint32_t index) const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return index < slots_.size() ? slots_[index].get() : nullptr;
+  }
+
+  /// Notify signal after every write, e.g. to wake the state machine reading the entries.
+  /// Set it before writers start.
+  void setWakeupSignal(const WakeupSignal::SharedPtr& wakeup) { wakeup_ = wakeup; }
+
+ protected:
+  TypedBlackboard() : size_(0) {}
+
+ private:
+  mutable std::mutex mtx_;
+  std::deque<std::unique_ptr<SlotBase>> slots_;
+  std::unordered_map<std::string, SlotBase*> index_;
+  WakeupSignal::SharedPtr wakeup_;
+  std::atomic<size_t> size_;
+};
+
+}  // namespace sm
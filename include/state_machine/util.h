@@ -9,8 +9,11 @@
 
 #include <unistd.h>
 #include <algorithm>
+#include <cassert>
 #include <cmath>
 #include <cstdlib>
+#include <deque>
+#include <limits>
 #include <iostream>
 #include <list>
 #include <map>
@@ -20,81 +23,191 @@
 #include <map>
 #include <vector>
 #include <type_traits>
+#include <unordered_map>
 #include <functional>
+#include <optional>
 #include <chrono>
 #include <thread>
 #include <tuple>
 #include <shared_mutex>
 #include <mutex>
 
-#include <boost/uuid/uuid.hpp>
-#include <boost/uuid/uuid_generators.hpp>
-#include <boost/uuid/uuid_io.hpp>
-
 #include <behaviortree_cpp_v3/blackboard.h>
 
+#include "state_machine/arena.h"
 #include "state_machine/exception.h"
+#include "state_machine/logging.h"
 
 namespace sm {
 
+typedef uint32_t Handle;
+constexpr Handle kInvalidHandle = std::numeric_limits<Handle>::max();
+
+/**
+ * @brief Interns names into dense integer handles.
+ *
+ * Handles are assigned in insertion order starting from 0 and never change, so they can
+ * index flat arrays. Names are only looked up when crossing the API boundary.
+ */
+template <typename ID>
+class IdTable {
+ public:
+  typedef std::shared_ptr<IdTable> SharedPtr;
+
+  IdTable() = default;
+
+  /// Return the handle of name, assigning the next free one if it is new.
+  Handle intern(const ID& name) {
+    {
+      std::shared_lock<std::shared_mutex> lock(mtx_);
+      auto it = ids_.find(name);
+      if (it != ids_.end()) {
+        return it->second;
+      }
+    }
+    std::unique_lock<std::shared_mutex> lock(mtx_);
+    auto inserted = ids_.emplace(name, static_cast<Handle>(names_.size()));
+    if (inserted.second) {
+      names_.push_back(name);
+    }
+    return inserted.first->second;
+  }
+
+  /// Return the handle of name, or kInvalidHandle if it was never interned.
+  Handle find(const ID& name) const {
+    std::shared_lock<std::shared_mutex> lock(mtx_);
+    auto it = ids_.find(name);
+    return (it == ids_.end()) ? kInvalidHandle : it->second;
+  }
+
+  const ID& name(Handle handle) const {
+    std::shared_lock<std::shared_mutex> lock(mtx_);
+    if (handle >= names_.size()) {
+      throw RuntimeError("invalid handle: " + std::to_string(handle));
+    }
+    return names_[handle];
+  }
+
+  size_t size() const {
+    std::shared_lock<std::shared_mutex> lock(mtx_);
+    return names_.size();
+  }
+
+ private:
+  mutable std::shared_mutex mtx_;
+  std::unordered_map<ID, Handle> ids_;
+  std::deque<ID> names_;  // deque keeps references returned by name() stable
+};
+
+typedef IdTable<std::string> NameTable;
+
 template <typename ID, typename ResourceT>
 class ResourceKeeper {
  public:
   typedef std::unordered_map<ID, std::shared_ptr<ResourceT>> ResourceMap;
 
-  ResourceKeeper() = default;
+  ResourceKeeper() : ids_(std::make_shared<IdTable<ID>>()), size_(0) {}
+
+  explicit ResourceKeeper(const typename IdTable<ID>::SharedPtr& ids) : ids_(ids), size_(0) {}
 
   virtual ~ResourceKeeper() {
-    for(auto &c : map_) {
-      c.second.reset();
+    for(auto &c : slots_) {
+      c.reset();
     }
   }
 
-  ResourceMap getResourceMap() const { return map_; }
+  const typename IdTable<ID>::SharedPtr& getIdTable() const { return ids_; }
 
-  int getResourceSize() const { return map_.size(); }
+  /// Allocate the resources added from now on from arena; nullptr uses the heap.
+  void setArena(const MachineArena::SharedPtr& arena) { arena_ = arena; }
 
-  bool hasResource(const ID& name) {
-    if(map_.find(name) != map_.end()) {
-      return true;
+  ResourceMap getResourceMap() const {
+    std::shared_lock<std::shared_mutex> lock(mtx_);
+    ResourceMap map;
+    for (Handle h = 0; h < slots_.size(); ++h) {
+      if (slots_[h]) {
+        map.emplace(ids_->name(h), slots_[h]);
+      }
     }
-    return false;
+    return map;
+  }
+
+  int getResourceSize() const {
+    std::shared_lock<std::shared_mutex> lock(mtx_);
+    return size_;
+  }
+
+  bool hasResource(const ID& name) const { return hasResource(ids_->find(name)); }
+
+  bool hasResource(Handle handle) const {
+    std::shared_lock<std::shared_mutex> lock(mtx_);
+    return hasResourceLocked(handle);
+  }
+
+  /// Handle of name, or kInvalidHandle if no resource was ever registered under it.
+  Handle getHandle(const ID& name) const { return ids_->find(name); }
+
+  std::shared_ptr<ResourceT> getResource(const ID &name) const {
+    return getResource(ids_->find(name));
   }
 
-  std::shared_ptr<ResourceT> getResource(const ID &name) {
+  std::shared_ptr<ResourceT> getResource(Handle handle) const {
     std::shared_lock<std::shared_mutex> lock(mtx_);
-    if (!hasResource(name)) {
+    if (!hasResourceLocked(handle)) {
       return nullptr;
     }
-    return map_[name];
+    return slots_[handle];
   }
 
   template <typename T, typename... Args>
   ResourceKeeper& addResource(const ID &name, Args &&... data) {
+    Handle handle = ids_->intern(name);
     std::unique_lock<std::shared_mutex> lock(mtx_);
-    if(hasResource(name)) {
+    if(hasResourceLocked(handle)) {
       throw RuntimeError("try to add a resource that already exists");
     }
-    map_.emplace(name, new T(name, std::forward<Args>(data)...));
+    if (handle >= slots_.size()) {
+      slots_.resize(handle + 1);
+    }
+    if (arena_) {
+      slots_[handle] = arena_->make<T>(name, std::forward<Args>(data)...);
+    } else {
+      slots_[handle] = std::make_shared<T>(name, std::forward<Args>(data)...);
+    }
+    size_++;
     return *this;
   }
 
   bool removeResource(const ID &name) {
+    Handle handle = ids_->find(name);
     std::unique_lock<std::shared_mutex> lock(mtx_);
-    if (hasResource(name)) {
-      map_[name]->reset(nullptr);
-      map_.erase(name);
+    if (hasResourceLocked(handle)) {
+      slots_[handle].reset();
+      size_--;
       return true;
     }
     return false;
   }
 
 private:
+  // for callers that hold mtx_ already
+  bool hasResourceLocked(Handle handle) const {
+    return handle < slots_.size() && slots_[handle] != nullptr;
+  }
+
   mutable std::shared_mutex mtx_;
-  ResourceMap map_;
+  typename IdTable<ID>::SharedPtr ids_;
+  // indexed by handle; names interned without a resource leave an empty slot
+  std::vector<std::shared_ptr<ResourceT>> slots_;
+  int size_;
+  MachineArena::SharedPtr arena_;
 };
 
 using DurationType = std::chrono::duration<int64_t, std::micro>;
+using TimePoint = std::chrono::steady_clock::time_point;
+
+/// Tick interval of engines and states until one is set.
+constexpr DurationType kDefaultTickInterval = std::chrono::milliseconds(10);
 
 inline double timeNow() {
   auto now = std::chrono::steady_clock::now();
@@ -104,8 +217,8 @@ inline double timeNow() {
   return value.count()*1e-3;
 }
 
-#define updateLog(name) std::cout << #name << " update" << std::endl;
-#define enterLog(name) std::cout << #name << " enter" << std::endl;
-#define leaveLog(name) std::cout << #name << " leave" << std::endl;
+#define updateLog(name) SM_LOG_DEBUG("{} update", #name);
+#define enterLog(name) SM_LOG_INFO("{} enter", #name);
+#define leaveLog(name) SM_LOG_INFO("{} leave", #name);
 
 } // namespace sm
\ No newline at end of file
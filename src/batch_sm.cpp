@@ -0,0 +1,156 @@
+#include "state_machine/batch_sm.h"
+
+#include <cstring>
+
+namespace sm {
+
+namespace {
+
+#if defined(__GNUC__)
+// 16 byte vectors map to SSE2 on x86-64 and NEON on aarch64, both always available
+typedef float FloatLanes __attribute__((vector_size(16)));
+typedef Handle HandleLanes __attribute__((vector_size(16)));
+constexpr size_t kLanes = sizeof(FloatLanes) / sizeof(float);
+#endif
+
+/**
+ * Take row for every instance in row.from that has not taken a transition yet and whose
+ * value holds. Rows are applied in priority order, so masking out instances that already
+ * took one makes the first match win without a branch per instance.
+ */
+template <typename Op>
+void applyRow(const Handle* states, const float* values, Handle* next, Handle* fired,
+              size_t size, const BatchDefinition::Row& row, Op op) {
+  const Handle from = row.from, to = row.to, event = row.event;
+  const float threshold = row.threshold;
+  size_t i = 0;
+#if defined(__GNUC__)
+  for (; i + kLanes <= size; i += kLanes) {
+    HandleLanes state, target, trigger;
+    FloatLanes value;
+    std::memcpy(&state, states + i, sizeof(state));
+    std::memcpy(&target, next + i, sizeof(target));
+    std::memcpy(&trigger, fired + i, sizeof(trigger));
+    std::memcpy(&value, values + i, sizeof(value));
+    // comparisons give all ones per lane that holds
+    HandleLanes take = reinterpret_cast<HandleLanes>((state == from) & (target == kInvalidHandle) &
+                                                     op(value, threshold));
+    target = (target & ~take) | (take & to);
+    trigger = (trigger & ~take) | (take & event);
+    std::memcpy(next + i, &target, sizeof(target));
+    std::memcpy(fired + i, &trigger, sizeof(trigger));
+  }
+#endif
+  for (; i < size; i++) {
+    bool take = (states[i] == from) & (next[i] == kInvalidHandle) & op(values[i], threshold);
+    next[i] = take ? to : next[i];
+    fired[i] = take ? event : fired[i];
+  }
+}
+
+}  // namespace
+
+BatchDefinition::BatchDefinition()
+    : states_(std::make_shared<NameTable>()), inputs_(std::make_shared<NameTable>()),
+      events_(std::make_shared<NameTable>()) {
+  inputs_->intern("elapsed");
+}
+
+void BatchDefinition::addRow(const std::string& event, const std::string& from,
+                             const std::string& to, const std::string& input, Compare op,
+                             float threshold, Priority priority) {
+  Row row{states_->intern(from), states_->intern(to), inputs_->intern(input),
+          events_->intern(event), op, threshold, priority};
+  // insert after rows of equal priority so ties keep registration order
+  auto pos = std::upper_bound(rows_.begin(), rows_.end(), priority,
+                              [](Priority p, const Row& r) { return p > r.priority; });
+  rows_.insert(pos, row);
+}
+
+BatchStateMachine::BatchStateMachine(const BatchDefinition::SharedPtr& definition, size_t size,
+                                     const std::string& initial_state)
+    : definition_(definition), fired_(size, kInvalidHandle), next_(size, kInvalidHandle) {
+  Handle initial = definition_->getStateIdTable()->find(initial_state);
+  if (initial == kInvalidHandle) {
+    throw LogicError("batch definition has no state [" + initial_state + "]");
+  }
+  states_.assign(size, initial);
+  inputs_.assign(definition_->getInputIdTable()->size(), std::vector<float>(size, 0.0f));
+  changed_.reserve(size);
+}
+
+void BatchStateMachine::setState(size_t instance, const std::string& state_id) {
+  Handle state = definition_->getStateIdTable()->find(state_id);
+  if (state == kInvalidHandle) {
+    throw LogicError("batch definition has no state [" + state_id + "]");
+  }
+  states_[instance] = state;
+  inputs_[BatchDefinition::kElapsed][instance] = 0.0f;
+}
+
+float* BatchStateMachine::input(const std::string& input) {
+  Handle handle = definition_->getInputIdTable()->find(input);
+  if (handle == kInvalidHandle) {
+    throw LogicError("batch definition has no input [" + input + "]");
+  }
+  addColumns();
+  return inputs_[handle].data();
+}
+
+void BatchStateMachine::addColumns() {
+  // inputs added to the definition after this batch was created
+  while (inputs_.size() < definition_->getInputIdTable()->size()) {
+    inputs_.emplace_back(size(), 0.0f);
+  }
+}
+
+size_t BatchStateMachine::step(const DurationType& dt) {
+  addColumns();
+  const size_t n = size();
+  const float seconds = std::chrono::duration<float>(dt).count();
+  float* elapsed = inputs_[BatchDefinition::kElapsed].data();
+  for (size_t i = 0; i < n; i++) {
+    elapsed[i] += seconds;
+  }
+  std::fill(next_.begin(), next_.end(), kInvalidHandle);
+  std::fill(fired_.begin(), fired_.end(), kInvalidHandle);
+
+  for (const auto& row : definition_->rows()) {
+    const float* values = inputs_[row.input].data();
+    const Handle* states = states_.data();
+    switch (row.op) {
+      case Compare::Less:
+        applyRow(states, values, next_.data(), fired_.data(), n, row, std::less<>());
+        break;
+      case Compare::LessEqual:
+        applyRow(states, values, next_.data(), fired_.data(), n, row, std::less_equal<>());
+        break;
+      case Compare::Greater:
+        applyRow(states, values, next_.data(), fired_.data(), n, row, std::greater<>());
+        break;
+      case Compare::GreaterEqual:
+        applyRow(states, values, next_.data(), fired_.data(), n, row,
+                 std::greater_equal<>());
+        break;
+      case Compare::Equal:
+        applyRow(states, values, next_.data(), fired_.data(), n, row, std::equal_to<>());
+        break;
+      case Compare::NotEqual:
+        applyRow(states, values, next_.data(), fired_.data(), n, row,
+                 std::not_equal_to<>());
+        break;
+    }
+  }
+
+  changed_.clear();
+  for (size_t i = 0; i < n; i++) {
+    if (next_[i] != kInvalidHandle) {
+      states_[i] = next_[i];
+      elapsed[i] = 0.0f;
+      changed_.push_back(static_cast<uint32_t>(i));
+    }
+  }
+  return changed_.size();
+}
+
+}  // namespace sm
@@ -1,16 +1,89 @@
 #include "state_machine/event.h"
 
+#include <atomic>
+
 namespace sm {
 
-EventBase::EventBase() {
-  boost::uuids::random_generator uuid_gen_;
-  uuid_ = boost::uuids::to_string(uuid_gen_());
-}
+namespace {
+
+std::atomic<uint64_t> next_event_id(0);
+
+}  // namespace
+
+EventBase::EventBase()
+    : id_(next_event_id.fetch_add(1, std::memory_order_relaxed)), clock_(Clock::steady()),
+      tracked_(false), revision_(0) {}
 
 bool EventBase::update() { return true; }
 
+void EventBase::notify() {
+  if (wakeup_) {
+    wakeup_->notify();
+  }
+}
+
+void EventBase::dependsOn(const std::vector<std::string>& keys) {
+  tracked_ = true;
+  inputs_ = keys;
+}
+
 void EventBase::onStart() {}
 
 void EventBase::onLeave() {}
 
+void EventBase::onResume(const TimePoint&) {}
+
+DeadlineEvent::DeadlineEvent(const DurationType& timeout)
+    : EventBase(), timeout_(timeout), timer_(kInvalidTimer), fired_(false) {
+  dependsOn({});
+}
+
+DeadlineEvent::~DeadlineEvent() {
+  if (timers_) {
+    timers_->cancel(timer_);
+  }
+}
+
+bool DeadlineEvent::update() {
+  if (!timers_) {
+    // not driven by an engine, fall back to reading the clock on every check
+    invalidate();
+    return clock_->now() - start_ >= timeout_;
+  }
+  return fired_;
+}
+
+void DeadlineEvent::onStart() {
+  start_ = clock_->now();
+  fired_ = false;
+  invalidate();
+  if (timers_) {
+    timers_->cancel(timer_);
+    timer_ = timers_->schedule(start_ + timeout_, &DeadlineEvent::expire, this);
+  }
+}
+
+void DeadlineEvent::onLeave() {
+  if (timers_) {
+    timers_->cancel(timer_);
+  }
+  timer_ = kInvalidTimer;
+}
+
+void DeadlineEvent::onResume(const TimePoint& entered) {
+  start_ = entered;
+  invalidate();
+  if (timers_) {
+    timers_->cancel(timer_);
+    timer_ = timers_->schedule(start_ + timeout_, &DeadlineEvent::expire, this);
+  }
+}
+
+void DeadlineEvent::expire(void* context) {
+  auto self = static_cast<DeadlineEvent*>(context);
+  self->fired_ = true;
+  self->timer_ = kInvalidTimer;
+  self->invalidate();
+}
+
 }  // namespace sm
\ No newline at end of file
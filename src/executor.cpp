@@ -0,0 +1,217 @@
+#include "state_machine/executor.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <cstring>
+#include <string>
+
+namespace sm {
+
+Executor::Executor(size_t threads, bool pin_workers)
+    : running_(false), idle_workers_(0), next_worker_(0), pin_workers_(pin_workers) {
+  if (threads == 0) {
+    throw LogicError("executor needs at least one worker thread");
+  }
+  for (size_t i = 0; i < threads; i++) {
+    workers_.emplace_back(new Worker());
+  }
+}
+
+Executor::~Executor() {
+  stop();
+  std::lock_guard<std::mutex> lock(tasks_mtx_);
+  for (auto& task : tasks_) {
+    task->engine->getWakeupSignal()->setObserver(nullptr, nullptr);
+  }
+}
+
+void Executor::add(const StateMachineEngine::SharedPtr& engine) {
+  Task* task = new Task();
+  task->engine = engine;
+  task->executor = this;
+  task->status = kReady;
+  task->epoch = 0;
+  size_t index;
+  {
+    std::lock_guard<std::mutex> lock(tasks_mtx_);
+    tasks_.emplace_back(task);
+    index = next_worker_++ % workers_.size();
+  }
+  task->home = index;
+  pushReady(task, index, false);
+  engine->getWakeupSignal()->setObserver(&Executor::wake, task);
+}
+
+size_t Executor::EngineNumber() const {
+  std::lock_guard<std::mutex> lock(tasks_mtx_);
+  return tasks_.size();
+}
+
+void Executor::start() {
+  if (running_.exchange(true)) {
+    return;
+  }
+  for (size_t i = 0; i < workers_.size(); i++) {
+    workers_[i]->thread = std::thread(&Executor::run, this, i);
+    if (pin_workers_) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(i % std::max(1u, std::thread::hardware_concurrency()), &cpus);
+      int error =
+          pthread_setaffinity_np(workers_[i]->thread.native_handle(), sizeof(cpus), &cpus);
+      if (error != 0) {
+        stop();
+        throw RuntimeError("cannot pin executor worker " + std::to_string(i) + " to a cpu: " +
+                           std::strerror(error));
+      }
+    }
+  }
+}
+
+void Executor::stop() {
+  if (!running_.exchange(false)) {
+    return;
+  }
+  for (auto& worker : workers_) {
+    {
+      std::lock_guard<std::mutex> lock(worker->mtx);
+      worker->poked = true;
+    }
+    worker->cv.notify_all();
+  }
+  for (auto& worker : workers_) {
+    if (worker->thread.joinable()) {
+      worker->thread.join();
+    }
+  }
+}
+
+void Executor::wake(void* context) {
+  Task* task = static_cast<Task*>(context);
+  int status = task->status.load();
+  while (true) {
+    if (status == kSleeping) {
+      if (task->status.compare_exchange_weak(status, kReady)) {
+        task->executor->pushReady(task, task->home, false);
+        return;
+      }
+    } else if (status == kRunning) {
+      // the worker running it will queue it again instead of putting it to sleep
+      if (task->status.compare_exchange_weak(status, kRunningNotified)) {
+        return;
+      }
+    } else {
+      return;
+    }
+  }
+}
+
+void Executor::pushReady(Task* task, size_t index, bool front) {
+  Worker& worker = *workers_[index];
+  size_t queued;
+  {
+    std::lock_guard<std::mutex> lock(worker.mtx);
+    if (front) {
+      worker.ready.push_front(task);
+    } else {
+      worker.ready.push_back(task);
+    }
+    queued = worker.ready.size();
+  }
+  worker.cv.notify_one();
+  if (queued > 1 && idle_workers_.load() > 0) {
+    // more work than this worker can take right now, let an idle one steal it
+    for (size_t k = 1; k < workers_.size(); k++) {
+      Worker& other = *workers_[(index + k) % workers_.size()];
+      std::lock_guard<std::mutex> lock(other.mtx);
+      if (other.idle) {
+        other.poked = true;
+        other.cv.notify_one();
+        break;
+      }
+    }
+  }
+}
+
+Executor::Task* Executor::steal(size_t index) {
+  for (size_t k = 1; k < workers_.size(); k++) {
+    Worker& victim = *workers_[(index + k) % workers_.size()];
+    std::unique_lock<std::mutex> lock(victim.mtx, std::try_to_lock);
+    if (lock.owns_lock() && !victim.ready.empty()) {
+      Task* task = victim.ready.front();
+      victim.ready.pop_front();
+      return task;
+    }
+  }
+  return nullptr;
+}
+
+void Executor::run(size_t index) {
+  Worker& worker = *workers_[index];
+  while (running_) {
+    Task* task = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(worker.mtx);
+      auto now = std::chrono::steady_clock::now();
+      while (!worker.sleepers.empty() && worker.sleepers.top().deadline <= now) {
+        Sleeper sleeper = worker.sleepers.top();
+        worker.sleepers.pop();
+        int expected = kSleeping;
+        if (sleeper.task->epoch == sleeper.epoch &&
+            sleeper.task->status.compare_exchange_strong(expected, kReady)) {
+          worker.ready.push_back(sleeper.task);
+        }
+      }
+      if (!worker.ready.empty()) {
+        task = worker.ready.back();
+        worker.ready.pop_back();
+      }
+    }
+    if (!task) {
+      task = steal(index);
+    }
+    if (task) {
+      execute(task, index);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(worker.mtx);
+    TimePoint deadline =
+        worker.sleepers.empty() ? TimePoint::max() : worker.sleepers.top().deadline;
+    worker.idle = true;
+    idle_workers_++;
+    worker.cv.wait_until(lock, deadline, [&worker, this] {
+      return !worker.ready.empty() || worker.poked || !running_;
+    });
+    idle_workers_--;
+    worker.idle = false;
+    worker.poked = false;
+  }
+}
+
+void Executor::execute(Task* task, size_t index) {
+  task->status = kRunning;
+  TimePoint deadline = task->engine->step();
+  if (deadline <= std::chrono::steady_clock::now()) {
+    task->status = kReady;
+    pushReady(task, index, true);
+    return;
+  }
+
+  task->home = index;
+  uint64_t epoch = ++task->epoch;
+  {
+    Worker& worker = *workers_[index];
+    std::lock_guard<std::mutex> lock(worker.mtx);
+    worker.sleepers.push(Sleeper{deadline, task, epoch});
+  }
+  int expected = kRunning;
+  if (!task->status.compare_exchange_strong(expected, kSleeping)) {
+    // notified while stepping
+    task->status = kReady;
+    pushReady(task, index, false);
+  }
+}
+
+}  // namespace sm
@@ -0,0 +1,530 @@
+#include "state_machine/guard_expr.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <sstream>
+#include <typeindex>
+
+namespace sm {
+
+namespace {
+
+using Op = GuardExpression::Op;
+
+inline double apply(Op op, double a, double b) {
+  switch (op) {
+    case Op::kAdd:
+      return a + b;
+    case Op::kSub:
+      return a - b;
+    case Op::kMul:
+      return a * b;
+    case Op::kDiv:
+      return a / b;
+    case Op::kLess:
+      return a < b;
+    case Op::kLessEqual:
+      return a <= b;
+    case Op::kGreater:
+      return a > b;
+    case Op::kGreaterEqual:
+      return a >= b;
+    case Op::kEqual:
+      return a == b;
+    case Op::kNotEqual:
+      return a != b;
+    default:
+      return 0.0;
+  }
+}
+
+template <typename T>
+inline double load(const SlotBase* slot) {
+  return static_cast<double>(static_cast<const Slot<T>*>(slot)->storage.load());
+}
+
+/// Right operand of a binary instruction: its constant, or popped from the stack.
+inline double operand(const GuardExpression::Instruction& in, const double* stack,
+                      size_t& top) {
+  return in.immediate ? in.constant : stack[--top];
+}
+
+struct LoadType {
+  std::type_index type;
+  Op op;
+};
+
+const LoadType kLoadTypes[] = {
+    {typeid(double), Op::kLoadDouble},     {typeid(float), Op::kLoadFloat},
+    {typeid(bool), Op::kLoadBool},         {typeid(int8_t), Op::kLoadInt8},
+    {typeid(int16_t), Op::kLoadInt16},     {typeid(int32_t), Op::kLoadInt32},
+    {typeid(int64_t), Op::kLoadInt64},     {typeid(uint8_t), Op::kLoadUInt8},
+    {typeid(uint16_t), Op::kLoadUInt16},   {typeid(uint32_t), Op::kLoadUInt32},
+    {typeid(uint64_t), Op::kLoadUInt64},
+};
+
+const char* opName(Op op) {
+  static const char* names[] = {
+      "const",
+      "load_double", "load_float", "load_bool",
+      "load_int8", "load_int16", "load_int32", "load_int64",
+      "load_uint8", "load_uint16", "load_uint32", "load_uint64",
+      "elapsed",
+      "neg", "not",
+      "add", "sub", "mul", "div",
+      "less", "less_equal", "greater", "greater_equal", "equal", "not_equal",
+      "jump_if_false", "jump_if_true",
+  };
+  return names[static_cast<size_t>(op)];
+}
+
+}  // namespace
+
+/// Recursive descent parser that folds constants while building the tree, then emits
+/// stack bytecode. Used only by GuardExpression::compile().
+class ExpressionCompiler {
+ public:
+  ExpressionCompiler(GuardExpression& expr, TypedBlackboard& blackboard)
+      : expr_(expr), blackboard_(blackboard), pos_(0), depth_(0), max_depth_(0) {}
+
+  void compile() {
+    auto root = parseOr();
+    skipSpace();
+    if (pos_ != source().size()) {
+      fail("unexpected '" + std::string(1, source()[pos_]) + "'");
+    }
+    emit(*root);
+  }
+
+ private:
+  struct Node {
+    Op op;  // kJumpIfFalse stands for &&, kJumpIfTrue for ||
+    double constant = 0.0;
+    const SlotBase* slot = nullptr;
+    std::unique_ptr<Node> lhs, rhs;
+  };
+  typedef std::unique_ptr<Node> NodePtr;
+
+  const std::string& source() const { return expr_.source_; }
+
+  [[noreturn]] void fail(const std::string& what) const {
+    throw LogicError("guard expression [" + source() + "] at " + std::to_string(pos_) + ": " +
+                     what);
+  }
+
+  void skipSpace() {
+    while (pos_ < source().size() && std::isspace(static_cast<unsigned char>(source()[pos_]))) {
+      pos_++;
+    }
+  }
+
+  bool accept(const char* token) {
+    skipSpace();
+    size_t length = std::char_traits<char>::length(token);
+    if (source().compare(pos_, length, token) != 0) {
+      return false;
+    }
+    // do not read the "<" of "<=" or the "!" of "!="
+    if (length == 1 && pos_ + 1 < source().size() && source()[pos_ + 1] == '=' &&
+        std::string("<>!=").find(token[0]) != std::string::npos) {
+      return false;
+    }
+    pos_ += length;
+    return true;
+  }
+
+  static NodePtr constant(double value) {
+    NodePtr node(new Node());
+    node->op = Op::kConst;
+    node->constant = value;
+    return node;
+  }
+
+  static NodePtr unary(Op op, NodePtr operand) {
+    if (operand->op == Op::kConst) {
+      double v = operand->constant;
+      return constant(op == Op::kNeg ? -v : (v == 0.0 ? 1.0 : 0.0));
+    }
+    NodePtr node(new Node());
+    node->op = op;
+    node->lhs = std::move(operand);
+    return node;
+  }
+
+  static NodePtr binary(Op op, NodePtr lhs, NodePtr rhs) {
+    if (op == Op::kJumpIfFalse || op == Op::kJumpIfTrue) {
+      // operands have no side effects, so a constant left side decides the result
+      if (lhs->op == Op::kConst) {
+        bool value = lhs->constant != 0.0;
+        return (value == (op == Op::kJumpIfTrue)) ? std::move(lhs) : std::move(rhs);
+      }
+    } else if (lhs->op == Op::kConst && rhs->op == Op::kConst) {
+      return constant(apply(op, lhs->constant, rhs->constant));
+    }
+    NodePtr node(new Node());
+    node->op = op;
+    node->lhs = std::move(lhs);
+    node->rhs = std::move(rhs);
+    return node;
+  }
+
+  NodePtr parseOr() {
+    auto node = parseAnd();
+    while (accept("||")) {
+      node = binary(Op::kJumpIfTrue, std::move(node), parseAnd());
+    }
+    return node;
+  }
+
+  NodePtr parseAnd() {
+    auto node = parseEquality();
+    while (accept("&&")) {
+      node = binary(Op::kJumpIfFalse, std::move(node), parseEquality());
+    }
+    return node;
+  }
+
+  NodePtr parseEquality() {
+    auto node = parseComparison();
+    while (true) {
+      if (accept("==")) {
+        node = binary(Op::kEqual, std::move(node), parseComparison());
+      } else if (accept("!=")) {
+        node = binary(Op::kNotEqual, std::move(node), parseComparison());
+      } else {
+        return node;
+      }
+    }
+  }
+
+  NodePtr parseComparison() {
+    auto node = parseAdditive();
+    while (true) {
+      if (accept("<=")) {
+        node = binary(Op::kLessEqual, std::move(node), parseAdditive());
+      } else if (accept(">=")) {
+        node = binary(Op::kGreaterEqual, std::move(node), parseAdditive());
+      } else if (accept("<")) {
+        node = binary(Op::kLess, std::move(node), parseAdditive());
+      } else if (accept(">")) {
+        node = binary(Op::kGreater, std::move(node), parseAdditive());
+      } else {
+        return node;
+      }
+    }
+  }
+
+  NodePtr parseAdditive() {
+    auto node = parseMultiplicative();
+    while (true) {
+      if (accept("+")) {
+        node = binary(Op::kAdd, std::move(node), parseMultiplicative());
+      } else if (accept("-")) {
+        node = binary(Op::kSub, std::move(node), parseMultiplicative());
+      } else {
+        return node;
+      }
+    }
+  }
+
+  NodePtr parseMultiplicative() {
+    auto node = parseUnary();
+    while (true) {
+      if (accept("*")) {
+        node = binary(Op::kMul, std::move(node), parseUnary());
+      } else if (accept("/")) {
+        node = binary(Op::kDiv, std::move(node), parseUnary());
+      } else {
+        return node;
+      }
+    }
+  }
+
+  NodePtr parseUnary() {
+    if (accept("!")) {
+      return unary(Op::kNot, parseUnary());
+    }
+    if (accept("-")) {
+      return unary(Op::kNeg, parseUnary());
+    }
+    return parsePrimary();
+  }
+
+  NodePtr parsePrimary() {
+    skipSpace();
+    if (accept("(")) {
+      auto node = parseOr();
+      if (!accept(")")) {
+        fail("expected ')'");
+      }
+      return node;
+    }
+    if (pos_ == source().size()) {
+      fail("unexpected end of expression");
+    }
+    const char* begin = source().c_str() + pos_;
+    if (std::isdigit(static_cast<unsigned char>(*begin)) || *begin == '.') {
+      char* end;
+      double value = std::strtod(begin, &end);
+      pos_ += end - begin;
+      return constant(value);
+    }
+    size_t start = pos_;
+    while (pos_ < source().size() && (std::isalnum(static_cast<unsigned char>(source()[pos_])) ||
+                                      source()[pos_] == '_' || source()[pos_] == '.')) {
+      pos_++;
+    }
+    if (start == pos_) {
+      fail("unexpected '" + std::string(1, source()[pos_]) + "'");
+    }
+    std::string name = source().substr(start, pos_ - start);
+    if (name == "true" || name == "false") {
+      return constant(name == "true" ? 1.0 : 0.0);
+    }
+    NodePtr node(new Node());
+    if (name == "elapsed") {
+      if (!expr_.since_) {
+        fail("elapsed is only available to guards of a state");
+      }
+      expr_.uses_elapsed_ = true;
+      node->op = Op::kElapsed;
+      return node;
+    }
+    resolve(name, *node);
+    return node;
+  }
+
+  void resolve(const std::string& key, Node& node) {
+    const SlotBase* slot = blackboard_.find(key);
+    if (!slot) {
+      blackboard_.entry<double>(key);
+      slot = blackboard_.find(key);
+    }
+    auto type = std::find_if(std::begin(kLoadTypes), std::end(kLoadTypes),
+                             [slot](const LoadType& t) { return t.type == slot->type; });
+    if (type == std::end(kLoadTypes)) {
+      fail("entry [" + key + "] is not of a numeric type");
+    }
+    node.op = type->op;
+    node.slot = slot;
+    if (std::find(expr_.inputs_.begin(), expr_.inputs_.end(), key) == expr_.inputs_.end()) {
+      expr_.inputs_.push_back(key);
+    }
+  }
+
+  GuardExpression::Instruction& push(Op op) {
+    GuardExpression::Instruction in;
+    in.op = op;
+    in.immediate = false;
+    in.target = 0;
+    in.constant = 0.0;
+    expr_.code_.push_back(in);
+    return expr_.code_.back();
+  }
+
+  void grow(int delta) {
+    depth_ += delta;
+    max_depth_ = std::max(max_depth_, depth_);
+    if (max_depth_ > static_cast<int>(GuardExpression::kMaxDepth)) {
+      throw LogicError("guard expression [" + source() + "] is nested too deeply");
+    }
+  }
+
+  void emit(const Node& node) {
+    switch (node.op) {
+      case Op::kConst:
+        push(Op::kConst).constant = node.constant;
+        grow(1);
+        break;
+      case Op::kElapsed:
+        push(Op::kElapsed);
+        grow(1);
+        break;
+      case Op::kNeg:
+      case Op::kNot:
+        emit(*node.lhs);
+        push(node.op);
+        break;
+      case Op::kJumpIfFalse:
+      case Op::kJumpIfTrue: {
+        emit(*node.lhs);
+        size_t jump = expr_.code_.size();
+        push(node.op);
+        grow(-1);
+        emit(*node.rhs);
+        expr_.code_[jump].target = static_cast<uint32_t>(expr_.code_.size());
+        break;
+      }
+      default:
+        if (node.slot) {
+          push(node.op).slot = node.slot;
+          grow(1);
+        } else if (node.rhs->op == Op::kConst) {
+          // a constant right operand is carried by the instruction itself
+          emit(*node.lhs);
+          auto& in = push(node.op);
+          in.immediate = true;
+          in.constant = node.rhs->constant;
+        } else {
+          emit(*node.lhs);
+          emit(*node.rhs);
+          push(node.op);
+          grow(-1);
+        }
+        break;
+    }
+  }
+
+  GuardExpression& expr_;
+  TypedBlackboard& blackboard_;
+  size_t pos_;
+  int depth_, max_depth_;
+};
+
+GuardExpression::SharedPtr GuardExpression::compile(const std::string& source,
+                                                    TypedBlackboard& blackboard,
+                                                    const TimePoint* since,
+                                                    const Clock::SharedPtr& clock) {
+  std::shared_ptr<GuardExpression> expr(new GuardExpression());
+  expr->source_ = source;
+  expr->since_ = since;
+  expr->clock_ = clock ? clock : Clock::steady();
+  ExpressionCompiler(*expr, blackboard).compile();
+  return expr;
+}
+
+bool GuardExpression::evaluate() const {
+  double stack[kMaxDepth];
+  size_t top = 0;  // number of values on the stack
+  double rhs;
+  const Instruction* code = code_.data();
+  const size_t size = code_.size();
+  for (size_t pc = 0; pc < size; pc++) {
+    const Instruction& in = code[pc];
+    switch (in.op) {
+      case Op::kConst:
+        stack[top++] = in.constant;
+        break;
+      case Op::kLoadDouble:
+        stack[top++] = load<double>(in.slot);
+        break;
+      case Op::kLoadFloat:
+        stack[top++] = load<float>(in.slot);
+        break;
+      case Op::kLoadBool:
+        stack[top++] = load<bool>(in.slot);
+        break;
+      case Op::kLoadInt8:
+        stack[top++] = load<int8_t>(in.slot);
+        break;
+      case Op::kLoadInt16:
+        stack[top++] = load<int16_t>(in.slot);
+        break;
+      case Op::kLoadInt32:
+        stack[top++] = load<int32_t>(in.slot);
+        break;
+      case Op::kLoadInt64:
+        stack[top++] = load<int64_t>(in.slot);
+        break;
+      case Op::kLoadUInt8:
+        stack[top++] = load<uint8_t>(in.slot);
+        break;
+      case Op::kLoadUInt16:
+        stack[top++] = load<uint16_t>(in.slot);
+        break;
+      case Op::kLoadUInt32:
+        stack[top++] = load<uint32_t>(in.slot);
+        break;
+      case Op::kLoadUInt64:
+        stack[top++] = load<uint64_t>(in.slot);
+        break;
+      case Op::kElapsed:
+        stack[top++] =
+            std::chrono::duration<double>(clock_->now() - *since_).count();
+        break;
+      case Op::kNeg:
+        stack[top - 1] = -stack[top - 1];
+        break;
+      case Op::kNot:
+        stack[top - 1] = stack[top - 1] == 0.0;
+        break;
+      case Op::kJumpIfFalse:
+        if (stack[top - 1] == 0.0) {
+          pc = in.target - 1;
+        } else {
+          top--;
+        }
+        break;
+      case Op::kJumpIfTrue:
+        if (stack[top - 1] != 0.0) {
+          pc = in.target - 1;
+        } else {
+          top--;
+        }
+        break;
+      case Op::kAdd:
+        rhs = operand(in, stack, top);
+        stack[top - 1] = stack[top - 1] + rhs;
+        break;
+      case Op::kSub:
+        rhs = operand(in, stack, top);
+        stack[top - 1] = stack[top - 1] - rhs;
+        break;
+      case Op::kMul:
+        rhs = operand(in, stack, top);
+        stack[top - 1] = stack[top - 1] * rhs;
+        break;
+      case Op::kDiv:
+        rhs = operand(in, stack, top);
+        stack[top - 1] = stack[top - 1] / rhs;
+        break;
+      case Op::kLess:
+        rhs = operand(in, stack, top);
+        stack[top - 1] = stack[top - 1] < rhs;
+        break;
+      case Op::kLessEqual:
+        rhs = operand(in, stack, top);
+        stack[top - 1] = stack[top - 1] <= rhs;
+        break;
+      case Op::kGreater:
+        rhs = operand(in, stack, top);
+        stack[top - 1] = stack[top - 1] > rhs;
+        break;
+      case Op::kGreaterEqual:
+        rhs = operand(in, stack, top);
+        stack[top - 1] = stack[top - 1] >= rhs;
+        break;
+      case Op::kEqual:
+        rhs = operand(in, stack, top);
+        stack[top - 1] = stack[top - 1] == rhs;
+        break;
+      case Op::kNotEqual:
+        rhs = operand(in, stack, top);
+        stack[top - 1] = stack[top - 1] != rhs;
+        break;
+    }
+  }
+  return stack[0] != 0.0;
+}
+
+std::string GuardExpression::disassemble() const {
+  std::string text;
+  for (size_t pc = 0; pc < code_.size(); pc++) {
+    const Instruction& in = code_[pc];
+    text += std::to_string(pc) + ": " + opName(in.op);
+    if (in.op == Op::kConst || in.immediate) {
+      std::ostringstream constant;
+      constant << in.constant;
+      text += " " + constant.str();
+    } else if (in.op == Op::kJumpIfFalse || in.op == Op::kJumpIfTrue) {
+      text += " " + std::to_string(in.target);
+    } else if (in.op >= Op::kLoadDouble && in.op <= Op::kLoadUInt64) {
+      text += " " + in.slot->key;
+    }
+    text += "\n";
+  }
+  return text;
+}
+
+}  // namespace sm
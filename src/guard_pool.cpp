@@ -0,0 +1,155 @@
+#include "state_machine/guard_pool.h"
+
+#include <algorithm>
+
+#include "state_machine/exception.h"
+
+namespace sm {
+
+namespace {
+
+// the batch and guard index the calling thread is evaluating, for guardCancelled()
+thread_local const std::atomic<size_t>* current_cutoff = nullptr;
+thread_local size_t current_index = 0;
+
+}  // namespace
+
+bool guardCancelled() {
+  return current_cutoff && current_cutoff->load(std::memory_order_acquire) < current_index;
+}
+
+void GuardPool::Batch::reset(size_t size, Evaluator evaluate, void* context) {
+  if (capacity_ < size) {
+    results_.reset(new std::atomic<uint8_t>[size]);
+    capacity_ = size;
+  }
+  for (size_t i = 0; i < size; i++) {
+    results_[i].store(kPending, std::memory_order_relaxed);
+  }
+  size_ = size;
+  evaluate_ = evaluate;
+  context_ = context;
+  next_.store(0, std::memory_order_relaxed);
+  cutoff_.store(size, std::memory_order_relaxed);
+  joined_.store(0, std::memory_order_relaxed);
+}
+
+void GuardPool::Batch::drain() {
+  while (true) {
+    size_t index = next_.fetch_add(1);
+    // guards after one that already fired cannot change the outcome
+    if (index >= size_ || index > cutoff_.load(std::memory_order_acquire)) {
+      return;
+    }
+    current_cutoff = &cutoff_;
+    current_index = index;
+    bool fired = evaluate_(context_, index);
+    current_cutoff = nullptr;
+
+    results_[index].store(fired ? kTrue : kFalse, std::memory_order_release);
+    if (fired) {
+      size_t cutoff = cutoff_.load();
+      while (index < cutoff && !cutoff_.compare_exchange_weak(cutoff, index)) {
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+    }
+    cv_.notify_all();
+  }
+}
+
+bool GuardPool::Batch::waitFor(size_t index) {
+  uint8_t result = results_[index].load(std::memory_order_acquire);
+  if (result == kPending) {
+    std::unique_lock<std::mutex> lock(mtx_);
+    cv_.wait(lock, [this, index, &result] {
+      result = results_[index].load(std::memory_order_acquire);
+      return result != kPending;
+    });
+  }
+  return result == kTrue;
+}
+
+GuardPool::GuardPool(size_t threads) : running_(true) {
+  if (threads == 0) {
+    throw LogicError("guard pool needs at least one worker thread");
+  }
+  for (size_t i = 0; i < threads; i++) {
+    threads_.emplace_back(&GuardPool::run, this);
+  }
+}
+
+GuardPool::~GuardPool() {
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    running_ = false;
+  }
+  cv_.notify_all();
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
+
+int GuardPool::evaluate(Batch& batch, size_t size, Evaluator evaluate, void* context) {
+  if (size == 0) {
+    return -1;
+  }
+  batch.reset(size, evaluate, context);
+  size_t helpers = std::min(threads_.size(), size - 1);
+  if (helpers > 0) {
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      requests_.insert(requests_.end(), helpers, &batch);
+    }
+    cv_.notify_all();
+  }
+
+  // the calling thread claims guards too; once it runs out, every guard up to the first
+  // one that fired has been claimed by someone
+  batch.drain();
+  int winner = -1;
+  for (size_t i = 0; i < size; i++) {
+    if (i > batch.cutoff_.load(std::memory_order_acquire)) {
+      break;
+    }
+    if (batch.waitFor(i)) {
+      winner = static_cast<int>(i);
+      break;
+    }
+  }
+
+  if (helpers > 0) {
+    {
+      // workers that did not pick the request up yet never will
+      std::lock_guard<std::mutex> lock(mtx_);
+      requests_.erase(std::remove(requests_.begin(), requests_.end(), &batch), requests_.end());
+    }
+    std::unique_lock<std::mutex> lock(batch.mtx_);
+    batch.cv_.wait(lock, [&batch] { return batch.joined_.load() == 0; });
+  }
+  return winner;
+}
+
+void GuardPool::run() {
+  while (true) {
+    Batch* batch;
+    {
+      std::unique_lock<std::mutex> lock(mtx_);
+      cv_.wait(lock, [this] { return !running_ || !requests_.empty(); });
+      if (!running_) {
+        return;
+      }
+      batch = requests_.front();
+      requests_.pop_front();
+      batch->joined_++;
+    }
+    batch->drain();
+    // notify under the lock: the batch may be gone as soon as it is released
+    std::lock_guard<std::mutex> lock(batch->mtx_);
+    batch->joined_--;
+    batch->cv_.notify_all();
+  }
+}
+
+}  // namespace sm
@@ -0,0 +1,484 @@
+#include "state_machine/loader.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <unordered_set>
+
+namespace sm {
+
+namespace {
+
+constexpr char kImageMagic[8] = {'S', 'M', 'M', 'A', 'C', 'H', '\0', '\0'};
+constexpr uint32_t kImageVersion = 1;
+constexpr uint32_t kNoString = std::numeric_limits<uint32_t>::max();
+
+std::string systemError(const std::string& what, const std::string& path) {
+  return what + " " + path + ": " + std::strerror(errno);
+}
+
+uint64_t hashName(std::string_view name) {
+  uint64_t hash = 14695981039346656037ull;
+  for (char c : name) {
+    hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+  }
+  return hash;
+}
+
+// splitmix64 finalizer, so every seed gives an independent slot for the same name hash
+uint64_t mix(uint64_t hash, uint64_t seed) {
+  uint64_t z = hash + (seed + 1) * 0x9e3779b97f4a7c15ull;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+template <typename T>
+T readAt(const char* data, size_t offset) {
+  T value;
+  std::memcpy(&value, data + offset, sizeof(T));
+  return value;
+}
+
+template <typename T>
+void appendValue(std::string& blob, const T& value) {
+  blob.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+std::string trim(const std::string& text) {
+  size_t begin = text.find_first_not_of(" \t\r");
+  if (begin == std::string::npos) {
+    return std::string();
+  }
+  return text.substr(begin, text.find_last_not_of(" \t\r") - begin + 1);
+}
+
+}  // namespace
+
+struct MachineImage::Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t state_number;
+  uint32_t transition_number;
+  uint32_t initial;
+  uint32_t bucket_number;  // perfect hash: one displacement per bucket
+  uint32_t slot_number;    // perfect hash: state index per slot, kInvalidHandle if free
+  uint32_t states_offset;
+  uint32_t transitions_offset;
+  uint32_t buckets_offset;
+  uint32_t slots_offset;
+  uint32_t strings_offset;
+  uint32_t strings_size;
+  uint32_t reserved[2];
+};
+
+struct MachineImage::StateRecord {
+  uint32_t id, type, parent;
+};
+
+struct MachineImage::TransitionRecord {
+  uint32_t from, to, event, expression, event_type, argument;
+  uint16_t priority;
+  uint16_t reserved;
+};
+
+MachineDefinition MachineDefinition::parse(const std::string& text) {
+  MachineDefinition definition;
+  std::istringstream lines(text);
+  std::string line;
+  for (size_t number = 1; std::getline(lines, line); number++) {
+    auto fail = [number](const std::string& what) {
+      throw LogicError("machine definition line " + std::to_string(number) + ": " + what);
+    };
+    line = line.substr(0, line.find('#'));
+    std::istringstream tokens(line);
+    std::string keyword;
+    if (!(tokens >> keyword)) {
+      continue;
+    }
+    if (keyword == "state") {
+      State state;
+      if (!(tokens >> state.id >> state.type)) {
+        fail("expected 'state <id> <type> [parent]'");
+      }
+      tokens >> state.parent;
+      definition.states.push_back(std::move(state));
+    } else if (keyword == "initial") {
+      if (!(tokens >> definition.initial)) {
+        fail("expected 'initial <id>'");
+      }
+    } else if (keyword == "transition") {
+      Transition transition;
+      int priority;
+      std::string kind;
+      if (!(tokens >> transition.from >> transition.event >> transition.to >> priority >> kind)) {
+        fail("expected 'transition <from> <event> <to> <priority> if|use ...'");
+      }
+      if (priority < 0 || priority > 100) {
+        fail("priority " + std::to_string(priority) + " is out of [0, 100]");
+      }
+      transition.priority = static_cast<Priority>(priority);
+      if (kind == "if") {
+        std::getline(tokens, transition.expression);
+        transition.expression = trim(transition.expression);
+        if (transition.expression.empty()) {
+          fail("expected a guard expression after 'if'");
+        }
+      } else if (kind == "use") {
+        if (!(tokens >> transition.event_type)) {
+          fail("expected an event type after 'use'");
+        }
+        std::getline(tokens, transition.argument);
+        transition.argument = trim(transition.argument);
+      } else {
+        fail("expected 'if' or 'use', got '" + kind + "'");
+      }
+      definition.transitions.push_back(std::move(transition));
+    } else {
+      fail("unknown keyword '" + keyword + "'");
+    }
+  }
+  return definition;
+}
+
+MachineImage::MachineImage(MachineImage&& other) noexcept
+    : data_(other.data_), size_(other.size_), mapped_(other.mapped_),
+      buffer_(std::move(other.buffer_)) {
+  if (!mapped_) {
+    data_ = buffer_.data();
+  }
+  other.data_ = nullptr;
+  other.size_ = 0;
+  other.mapped_ = false;
+}
+
+MachineImage::~MachineImage() {
+  if (mapped_) {
+    ::munmap(const_cast<char*>(data_), size_);
+  }
+}
+
+MachineImage MachineImage::compile(const MachineDefinition& definition) {
+  if (definition.states.empty()) {
+    throw LogicError("machine definition has no states");
+  }
+  std::unordered_map<std::string, uint32_t> index;
+  for (const auto& state : definition.states) {
+    if (!index.emplace(state.id, static_cast<uint32_t>(index.size())).second) {
+      throw LogicError("machine definition has state [" + state.id + "] twice");
+    }
+  }
+  auto lookup = [&index](const std::string& id) {
+    auto it = index.find(id);
+    if (it == index.end()) {
+      throw LogicError("machine definition uses undefined state [" + id + "]");
+    }
+    return it->second;
+  };
+
+  std::string strings;
+  auto intern = [&strings](const std::string& text) {
+    if (text.empty()) {
+      return kNoString;
+    }
+    uint32_t offset = static_cast<uint32_t>(strings.size());
+    strings.append(text);
+    strings.push_back('\0');
+    return offset;
+  };
+
+  std::vector<StateRecord> states;
+  for (const auto& state : definition.states) {
+    states.push_back(StateRecord{intern(state.id), intern(state.type),
+                                 state.parent.empty() ? kInvalidHandle : lookup(state.parent)});
+  }
+  std::vector<TransitionRecord> transitions;
+  for (const auto& t : definition.transitions) {
+    transitions.push_back(TransitionRecord{lookup(t.from), lookup(t.to), intern(t.event),
+                                           intern(t.expression), intern(t.event_type),
+                                           intern(t.argument), t.priority, 0});
+  }
+
+  // hash and displace: place the largest buckets first, each with the first displacement
+  // that sends all of its names to free slots
+  uint32_t n = static_cast<uint32_t>(definition.states.size());
+  uint32_t bucket_number = n / 2 + 1;
+  uint32_t slot_number = n + n / 4 + 1;
+  std::vector<std::vector<uint32_t>> buckets(bucket_number);
+  for (uint32_t i = 0; i < n; i++) {
+    buckets[mix(hashName(definition.states[i].id), 0) % bucket_number].push_back(i);
+  }
+  std::vector<uint32_t> order(bucket_number);
+  for (uint32_t b = 0; b < bucket_number; b++) {
+    order[b] = b;
+  }
+  std::stable_sort(order.begin(), order.end(), [&buckets](uint32_t a, uint32_t b) {
+    return buckets[a].size() > buckets[b].size();
+  });
+  std::vector<uint32_t> displacements(bucket_number, 0), slots(slot_number, kInvalidHandle);
+  std::vector<uint32_t> placed;
+  for (uint32_t b : order) {
+    if (buckets[b].empty()) {
+      break;
+    }
+    for (uint32_t d = 1;; d++) {
+      if (d == (1u << 24)) {
+        throw RuntimeError("cannot build a perfect hash for the machine's states");
+      }
+      placed.clear();
+      for (uint32_t i : buckets[b]) {
+        uint32_t slot = mix(hashName(definition.states[i].id), d) % slot_number;
+        if (slots[slot] != kInvalidHandle ||
+            std::find(placed.begin(), placed.end(), slot) != placed.end()) {
+          break;
+        }
+        placed.push_back(slot);
+      }
+      if (placed.size() == buckets[b].size()) {
+        for (size_t k = 0; k < placed.size(); k++) {
+          slots[placed[k]] = buckets[b][k];
+        }
+        displacements[b] = d;
+        break;
+      }
+    }
+  }
+
+  Header header{};
+  std::memcpy(header.magic, kImageMagic, sizeof(kImageMagic));
+  header.version = kImageVersion;
+  header.state_number = n;
+  header.transition_number = static_cast<uint32_t>(transitions.size());
+  header.initial = definition.initial.empty() ? 0 : lookup(definition.initial);
+  header.bucket_number = bucket_number;
+  header.slot_number = slot_number;
+  header.states_offset = sizeof(Header);
+  header.transitions_offset = header.states_offset + n * sizeof(StateRecord);
+  header.buckets_offset =
+      header.transitions_offset + header.transition_number * sizeof(TransitionRecord);
+  header.slots_offset = header.buckets_offset + bucket_number * sizeof(uint32_t);
+  header.strings_offset = header.slots_offset + slot_number * sizeof(uint32_t);
+  header.strings_size = static_cast<uint32_t>(strings.size());
+
+  MachineImage image;
+  std::string& blob = image.buffer_;
+  blob.reserve(header.strings_offset + strings.size());
+  appendValue(blob, header);
+  for (const auto& record : states) {
+    appendValue(blob, record);
+  }
+  for (const auto& record : transitions) {
+    appendValue(blob, record);
+  }
+  blob.append(reinterpret_cast<const char*>(displacements.data()),
+              displacements.size() * sizeof(uint32_t));
+  blob.append(reinterpret_cast<const char*>(slots.data()), slots.size() * sizeof(uint32_t));
+  blob.append(strings);
+  image.data_ = blob.data();
+  image.size_ = blob.size();
+  return image;
+}
+
+MachineImage MachineImage::load(const std::string& path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw RuntimeError(systemError("cannot open machine image", path));
+  }
+  struct stat info;
+  if (::fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(Header)) {
+    ::close(fd);
+    throw RuntimeError("not a machine image: " + path);
+  }
+  size_t size = static_cast<size_t>(info.st_size);
+  void* mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mapping == MAP_FAILED) {
+    throw RuntimeError(systemError("cannot map machine image", path));
+  }
+  MachineImage image;
+  image.data_ = static_cast<const char*>(mapping);
+  image.size_ = size;
+  image.mapped_ = true;
+  try {
+    image.validate();
+  } catch (const RuntimeError& e) {
+    throw RuntimeError(std::string(e.what()) + ": " + path);
+  }
+  return image;
+}
+
+void MachineImage::save(const std::string& path) const {
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  if (!file || !file.write(data_, static_cast<std::streamsize>(size_))) {
+    throw RuntimeError(systemError("cannot write machine image", path));
+  }
+}
+
+void MachineImage::validate() const {
+  const Header h = header();
+  auto fail = [] { throw RuntimeError("not a machine image"); };
+  if (std::memcmp(h.magic, kImageMagic, sizeof(kImageMagic)) != 0 ||
+      h.version != kImageVersion || h.state_number == 0 || h.initial >= h.state_number ||
+      h.bucket_number == 0 || h.slot_number == 0) {
+    fail();
+  }
+  // sections are laid out back to back, which also rules out overflowing offsets
+  if (h.states_offset != sizeof(Header) ||
+      h.transitions_offset != h.states_offset + uint64_t(h.state_number) * sizeof(StateRecord) ||
+      h.buckets_offset != h.transitions_offset +
+                              uint64_t(h.transition_number) * sizeof(TransitionRecord) ||
+      h.slots_offset != h.buckets_offset + uint64_t(h.bucket_number) * sizeof(uint32_t) ||
+      h.strings_offset != h.slots_offset + uint64_t(h.slot_number) * sizeof(uint32_t) ||
+      size_ != uint64_t(h.strings_offset) + h.strings_size ||
+      (h.strings_size > 0 && data_[size_ - 1] != '\0')) {
+    fail();
+  }
+  auto checkString = [&h, &fail](uint32_t offset, bool optional) {
+    if (offset == kNoString ? !optional : offset >= h.strings_size) {
+      fail();
+    }
+  };
+  for (uint32_t i = 0; i < h.state_number; i++) {
+    auto record = readAt<StateRecord>(data_, h.states_offset + i * sizeof(StateRecord));
+    checkString(record.id, false);
+    checkString(record.type, false);
+    if (record.parent != kInvalidHandle && record.parent >= h.state_number) {
+      fail();
+    }
+  }
+  for (uint32_t i = 0; i < h.transition_number; i++) {
+    auto record =
+        readAt<TransitionRecord>(data_, h.transitions_offset + i * sizeof(TransitionRecord));
+    if (record.from >= h.state_number || record.to >= h.state_number || record.priority > 100) {
+      fail();
+    }
+    checkString(record.event, false);
+    checkString(record.expression, true);
+    checkString(record.event_type, true);
+    checkString(record.argument, true);
+  }
+  for (uint32_t i = 0; i < h.slot_number; i++) {
+    uint32_t slot = readAt<uint32_t>(data_, h.slots_offset + i * sizeof(uint32_t));
+    if (slot != kInvalidHandle && slot >= h.state_number) {
+      fail();
+    }
+  }
+}
+
+const MachineImage::Header& MachineImage::header() const {
+  return *reinterpret_cast<const Header*>(data_);
+}
+
+std::string_view MachineImage::string(uint32_t offset) const {
+  if (offset == kNoString) {
+    return std::string_view();
+  }
+  return std::string_view(data_ + header().strings_offset + offset);
+}
+
+size_t MachineImage::stateNumber() const { return header().state_number; }
+
+MachineImage::StateView MachineImage::state(Handle index) const {
+  auto record = readAt<StateRecord>(data_, header().states_offset + index * sizeof(StateRecord));
+  return StateView{string(record.id), string(record.type), record.parent};
+}
+
+size_t MachineImage::transitionNumber() const { return header().transition_number; }
+
+MachineImage::TransitionView MachineImage::transition(size_t index) const {
+  auto record = readAt<TransitionRecord>(
+      data_, header().transitions_offset + index * sizeof(TransitionRecord));
+  return TransitionView{record.from,
+                        record.to,
+                        record.priority,
+                        string(record.event),
+                        string(record.expression),
+                        string(record.event_type),
+                        string(record.argument)};
+}
+
+Handle MachineImage::initial() const { return header().initial; }
+
+Handle MachineImage::findState(std::string_view id) const {
+  const Header& h = header();
+  uint64_t hash = hashName(id);
+  uint32_t displacement = readAt<uint32_t>(
+      data_, h.buckets_offset + (mix(hash, 0) % h.bucket_number) * sizeof(uint32_t));
+  if (displacement == 0) {
+    return kInvalidHandle;  // empty bucket
+  }
+  Handle index = readAt<uint32_t>(
+      data_, h.slots_offset + (mix(hash, displacement) % h.slot_number) * sizeof(uint32_t));
+  if (index == kInvalidHandle || state(index).id != id) {
+    return kInvalidHandle;
+  }
+  return index;
+}
+
+MachineFactory::MachineFactory() {
+  registerEvent("deadline", [](const std::string& argument) {
+    return std::unique_ptr<EventBase>(new DeadlineEvent(parseDuration(argument)));
+  });
+}
+
+void MachineFactory::build(const MachineImage& image, StateMachineEngine& engine) const {
+  for (Handle i = 0; i < image.stateNumber(); i++) {
+    auto view = image.state(i);
+    auto creator = states_.find(std::string(view.type));
+    if (creator == states_.end()) {
+      throw LogicError("state [" + std::string(view.id) + "] has unregistered type [" +
+                       std::string(view.type) + "]");
+    }
+    creator->second(engine, std::string(view.id));
+  }
+  for (Handle i = 0; i < image.stateNumber(); i++) {
+    auto view = image.state(i);
+    if (view.parent != kInvalidHandle) {
+      engine.setParent(std::string(view.id), std::string(image.state(view.parent).id));
+    }
+  }
+  for (size_t i = 0; i < image.transitionNumber(); i++) {
+    auto view = image.transition(i);
+    auto state = engine.getState(std::string(image.state(view.from).id));
+    std::string to(image.state(view.to).id);
+    if (!view.expression.empty()) {
+      state->addExpression(std::string(view.event), to, view.priority,
+                           std::string(view.expression));
+      continue;
+    }
+    auto creator = events_.find(std::string(view.event_type));
+    if (creator == events_.end()) {
+      throw LogicError("event [" + std::string(view.event) + "] has unregistered type [" +
+                       std::string(view.event_type) + "]");
+    }
+    const EventCreator& create = creator->second;
+    std::string argument(view.argument);
+    state->adoptEvent(std::string(view.event), to, view.priority,
+                      [create, argument]() { return create(argument); });
+  }
+  engine.setInitialStateID(std::string(image.state(image.initial()).id));
+}
+
+DurationType parseDuration(const std::string& text) {
+  char* end;
+  double value = std::strtod(text.c_str(), &end);
+  std::string unit = trim(end);
+  if (end == text.c_str() || value < 0) {
+    throw LogicError("invalid duration '" + text + "'");
+  }
+  if (unit == "us") {
+    return DurationType(static_cast<int64_t>(value));
+  } else if (unit == "ms") {
+    return DurationType(static_cast<int64_t>(value * 1e3));
+  } else if (unit == "s") {
+    return DurationType(static_cast<int64_t>(value * 1e6));
+  }
+  throw LogicError("invalid duration '" + text + "', expected a unit of us, ms or s");
+}
+
+}  // namespace sm
@@ -0,0 +1,189 @@
+#include "state_machine/logging.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+
+namespace sm {
+
+namespace logging {
+
+namespace {
+
+constexpr size_t kRingCapacity = 1 << 16;
+constexpr uint32_t kPadding = 0xffffffff;
+
+const char* levelName(LogLevel level) {
+  switch (level) {
+    case LogLevel::Trace:
+      return "TRACE";
+    case LogLevel::Debug:
+      return "DEBUG";
+    case LogLevel::Info:
+      return "INFO";
+    case LogLevel::Warn:
+      return "WARN";
+    case LogLevel::Error:
+      return "ERROR";
+  }
+  return "";
+}
+
+void writeStdout(LogLevel level, int64_t timestamp, const std::string& message) {
+  std::fprintf(stdout, "[%s] [%.6f] %s\n", levelName(level), timestamp * 1e-9, message.c_str());
+}
+
+/// Marks the ring of an exiting thread so the backend can release it once drained.
+struct LocalRing {
+  std::shared_ptr<LogRing> ring;
+  ~LocalRing() {
+    if (ring) {
+      ring->orphaned = true;
+    }
+  }
+};
+
+}  // namespace
+
+LogRing::LogRing(size_t capacity)
+    : orphaned(false),
+      buffer_(capacity / sizeof(uint64_t)),
+      capacity_(capacity),
+      mask_(capacity - 1),
+      reserved_(0),
+      head_(0),
+      tail_(0),
+      dropped_(0) {
+  if (capacity < sizeof(RecordHeader) || (capacity & mask_) != 0) {
+    throw std::invalid_argument("log ring capacity must be a power of two");
+  }
+}
+
+uint8_t* LogRing::reserve(size_t size) {
+  uint8_t* base = reinterpret_cast<uint8_t*>(buffer_.data());
+  size_t head = head_.load(std::memory_order_relaxed);
+  size_t tail = tail_.load(std::memory_order_acquire);
+  size_t offset = head & mask_;
+  size_t contiguous = capacity_ - offset;
+  size_t needed = (contiguous < size) ? contiguous + size : size;
+  if (size > capacity_ || capacity_ - (head - tail) < needed) {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+  }
+  if (contiguous < size) {
+    // records never wrap: pad to the end of the buffer and start over at its beginning
+    uint32_t padding[2] = {static_cast<uint32_t>(contiguous), kPadding};
+    std::memcpy(base + offset, padding, sizeof(padding));
+    head += contiguous;
+  }
+  reserved_ = head;
+  return base + (head & mask_);
+}
+
+void LogRing::commit(size_t size) { head_.store(reserved_ + size, std::memory_order_release); }
+
+size_t LogRing::drain(const std::function<void(const RecordHeader&, const std::string&)>& sink) {
+  const uint8_t* base = reinterpret_cast<const uint8_t*>(buffer_.data());
+  size_t tail = tail_.load(std::memory_order_relaxed);
+  size_t head = head_.load(std::memory_order_acquire);
+  size_t drained = 0;
+  while (tail != head) {
+    const uint8_t* record = base + (tail & mask_);
+    uint32_t prefix[2];
+    std::memcpy(prefix, record, sizeof(prefix));
+    if (prefix[1] != kPadding) {
+      RecordHeader header;
+      std::memcpy(&header, record, sizeof(header));
+      sink(header, header.decoder(header.format, record + sizeof(header)));
+      drained++;
+    }
+    tail += prefix[0];
+  }
+  tail_.store(tail, std::memory_order_release);
+  return drained;
+}
+
+Logger& Logger::instance() {
+  static Logger logger;
+  return logger;
+}
+
+Logger::Logger()
+    : sink_(&writeStdout),
+      level_(static_cast<uint8_t>(LogLevel::Trace)),
+      interval_ms_(5),
+      running_(true) {
+  thread_ = std::thread(&Logger::run, this);
+}
+
+Logger::~Logger() {
+  running_ = false;
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  flush();
+}
+
+void Logger::setSink(const Sink& sink) {
+  std::lock_guard<std::mutex> lock(drain_mtx_);
+  sink_ = sink ? sink : Sink(&writeStdout);
+}
+
+void Logger::setFlushInterval(const std::chrono::milliseconds& interval) {
+  interval_ms_ = interval.count();
+}
+
+size_t Logger::flush() {
+  std::vector<std::shared_ptr<LogRing>> rings;
+  {
+    std::lock_guard<std::mutex> lock(rings_mtx_);
+    rings = rings_;
+  }
+  std::lock_guard<std::mutex> lock(drain_mtx_);
+  size_t drained = 0;
+  for (auto& ring : rings) {
+    drained += ring->drain([this](const RecordHeader& header, const std::string& message) {
+      sink_(static_cast<LogLevel>(header.level), header.timestamp, message);
+    });
+  }
+  std::fflush(stdout);
+  {
+    std::lock_guard<std::mutex> lock(rings_mtx_);
+    rings_.erase(std::remove_if(rings_.begin(), rings_.end(),
+                                [](const std::shared_ptr<LogRing>& ring) {
+                                  return ring->orphaned && ring->empty();
+                                }),
+                 rings_.end());
+  }
+  return drained;
+}
+
+uint64_t Logger::droppedNumber() {
+  std::lock_guard<std::mutex> lock(rings_mtx_);
+  uint64_t dropped = 0;
+  for (auto& ring : rings_) {
+    dropped += ring->droppedNumber();
+  }
+  return dropped;
+}
+
+LogRing& Logger::localRing() {
+  thread_local LocalRing local;
+  if (!local.ring) {
+    local.ring = std::make_shared<LogRing>(kRingCapacity);
+    std::lock_guard<std::mutex> lock(rings_mtx_);
+    rings_.push_back(local.ring);
+  }
+  return *local.ring;
+}
+
+void Logger::run() {
+  while (running_) {
+    flush();
+    std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms_.load()));
+  }
+}
+
+}  // namespace logging
+
+}  // namespace sm
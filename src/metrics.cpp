@@ -0,0 +1,129 @@
+#include "state_machine/metrics.h"
+
+#include <cmath>
+
+namespace sm {
+
+LatencyHistogram::LatencyHistogram() { reset(); }
+
+size_t LatencyHistogram::bucketIndex(uint64_t value) {
+  constexpr uint64_t kSubBuckets = 1 << kSubBucketBits;
+  constexpr uint64_t kLargest = (uint64_t(1) << (kMaxExponent + 1)) - 1;
+  if (value < kSubBuckets) {
+    return static_cast<size_t>(value);
+  }
+  value = std::min(value, kLargest);
+  int exponent = 63 - __builtin_clzll(value);
+  int shift = exponent - kSubBucketBits;
+  return static_cast<size_t>(((shift + 1) << kSubBucketBits) + ((value >> shift) - kSubBuckets));
+}
+
+uint64_t LatencyHistogram::bucketUpperBound(size_t index) {
+  constexpr uint64_t kSubBuckets = 1 << kSubBucketBits;
+  if (index < kSubBuckets) {
+    return index;
+  }
+  int shift = static_cast<int>(index >> kSubBucketBits) - 1;
+  uint64_t sub = (index & (kSubBuckets - 1)) + kSubBuckets;
+  return ((sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(int64_t nanoseconds) {
+  if (nanoseconds < 0) {
+    nanoseconds = 0;
+  }
+  buckets_[bucketIndex(static_cast<uint64_t>(nanoseconds))].fetch_add(1,
+                                                                      std::memory_order_relaxed);
+  sum_.fetch_add(static_cast<uint64_t>(nanoseconds), std::memory_order_relaxed);
+  int64_t current = min_.load(std::memory_order_relaxed);
+  while (nanoseconds < current &&
+         !min_.compare_exchange_weak(current, nanoseconds, std::memory_order_relaxed)) {
+  }
+  current = max_.load(std::memory_order_relaxed);
+  while (nanoseconds > current &&
+         !max_.compare_exchange_weak(current, nanoseconds, std::memory_order_relaxed)) {
+  }
+  count_.fetch_add(1, std::memory_order_relaxed);
+}
+
+int64_t LatencyHistogram::min() const { return count() ? min_.load(std::memory_order_relaxed) : 0; }
+
+int64_t LatencyHistogram::max() const { return count() ? max_.load(std::memory_order_relaxed) : 0; }
+
+double LatencyHistogram::mean() const {
+  uint64_t samples = count();
+  return samples ? static_cast<double>(sum_.load(std::memory_order_relaxed)) / samples : 0.;
+}
+
+int64_t LatencyHistogram::percentile(double percent) const {
+  uint64_t samples = count();
+  if (samples == 0) {
+    return 0;
+  }
+  percent = std::min(std::max(percent, 0.), 100.);
+  uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(percent / 100. * samples)));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kBucketNumber; i++) {
+    seen += buckets_[i].load(std::memory_order_relaxed);
+    if (seen >= rank) {
+      return std::min(static_cast<int64_t>(bucketUpperBound(i)), max());
+    }
+  }
+  return max();
+}
+
+void LatencyHistogram::reset() {
+  for (auto& bucket : buckets_) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+  count_.store(0, std::memory_order_relaxed);
+  sum_.store(0, std::memory_order_relaxed);
+  min_.store(std::numeric_limits<int64_t>::max(), std::memory_order_relaxed);
+  max_.store(0, std::memory_order_relaxed);
+}
+
+LatencyHistogram& StateMetrics::condition(Handle event) {
+  std::lock_guard<std::mutex> lock(events_mtx_);
+  for (auto& e : events_) {
+    if (e.event == event) {
+      return e.condition;
+    }
+  }
+  events_.emplace_back(event);
+  return events_.back().condition;
+}
+
+const LatencyHistogram* StateMetrics::findCondition(Handle event) const {
+  std::lock_guard<std::mutex> lock(events_mtx_);
+  for (const auto& e : events_) {
+    if (e.event == event) {
+      return &e.condition;
+    }
+  }
+  return nullptr;
+}
+
+std::vector<const StateMetrics::EventMetrics*> StateMetrics::events() const {
+  std::lock_guard<std::mutex> lock(events_mtx_);
+  std::vector<const EventMetrics*> events;
+  for (const auto& e : events_) {
+    events.push_back(&e);
+  }
+  return events;
+}
+
+void StateMetrics::reset() {
+  time_in_state.reset();
+  update.reset();
+  enter.reset();
+  leave.reset();
+  tick_period.reset();
+  tick_lateness.reset();
+  overruns.store(0, std::memory_order_relaxed);
+  std::lock_guard<std::mutex> lock(events_mtx_);
+  for (auto& e : events_) {
+    e.condition.reset();
+  }
+}
+
+}  // namespace sm
@@ -0,0 +1,41 @@
+#include "state_machine/realtime.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <cstring>
+#include <string>
+
+#include "state_machine/exception.h"
+
+namespace sm {
+
+void setRealtimeScheduling(int priority, int cpu) {
+  int min = sched_get_priority_min(SCHED_FIFO), max = sched_get_priority_max(SCHED_FIFO);
+  if (priority < min || priority > max) {
+    throw LogicError("SCHED_FIFO priority " + std::to_string(priority) + " is out of [" +
+                     std::to_string(min) + ", " + std::to_string(max) + "]");
+  }
+  if (cpu >= 0) {
+    if (cpu >= CPU_SETSIZE) {
+      throw LogicError("cpu " + std::to_string(cpu) + " is out of range");
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (error != 0) {
+      throw RuntimeError("cannot pin thread to cpu " + std::to_string(cpu) + ": " +
+                         std::strerror(error));
+    }
+  }
+  sched_param param{};
+  param.sched_priority = priority;
+  int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+  if (error != 0) {
+    throw RuntimeError("cannot set SCHED_FIFO priority " + std::to_string(priority) + ": " +
+                       std::strerror(error));
+  }
+}
+
+}  // namespace sm
@@ -1,45 +1,545 @@
 
 #include "state_machine/sm.h"
 
+#include "state_machine/realtime.h"
+
 namespace sm {
 
-StateMachineEngine::StateMachineEngine() { blackboard_ = BlackboardType::create(); }
+StateMachineEngine::StateMachineEngine()
+    : state_ids_(std::make_shared<NameTable>()),
+      event_ids_(std::make_shared<NameTable>()),
+      active_state_(kInvalidHandle),
+      initial_state_(kInvalidHandle),
+      transition_count_(0),
+      tick_interval_(kDefaultTickInterval),
+      event_driven_(false),
+      wakeup_(std::make_shared<WakeupSignal>()),
+      clock_(Clock::steady()),
+      timers_(std::make_shared<TimingWheel>()),
+      state_keeper_(state_ids_),
+      metrics_enabled_(false),
+      hierarchy_changed_(false),
+      fixed_rate_(false),
+      overrun_policy_(OverrunPolicy::kSkip),
+      overruns_(0),
+      realtime_priority_(0),
+      realtime_cpu_(-1),
+      posted_(std::make_unique<MpscQueue<Handle>>(1024)) {
+  blackboard_ = BlackboardType::create();
+  typed_blackboard_ = TypedBlackboard::create();
+  typed_blackboard_->setWakeupSignal(wakeup_);
+}
 
-StateMachineEngine::~StateMachineEngine() {}
+StateMachineEngine::StateMachineEngine(const MachineArena::SharedPtr& arena)
+    : StateMachineEngine() {
+  arena_ = arena;
+  state_keeper_.setArena(arena);
+}
+
+StateMachineEngine::StateMachineEngine(const StateMachineEngine& prototype,
+                                       const MachineArena::SharedPtr& arena)
+    : state_ids_(prototype.state_ids_),
+      event_ids_(prototype.event_ids_),
+      active_state_(prototype.initial_state_),
+      initial_state_(prototype.initial_state_),
+      transition_count_(0),
+      tick_interval_(prototype.tick_interval_),
+      event_driven_(prototype.event_driven_),
+      wakeup_(std::make_shared<WakeupSignal>()),
+      clock_(prototype.clock_),
+      timers_(std::make_shared<TimingWheel>(std::chrono::milliseconds(1), clock_->now())),
+      state_keeper_(state_ids_),
+      trace_(prototype.trace_.capacity()),
+      metrics_enabled_(prototype.metrics_enabled_.load()),
+      guard_pool_(prototype.guard_pool_),
+      parents_(prototype.parents_),
+      initial_substates_(prototype.initial_substates_),
+      lca_(prototype.lca_),
+      hierarchy_changed_(prototype.hierarchy_changed_),
+      arena_(arena),
+      fixed_rate_(prototype.fixed_rate_),
+      overrun_policy_(prototype.overrun_policy_),
+      overruns_(0),
+      realtime_priority_(prototype.realtime_priority_),
+      realtime_cpu_(prototype.realtime_cpu_),
+      posted_(std::make_unique<MpscQueue<Handle>>(prototype.posted_->capacity())) {
+  blackboard_ = BlackboardType::create();
+  typed_blackboard_ = TypedBlackboard::create();
+  typed_blackboard_->setWakeupSignal(wakeup_);
+  state_keeper_.setArena(arena);
+  for (const auto& creator : prototype.creators_) {
+    if (prototype.state_keeper_.getResource(creator.first)->hasForeignEvents()) {
+      throw LogicError("cannot clone state [" + creator.first +
+                       "], events were registered on it from outside its own hooks");
+    }
+  }
+  creators_.reserve(prototype.creators_.size());
+  for (const auto& creator : prototype.creators_) {
+    creator.second(*this, creator.first);
+  }
+  // transitions added by MachineFactory and the like, now that every target exists
+  for (const auto& creator : prototype.creators_) {
+    const auto& added = prototype.state_keeper_.getResource(creator.first)->getAddedTransitions();
+    if (!added.empty()) {
+      state_keeper_.getResource(creator.first)->addTransitions(added);
+    }
+  }
+}
+
+StateMachineEngine::SharedPtr StateMachineEngine::clone(
+    const MachineArena::SharedPtr& arena) const {
+  if (arena) {
+    return arena->make<StateMachineEngine>(*this, arena);
+  }
+  return std::make_shared<StateMachineEngine>(*this, nullptr);
+}
+
+StateMachineEngine::~StateMachineEngine() {
+  try {
+    stopRecordingTrace();
+  } catch (const RuntimeError& e) {
+    // the records are in the file already, only their names are missing
+    SM_LOG_ERROR("{}", e.what());
+  }
+}
 
 std::shared_ptr<StateBase> StateMachineEngine::getState(const std::string& name) {
   auto resource = state_keeper_.getResource(name);
   if (resource == nullptr) {
     throw RuntimeError("Cannot find resource with specified name: " + name);
   }
-  return state_keeper_.getResource(name);
+  return resource;
+}
+
+std::shared_ptr<StateBase> StateMachineEngine::getState(Handle handle) {
+  auto resource = state_keeper_.getResource(handle);
+  if (resource == nullptr) {
+    throw RuntimeError("Cannot find resource with specified handle: " + std::to_string(handle));
+  }
+  return resource;
+}
+
+std::string StateMachineEngine::getCurrentStateID() const {
+  return active_state_ == kInvalidHandle ? std::string() : state_ids_->name(active_state_);
 }
 
 void StateMachineEngine::spin() {
-  std::cout << fmt::format("Start from initial state: {}\n", active_state_id_);
+  applyRealtime();
+  SM_LOG_INFO("Start from initial state: {}", getCurrentStateID());
   while (1) {
     spinUntilStateChange();
   }
 }
 
 void StateMachineEngine::spinUntilStateChange() {
-  state_footprint_.push_back(active_state_id_);
-  auto current_state = state_keeper_.getResource(active_state_id_);
-  current_state->setLastStateID(active_state_id_);
-  current_state->spin();
-  current_state->setPrev(state_keeper_.getResource(active_state_id_));
-  active_state_id_ = current_state->getNextStateID();
+  applyRealtime();
+  uint64_t transitions = transition_count_;
+  while (true) {
+    TimePoint deadline = step();
+    if (transition_count_ != transitions) {
+      break;
+    }
+    waitUntil(deadline);
+  }
+}
+
+TimePoint StateMachineEngine::step() {
+  if (hierarchy_changed_) {
+    buildHierarchy();
+  }
+  if (!current_state_ || current_state_->getHandle() != active_state_) {
+    activate(descend(active_state_));
+  }
+  for (auto& state : active_path_) {
+    if (!state->isEntered()) {
+      state->enter();
+      state_entered_ = clock_->now();
+    }
+  }
+  auto now = clock_->now();
+  const auto& metrics = current_state_->getMetrics();
+  if (metrics && next_tick_ != TimePoint() && now >= next_tick_) {
+    metrics->tick_lateness.record(now - next_tick_);
+  }
+
+  StateBase* source = nullptr;
+  Handle posted;
+  while (!source && posted_->pop(posted)) {
+    source = dispatch(posted);
+  }
+
+  // parents first: their events apply to the whole subtree and take precedence
+  size_t ancestors = active_path_.size() - 1;
+  if (!source && ancestors > 0) {
+    timers_->advance(now);
+    for (size_t i = 0; i < ancestors && !source; i++) {
+      if (active_path_[i]->checkCondition()) {
+        source = active_path_[i].get();
+      }
+    }
+  }
+  if (!source) {
+    if (!current_state_->tick()) {
+      for (size_t i = 0; i < ancestors; i++) {
+        active_path_[i]->update();
+      }
+      next_tick_ = fixed_rate_ ? std::min(nextPeriod(now), timers_->nextDeadline())
+                               : current_state_->nextDeadline(now);
+      return next_tick_;
+    }
+    source = current_state_.get();
+  }
+  next_tick_ = TimePoint();
+
+  Handle target = source->getNextState();
+  Handle boundary = exitBoundary(source->getHandle(), target);
+  for (auto it = active_path_.rbegin(); it != active_path_.rend(); ++it) {
+    if ((*it)->getHandle() == boundary) {
+      break;
+    }
+    (*it)->leave();
+  }
+  Handle next = descend(target);
+  trace_.record(TransitionRecord{
+      std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count(),
+      std::chrono::duration_cast<std::chrono::nanoseconds>(now - state_entered_).count(),
+      active_state_, next, source->getTriggerEvent(), 0});
+  auto previous = current_state_;
+  activate(next);
+  current_state_->setLastState(previous->getHandle());
+  current_state_->setPrev(previous);
+  transition_count_++;
+  return now;
+}
+
+void StateMachineEngine::waitUntil(const TimePoint& deadline) {
+  clock_->sleepUntil(deadline, event_driven_ ? wakeup_.get() : nullptr);
+}
+
+bool StateMachineEngine::post(const std::string& event) {
+  Handle handle = event_ids_->find(event);
+  return handle != kInvalidHandle && post(handle);
+}
+
+void StateMachineEngine::setEventQueueCapacity(size_t capacity) {
+  posted_ = std::make_unique<MpscQueue<Handle>>(capacity);
+}
+
+StateBase* StateMachineEngine::dispatch(Handle event) {
+  for (auto& state : active_path_) {
+    if (state->dispatch(event)) {
+      return state.get();
+    }
+  }
+  SM_LOG_DEBUG("Posted [Event: {}] has no transition from [State: {}]", event_ids_->name(event),
+               getCurrentStateID());
+  return nullptr;
 }
 
-std::string generateFootprint(const std::list<std::string>& list) {
-  std::string fpt("");
-  for (std::list<std::string>::const_iterator it = list.begin(); it != list.end(); ++it) {
-    if (it == list.begin()) {
-      fpt += fmt::format("[{}]", *it);
+void StateMachineEngine::setFixedRate(bool enable, OverrunPolicy policy) {
+  fixed_rate_ = enable;
+  overrun_policy_ = policy;
+  period_ = TimePoint();
+}
+
+TimePoint StateMachineEngine::nextPeriod(const TimePoint& started) {
+  auto interval = current_state_->getTickInterval();
+  if (period_ == TimePoint()) {
+    // the first tick sets the phase
+    period_ = started;
+  }
+  if (started < period_) {
+    // woken early by a timer, notify() or a transition
+    return period_;
+  }
+  period_ += interval;
+  auto finished = clock_->now();
+  if (finished >= period_) {
+    overruns_++;
+    if (overrun_policy_ == OverrunPolicy::kSkip && interval.count() > 0) {
+      period_ += ((finished - period_) / interval + 1) * interval;
     }
-    fpt += fmt::format(" -> [{}]", *it);
   }
-  return fpt;
+  return period_;
+}
+
+void StateMachineEngine::applyRealtime() {
+  if (realtime_priority_ > 0 && realtime_thread_ != std::this_thread::get_id()) {
+    setRealtimeScheduling(realtime_priority_, realtime_cpu_);
+    realtime_thread_ = std::this_thread::get_id();
+  }
+}
+
+void StateMachineEngine::setClock(const Clock::SharedPtr& clock) {
+  if (StateNumber() > 0) {
+    throw LogicError("set the clock of an engine before adding states");
+  }
+  clock_ = clock ? clock : Clock::steady();
+  // the wheel counts ticks from its origin, which has to be on the same clock
+  timers_ = std::make_shared<TimingWheel>(std::chrono::milliseconds(1), clock_->now());
+}
+
+void StateMachineEngine::setParent(const std::string& state_id, const std::string& parent_id) {
+  Handle state = state_ids_->intern(state_id);
+  Handle parent = state_ids_->intern(parent_id);
+  if (state == parent) {
+    throw LogicError("State [" + state_id + "] cannot be its own parent");
+  }
+  if (parents_.size() <= std::max(state, parent)) {
+    parents_.resize(std::max(state, parent) + 1, kInvalidHandle);
+    initial_substates_.resize(parents_.size(), kInvalidHandle);
+  }
+  parents_[state] = parent;
+  if (initial_substates_[parent] == kInvalidHandle) {
+    initial_substates_[parent] = state;
+  }
+  hierarchy_changed_ = true;
+}
+
+void StateMachineEngine::setInitialSubstate(const std::string& parent_id,
+                                            const std::string& state_id) {
+  Handle parent = state_ids_->intern(parent_id);
+  Handle state = state_ids_->intern(state_id);
+  if (getParent(state) != parent) {
+    throw LogicError("State [" + state_id + "] is not a child of [" + parent_id + "]");
+  }
+  initial_substates_[parent] = state;
+  hierarchy_changed_ = true;
+}
+
+bool StateMachineEngine::isInState(const std::string& state_id) const {
+  Handle handle = state_ids_->find(state_id);
+  for (Handle h = active_state_; h != kInvalidHandle; h = getParent(h)) {
+    if (h == handle) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void StateMachineEngine::buildHierarchy() {
+  size_t n = parents_.size();
+  std::vector<uint32_t> depth(n, 0);
+  for (Handle h = 0; h < n; h++) {
+    if (parents_[h] == kInvalidHandle) {
+      continue;
+    }
+    if (!state_keeper_.hasResource(parents_[h])) {
+      throw LogicError("Parent state [" + state_ids_->name(parents_[h]) + "] of [" +
+                       state_ids_->name(h) + "] was never added");
+    }
+    for (Handle p = parents_[h]; p != kInvalidHandle; p = getParent(p)) {
+      if (++depth[h] > n) {
+        throw LogicError("State hierarchy has a cycle through [" + state_ids_->name(h) + "]");
+      }
+    }
+  }
+  auto lca = std::make_shared<std::vector<Handle>>(n * n, kInvalidHandle);
+  for (Handle a = 0; a < n; a++) {
+    for (Handle b = a; b < n; b++) {
+      Handle x = a, y = b;
+      uint32_t dx = depth[x], dy = depth[y];
+      while (dx > dy) {
+        x = parents_[x];
+        dx--;
+      }
+      while (dy > dx) {
+        y = parents_[y];
+        dy--;
+      }
+      while (x != y && x != kInvalidHandle) {
+        x = parents_[x];
+        y = parents_[y];
+      }
+      (*lca)[a * n + b] = (*lca)[b * n + a] = x;
+    }
+  }
+  lca_ = std::move(lca);
+  hierarchy_changed_ = false;
+  current_state_.reset();  // rebuild the active path
+}
+
+Handle StateMachineEngine::descend(Handle state) const {
+  while (state < initial_substates_.size() && initial_substates_[state] != kInvalidHandle) {
+    state = initial_substates_[state];
+  }
+  return state;
+}
+
+Handle StateMachineEngine::exitBoundary(Handle source, Handle target) const {
+  size_t n = parents_.size();
+  if (source >= n || target >= n) {
+    // at least one of them is outside any hierarchy
+    return kInvalidHandle;
+  }
+  Handle lca = (*lca_)[source * n + target];
+  if (lca == target) {
+    // to the source itself or one of its ancestors: leave and re-enter the target
+    return parents_[target];
+  }
+  return lca;
+}
+
+void StateMachineEngine::activate(Handle leaf) {
+  active_state_ = leaf;
+  current_state_ = getState(leaf);
+  active_path_.clear();
+  for (Handle h = leaf; h != kInvalidHandle; h = getParent(h)) {
+    active_path_.push_back(h == leaf ? current_state_ : getState(h));
+  }
+  std::reverse(active_path_.begin(), active_path_.end());
+}
+
+void StateMachineEngine::setTraceCapacity(size_t capacity) {
+  auto file = trace_.getFile();
+  trace_ = TransitionTrace(capacity);
+  trace_.setFile(file);
+}
+
+void StateMachineEngine::recordTrace(const std::string& path) {
+  stopRecordingTrace();
+  auto file = std::make_shared<TraceFile>(path, trace_.capacity());
+  file->writeNames(*state_ids_, *event_ids_);
+  trace_.setFile(file);
+}
+
+void StateMachineEngine::stopRecordingTrace() {
+  if (trace_.getFile()) {
+    // states and events may have been added since recording started
+    trace_.getFile()->writeNames(*state_ids_, *event_ids_);
+    trace_.setFile(nullptr);
+  }
+}
+
+void StateMachineEngine::enableMetrics(bool enable) {
+  metrics_enabled_ = enable;
+  for (auto& state : state_keeper_.getResourceMap()) {
+    state.second->enableMetrics(enable);
+  }
+}
+
+void StateMachineEngine::setGuardPool(const GuardPool::SharedPtr& pool) {
+  guard_pool_ = pool;
+  for (auto& state : state_keeper_.getResourceMap()) {
+    state.second->setGuardPool(pool);
+  }
+}
+
+Snapshot StateMachineEngine::snapshot() const {
+  Snapshot snapshot;
+  snapshot.taken = std::chrono::system_clock::now();
+  snapshot.transition_count = transition_count_;
+  auto now = clock_->now();
+  for (const auto& state : active_path_) {
+    if (state->isEntered()) {
+      snapshot.path.push_back(Snapshot::StateTime{
+          state_ids_->name(state->getHandle()),
+          std::chrono::duration_cast<DurationType>(now - state->entered_)});
+    }
+  }
+  if (current_state_ && current_state_->last_state_ != kInvalidHandle) {
+    snapshot.last_state = state_ids_->name(current_state_->last_state_);
+  }
+  for (uint32_t i = 0; i < typed_blackboard_->size(); i++) {
+    const SlotBase* slot = typed_blackboard_->slot(i);
+    if (slot->byteSize() == 0 || slot->version() == 0) {
+      continue;
+    }
+    Snapshot::Entry entry{slot->key, slot->type.name(), std::string(slot->byteSize(), '\0')};
+    slot->readBytes(&entry.value[0]);
+    snapshot.entries.push_back(std::move(entry));
+  }
+  return snapshot;
+}
+
+void StateMachineEngine::restore(const Snapshot& snapshot) {
+  for (const auto& entry : snapshot.entries) {
+    SlotBase* slot = typed_blackboard_->find(entry.key);
+    if (!slot || entry.type != slot->type.name() || entry.value.size() != slot->byteSize()) {
+      SM_LOG_WARN("Snapshot entry [{}] does not match the blackboard, skipped", entry.key);
+      continue;
+    }
+    slot->writeBytes(entry.value.data());
+  }
+  if (snapshot.path.empty()) {
+    return;
+  }
+  for (const auto& state : snapshot.path) {
+    if (!state_keeper_.hasResource(state.state)) {
+      throw LogicError("Snapshot state [" + state.state + "] was never added");
+    }
+  }
+
+  if (hierarchy_changed_) {
+    buildHierarchy();
+  }
+  for (auto it = active_path_.rbegin(); it != active_path_.rend(); ++it) {
+    if ((*it)->isEntered()) {
+      (*it)->leave();
+    }
+  }
+  activate(state_ids_->find(snapshot.path.back().state));
+  auto now = clock_->now();
+  for (auto& state : active_path_) {
+    const std::string& id = state_ids_->name(state->getHandle());
+    auto saved = std::find_if(snapshot.path.begin(), snapshot.path.end(),
+                              [&id](const Snapshot::StateTime& s) { return s.state == id; });
+    TimePoint entered = now - (saved != snapshot.path.end() ? saved->in_state : DurationType(0));
+    state->enter();
+    state->resume(entered);
+    state_entered_ = entered;
+  }
+  if (!snapshot.last_state.empty() && state_keeper_.hasResource(snapshot.last_state)) {
+    current_state_->setLastStateID(snapshot.last_state);
+  }
+  transition_count_ = snapshot.transition_count;
+  next_tick_ = TimePoint();
+  SM_LOG_INFO("Restored [State: {}] after {} transition(s)", getCurrentStateID(),
+              snapshot.transition_count);
+}
+
+StateMetrics::SharedPtr StateMachineEngine::getMetrics(const std::string& state_id) {
+  return getState(state_id)->getMetrics();
+}
+
+std::string StateMachineEngine::metricsReport() {
+  auto row = [](const std::string& name, const LatencyHistogram& h) {
+    return fmt::format("  {:<24} {:>10} {:>12.3f} {:>12.3f} {:>12.3f}\n", name, h.count(),
+                       h.percentile(50) * 1e-3, h.percentile(99) * 1e-3, h.max() * 1e-3);
+  };
+  std::string report = fmt::format("  {:<24} {:>10} {:>12} {:>12} {:>12}\n", "(us)", "count",
+                                   "p50", "p99", "max");
+  for (Handle handle = 0; handle < state_ids_->size(); handle++) {
+    auto state = state_keeper_.getResource(handle);
+    if (!state || !state->getMetrics()) {
+      continue;
+    }
+    const auto& m = *state->getMetrics();
+    report += fmt::format("{} ({} overrun(s))\n", state_ids_->name(handle), m.overruns.load());
+    report += row("time in state", m.time_in_state);
+    report += row("enter", m.enter);
+    report += row("update", m.update);
+    report += row("leave", m.leave);
+    report += row("tick period", m.tick_period);
+    report += row("tick lateness", m.tick_lateness);
+    for (const auto* e : m.events()) {
+      report += row("event " + event_ids_->name(e->event), e->condition);
+    }
+  }
+  return report;
+}
+
+std::string StateMachineEngine::generateFootprint() const {
+  auto records = trace_.records();
+  if (records.empty()) {
+    return std::string();
+  }
+  fmt::memory_buffer footprint;
+  fmt::format_to(std::back_inserter(footprint), "[{}]", state_ids_->name(records.front().from));
+  for (const auto& record : records) {
+    fmt::format_to(std::back_inserter(footprint), " -> [{}]", state_ids_->name(record.to));
+  }
+  return fmt::to_string(footprint);
 }
 
 }  // namespace sm
\ No newline at end of file
@@ -0,0 +1,172 @@
+#include "state_machine/snapshot.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+namespace sm {
+
+namespace {
+
+constexpr char kSnapshotMagic[8] = {'S', 'M', 'S', 'N', 'A', 'P', '\0', '\0'};
+constexpr uint32_t kSnapshotVersion = 1;
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t path_size;
+  uint32_t entry_size;
+  uint32_t reserved;
+  int64_t taken;  // nanoseconds since the system clock's epoch
+  uint64_t transition_count;
+};
+
+std::string systemError(const std::string& what, const std::string& path) {
+  return what + " " + path + ": " + std::strerror(errno);
+}
+
+template <typename T>
+void appendValue(std::string& blob, const T& value) {
+  blob.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void appendString(std::string& blob, const std::string& value) {
+  appendValue(blob, static_cast<uint32_t>(value.size()));
+  blob.append(value);
+}
+
+/// Bounds-checked cursor over a serialized snapshot.
+class Reader {
+ public:
+  Reader(const char* data, size_t size) : data_(data), size_(size), offset_(0) {}
+
+  template <typename T>
+  T value() {
+    T value;
+    std::memcpy(&value, take(sizeof(T)), sizeof(T));
+    return value;
+  }
+
+  std::string string() {
+    uint32_t length = value<uint32_t>();
+    return std::string(take(length), length);
+  }
+
+ private:
+  const char* take(size_t size) {
+    if (size > size_ - offset_) {
+      throw RuntimeError("truncated snapshot");
+    }
+    const char* at = data_ + offset_;
+    offset_ += size;
+    return at;
+  }
+
+  const char* data_;
+  size_t size_, offset_;
+};
+
+}  // namespace
+
+std::string Snapshot::serialize() const {
+  Header header{};
+  std::memcpy(header.magic, kSnapshotMagic, sizeof(kSnapshotMagic));
+  header.version = kSnapshotVersion;
+  header.path_size = static_cast<uint32_t>(path.size());
+  header.entry_size = static_cast<uint32_t>(entries.size());
+  header.taken =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(taken.time_since_epoch()).count();
+  header.transition_count = transition_count;
+
+  std::string blob;
+  appendValue(blob, header);
+  for (const auto& state : path) {
+    appendString(blob, state.state);
+    appendValue(blob, static_cast<int64_t>(state.in_state.count()));
+  }
+  appendString(blob, last_state);
+  for (const auto& entry : entries) {
+    appendString(blob, entry.key);
+    appendString(blob, entry.type);
+    appendString(blob, entry.value);
+  }
+  return blob;
+}
+
+Snapshot Snapshot::parse(const char* data, size_t size) {
+  Reader reader(data, size);
+  auto header = reader.value<Header>();
+  if (std::memcmp(header.magic, kSnapshotMagic, sizeof(kSnapshotMagic)) != 0 ||
+      header.version != kSnapshotVersion) {
+    throw RuntimeError("not a snapshot");
+  }
+  Snapshot snapshot;
+  snapshot.taken = std::chrono::system_clock::time_point(
+      std::chrono::duration_cast<std::chrono::system_clock::duration>(
+          std::chrono::nanoseconds(header.taken)));
+  snapshot.transition_count = header.transition_count;
+  for (uint32_t i = 0; i < header.path_size; i++) {
+    StateTime state;
+    state.state = reader.string();
+    state.in_state = DurationType(reader.value<int64_t>());
+    snapshot.path.push_back(std::move(state));
+  }
+  snapshot.last_state = reader.string();
+  for (uint32_t i = 0; i < header.entry_size; i++) {
+    Entry entry;
+    entry.key = reader.string();
+    entry.type = reader.string();
+    entry.value = reader.string();
+    snapshot.entries.push_back(std::move(entry));
+  }
+  return snapshot;
+}
+
+void Snapshot::save(const std::string& path) const {
+  std::string blob = serialize();
+  std::string temporary = path + ".tmp";
+  int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    throw RuntimeError(systemError("cannot open snapshot", temporary));
+  }
+  bool written = ::write(fd, blob.data(), blob.size()) == static_cast<ssize_t>(blob.size()) &&
+                 ::fsync(fd) == 0;
+  ::close(fd);
+  if (!written || ::rename(temporary.c_str(), path.c_str()) != 0) {
+    std::string error = systemError("cannot write snapshot", path);
+    ::unlink(temporary.c_str());
+    throw RuntimeError(error);
+  }
+}
+
+Snapshot Snapshot::load(const std::string& path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw RuntimeError(systemError("cannot open snapshot", path));
+  }
+  struct stat info;
+  if (::fstat(fd, &info) != 0 || info.st_size == 0) {
+    ::close(fd);
+    throw RuntimeError("not a snapshot: " + path);
+  }
+  size_t size = static_cast<size_t>(info.st_size);
+  void* mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mapping == MAP_FAILED) {
+    throw RuntimeError(systemError("cannot map snapshot", path));
+  }
+  try {
+    Snapshot snapshot = parse(static_cast<const char*>(mapping), size);
+    ::munmap(mapping, size);
+    return snapshot;
+  } catch (const RuntimeError& e) {
+    ::munmap(mapping, size);
+    throw RuntimeError(std::string(e.what()) + ": " + path);
+  }
+}
+
+}  // namespace sm
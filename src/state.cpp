@@ -2,35 +2,195 @@
 
 namespace sm {
 
+namespace {
+
+/// Marks one of the state's own hooks as running for as long as it lives.
+class OwnHook {
+ public:
+  explicit OwnHook(int& depth) : depth_(depth) { depth_++; }
+  ~OwnHook() { depth_--; }
+
+ private:
+  int& depth_;
+};
+
+}  // namespace
+
+void EventPack::track(const std::vector<std::string>& inputs) {
+  tracked_ = true;
+  input_keys_ = inputs;
+  inputs_.assign(inputs.size(), nullptr);
+  unresolved_ = inputs.size();
+  subscription_ = std::make_shared<InputSubscription>();
+  cache_ = kUnknown;
+}
+
+void EventPack::resolveInputs(const TypedBlackboard* blackboard, const DirtyFlag& owner) {
+  blackboard_ = blackboard;
+  owner_ = owner;
+  if (!blackboard) {
+    return;
+  }
+  seen_entries_ = blackboard->size();
+  for (size_t i = 0; i < inputs_.size() && unresolved_ > 0; i++) {
+    if (!inputs_[i]) {
+      inputs_[i] = blackboard->find(input_keys_[i]);
+      if (inputs_[i]) {
+        auto& subscribed = subscription_->slots;
+        if (std::find(subscribed.begin(), subscribed.end(), inputs_[i]) == subscribed.end()) {
+          // aliases the subscription, which keeps the flag alive for the slot
+          inputs_[i]->subscribe(DirtyFlag(subscription_, &subscription_->written), owner_);
+          subscribed.push_back(inputs_[i]);
+        }
+        unresolved_--;
+        cache_ = kUnknown;
+      }
+    }
+  }
+}
+
+bool EventPack::checkTracked() {
+  if (unresolved_ > 0 && blackboard_ && blackboard_->size() != seen_entries_) {
+    // an input entry was perhaps created during the visit
+    resolveInputs(blackboard_, owner_);
+  }
+  // the flag is cleared before the guard reads the inputs, so a racing write raises it again
+  bool written = subscription_->written.exchange(false, std::memory_order_acq_rel);
+  bool changed = written || cache_ == kUnknown || (event_ && event_->getRevision() != revision_);
+  if (!changed) {
+    return cache_ == kTrue;
+  }
+  if (event_) {
+    revision_ = event_->getRevision();
+  }
+  bool fired = guard_();
+  // without all its entries there is nothing to tell changes by
+  if (unresolved_ > 0) {
+    cache_ = kUnknown;
+    if (owner_) {
+      owner_->store(true, std::memory_order_release);
+    }
+  } else {
+    cache_ = fired ? kTrue : kFalse;
+  }
+  return fired;
+}
+
 StateBase::StateBase(const std::string& id)
     : is_enter_(false),
       is_terminate_(false),
+      event_driven_(false),
+      tick_interval_(kDefaultTickInterval),
+      clock_(Clock::steady()),
       id_(id),
-      last_state_id_(""),
-      next_state_id_(""),
-      trigger_event_id_(""),
-      tic_(0.), toc_(0.), duration_(0.) {}
+      last_state_(kInvalidHandle),
+      next_state_(kInvalidHandle),
+      trigger_event_(kInvalidHandle),
+      untracked_(0),
+      dirty_(std::make_shared<std::atomic<bool>>(true)),
+      own_hooks_(0),
+      foreign_events_(false),
+      metrics_enabled_(false) {
+  // the engine shares its tables right after construction, which assigns the real handle
+  handle_ = 0;
+}
 
 StateBase::~StateBase() {}
 
-void StateBase::spin() {
-  if (!is_enter_) {
-    onEnter();
-    is_enter_ = true;
-  }
+void StateBase::setIdTables(const NameTable::SharedPtr& state_ids,
+                            const NameTable::SharedPtr& event_ids) {
+  state_ids_ = state_ids;
+  event_ids_ = event_ids;
+  handle_ = state_ids_->intern(id_);
+}
 
-  sortByPriority(events_);
-  listEvents();
+void StateBase::makeIdTables() {
+  setIdTables(std::make_shared<NameTable>(), std::make_shared<NameTable>());
+}
 
+std::string StateBase::getNextStateID() const {
+  return next_state_ == kInvalidHandle ? std::string() : state_ids_->name(next_state_);
+}
+
+void StateBase::spin() {
+  enter();
   while (!is_terminate_) {
-    if (checkCondition()) {
+    if (tick()) {
       break;
     }
-    update();
-    std::this_thread::sleep_for(tick_interval_);
+    waitForNextTick();
+  }
+  leave();
+}
+
+void StateBase::enter() {
+  if (is_enter_) {
+    return;
+  }
+  onEnter();
+  is_enter_ = true;
+  SM_LOG_DEBUG("State {} has {} event(s)", id_, events_.size());
+  for (const auto& e : events_) {
+    SM_LOG_DEBUG("[State: {}]---[Event: {}, priority={}]---> [State: {}]", id_, e.name(),
+                 e.priority(), e.to_state());
+  }
+}
+
+bool StateBase::tick() {
+  auto now = clock_->now();
+  tick_started_ = now;
+  TimePoint started;
+  StateMetrics* metrics = activeMetrics();
+  if (metrics) {
+    started = std::chrono::steady_clock::now();
+    if (last_tick_ != TimePoint()) {
+      metrics->tick_period.record(now - last_tick_);
+    }
+    last_tick_ = now;
+  }
+  if (timers_) {
+    timers_->advance(now);
+  }
+  if (checkCondition()) {
+    return true;
+  }
+  update();
+  if (metrics && std::chrono::steady_clock::now() - started > tick_interval_) {
+    metrics->overruns.fetch_add(1, std::memory_order_relaxed);
+  }
+  return false;
+}
+
+void StateBase::leave() { onLeave(); }
+
+TimePoint StateBase::nextDeadline(const TimePoint& now) const {
+  auto deadline = now + tick_interval_;
+  if (timers_) {
+    deadline = std::min(deadline, timers_->nextDeadline());
+  }
+  return deadline;
+}
+
+void StateBase::notify() {
+  if (wakeup_) {
+    wakeup_->notify();
+  }
+}
+
+void StateBase::waitForNextTick() {
+  // deadlines count from the start of the tick, so the time spent in it does not add up
+  if (event_driven_ && wakeup_) {
+    // Block until an event or blackboard write signals us; the tick interval only bounds
+    // how long an idle state may go without running UpdateImpl().
+    clock_->sleepUntil(nextDeadline(tick_started_), wakeup_.get());
+    return;
   }
+  clock_->sleepUntil(tick_started_ + tick_interval_, nullptr);
+}
 
-  onLeave();
+void StateBase::registerEvents() {
+  OwnHook hook(own_hooks_);
+  registerEventsImpl();
 }
 
 std::string StateBase::listEvents() {
@@ -40,72 +200,253 @@ std::string StateBase::listEvents() {
     events += fmt::format("[State: {}]---[Event: {}, priority={}]---> [State: {}]\n", id_, e.name(),
                           e.priority(), e.to_state());
   }
-  std::cout << title << events;
   return title + events;
 }
 
 void StateBase::reset() {
   is_enter_ = false;
   is_terminate_ = false;
-  id_ = "";
-  last_state_id_ = "";
-  next_state_id_ = "";
-  trigger_event_id_ = "";
-  tic_ = 0.;
-  toc_ = 0.;
-  duration_ = 0;
+  next_state_ = kInvalidHandle;
+  trigger_event_ = kInvalidHandle;
+  last_tick_ = TimePoint();
+}
+
+bool StateBase::evaluate(EventPack& e) {
+  SM_LOG_DEBUG("Check event ({}) name: {}, to: {}, priority: {}", e.event() ? "class" : "func",
+               e.name(), e.to_state(), e.priority());
+  return e.check();
+}
+
+bool StateBase::evaluateAt(void* self, size_t index) {
+  auto state = static_cast<StateBase*>(self);
+  auto& e = state->events_[index];
+  if (!state->activeMetrics()) {
+    return state->evaluate(e);
+  }
+  auto start = std::chrono::steady_clock::now();
+  bool fired = state->evaluate(e);
+  state->condition_metrics_[index]->record(std::chrono::steady_clock::now() - start);
+  return fired;
 }
 
 bool StateBase::checkCondition() {
-  // check each events (sorted by priority) see if condition met)
-  bool trigger(false);
-  for (auto& e : events_) {
-    if (e.func().has_value()) {
-      std::cout << fmt::format("Check event (func) name: {}, to: {}, priority: {}\n", e.name(),
-                               e.to_state(), e.priority());
-      if (e.func().value()()) {
-        next_state_id_ = e.to_state();
-        std::cout << "Bring to [State: " << e.to_state() << "] by [Event: " << e.name() << "]"
-                  << std::endl;
-        trigger = true;
+  bool dirty = dirty_->exchange(false, std::memory_order_acq_rel);
+  if (untracked_ == 0 && !dirty) {
+    return false;
+  }
+  // events are sorted by priority, the first one whose condition is met wins
+  int fired = -1;
+  if (guard_pool_ && events_.size() > 1) {
+    fired = guard_pool_->evaluate(guard_batch_, events_.size(), &StateBase::evaluateAt, this);
+  } else {
+    for (size_t i = 0; i < events_.size(); i++) {
+      if (evaluateAt(this, i)) {
+        fired = static_cast<int>(i);
+        break;
       }
     }
-    if (e.event()) {
-      std::cout << fmt::format("Check event (class) name: {}, to: {}, priority: {}\n", e.name(),
-                               e.to_state(), e.priority());
-      if (e.event()->update()) {
-        next_state_id_ = e.to_state();
-        std::cout << "Bring to [State: " << e.to_state() << "] by [Event: " << e.name() << "]"
-                  << std::endl;
-        trigger = true;
-      }
+  }
+  if (fired < 0) {
+    return false;
+  }
+  // its cached result stays true, so a state that is not left fires it again
+  dirty_->store(true, std::memory_order_release);
+  auto& e = events_[fired];
+  next_state_ = e.target();
+  trigger_event_ = e.id();
+  SM_LOG_INFO("Bring to [State: {}] by [Event: {}]", e.to_state(), e.name());
+  return true;
+}
+
+bool StateBase::dispatch(Handle event) {
+  for (const auto& e : events_) {
+    if (e.id() == event) {
+      next_state_ = e.target();
+      trigger_event_ = e.id();
+      SM_LOG_INFO("Bring to [State: {}] by posted [Event: {}]", e.to_state(), e.name());
+      return true;
+    }
+  }
+  return false;
+}
+
+void StateBase::addEvent(EventPack&& pack) {
+  if (own_hooks_ == 0) {
+    // addExpression() and adoptEvent() record themselves and enter as a hook
+    foreign_events_ = true;
+  }
+  if (pack.isTracked()) {
+    auto& subscription = subscriptions_[pack.id()];
+    if (!subscription) {
+      subscription = std::make_shared<InputSubscription>();
+    }
+    pack.shareSubscription(subscription);
+    pack.resolveInputs(typed_blackboard_.get(), dirty_);
+  }
+  Handle id = pack.id();
+  auto same = std::find_if(events_.begin(), events_.end(),
+                           [id](const EventPack& e) { return e.id() == id; });
+  if (same != events_.end() && same->priority() == pack.priority()) {
+    *same = std::move(pack);
+  } else {
+    if (same != events_.end()) {
+      events_.erase(same);
+    }
+    // insert after events of equal priority so ties keep registration order
+    auto pos = std::upper_bound(events_.begin(), events_.end(), pack.priority(),
+                                [](Priority p, const EventPack& e) { return p > e.priority(); });
+    events_.insert(pos, std::move(pack));
+    if (metrics_) {
+      bindConditionMetrics();
     }
   }
+  // the replaced pack is gone, so is whatever event it pointed to that the state owned;
+  // emplaceEvent() and adoptEvent() take ownership of the new one after this
+  owned_events_.erase(id);
+  untracked_ = std::count_if(events_.begin(), events_.end(),
+                             [](const EventPack& e) { return !e.isTracked(); });
+  dirty_->store(true, std::memory_order_release);
+}
+
+void StateBase::addExpression(const std::string& name, const std::string& transit_to,
+                              Priority priority, const std::string& expression) {
+  if (priority > 100) {
+    throw LogicError("Event [" + name + "] of state [" + id_ + "] has priority " +
+                     std::to_string(priority) + ", out of [0, 100]");
+  }
+  assert(typed_blackboard_);
+  auto expr = GuardExpression::compile(expression, *typed_blackboard_, &entered_, clock_);
+  EventPack pack(name, eventIds().intern(name), transit_to, stateIds().intern(transit_to),
+                 priority, Guard([expr]() { return expr->evaluate(); }));
+  if (!expr->usesElapsed()) {
+    pack.track(expr->inputs());
+  }
+  if (own_hooks_ == 0) {
+    added_.push_back(AddedTransition{name, transit_to, priority, expression, nullptr});
+  }
+  OwnHook hook(own_hooks_);
+  addEvent(std::move(pack));
+}
 
-  return trigger;
+void StateBase::adoptEvent(const std::string& name, const std::string& transit_to,
+                           Priority priority, const EventMaker& make) {
+  if (priority > 100) {
+    throw LogicError("Event [" + name + "] of state [" + id_ + "] has priority " +
+                     std::to_string(priority) + ", out of [0, 100]");
+  }
+  std::unique_ptr<EventBase> event = make();
+  EventBase* raw = event.get();
+  raw->setBlackBoard(blackboard_);
+  raw->setTypedBlackboard(typed_blackboard_);
+  raw->setWakeupSignal(wakeup_);
+  raw->setTimingWheel(timers_);
+  raw->setClock(clock_);
+  raw->setDirtyFlag(dirty_);
+  EventPack pack(name, eventIds().intern(name), transit_to, stateIds().intern(transit_to),
+                 priority, Guard([raw]() { return raw->update(); }), raw);
+  if (raw->isTracked()) {
+    pack.track(raw->getInputs());
+  }
+  if (own_hooks_ == 0) {
+    added_.push_back(AddedTransition{name, transit_to, priority, std::string(), make});
+  }
+  Handle id = pack.id();
+  {
+    OwnHook hook(own_hooks_);
+    addEvent(std::move(pack));
+  }
+  owned_events_[id] = std::move(event);
 }
 
-void StateBase::sortByPriority(std::vector<EventPack>& events) {
-  std::sort(events.begin(), events.end(), [](const EventPack& l, const EventPack& r) {
-    if ((l.priority()) != (r.priority())) {
-      return (l.priority()) > (r.priority());
+void StateBase::addTransitions(const std::vector<AddedTransition>& transitions) {
+  for (const auto& t : transitions) {
+    if (t.make) {
+      adoptEvent(t.name, t.transit_to, t.priority, t.make);
+    } else {
+      addExpression(t.name, t.transit_to, t.priority, t.expression);
     }
-    return l.to_state() > r.to_state();
-  });
+  }
+}
+
+void StateBase::enableMetrics(bool enable) {
+  if (enable && !metrics_) {
+    metrics_ = std::make_shared<StateMetrics>();
+    bindConditionMetrics();
+  }
+  metrics_enabled_.store(enable, std::memory_order_release);
+}
+
+void StateBase::bindConditionMetrics() {
+  condition_metrics_.clear();
+  for (const auto& e : events_) {
+    condition_metrics_.push_back(&metrics_->condition(e.id()));
+  }
 }
 
 void StateBase::onEnter() {
-  onEnterImpl();
+  auto start = std::chrono::steady_clock::now();
+  entered_ = clock_->now();
+  {
+    OwnHook hook(own_hooks_);
+    onEnterImpl();
+  }
+  if (StateMetrics* metrics = activeMetrics()) {
+    metrics->enter.record(std::chrono::steady_clock::now() - start);
+  }
   reset();
-  tic_ = timeNow();
+  for (auto& e : events_) {
+    if (e.event()) {
+      e.event()->onStart();
+    }
+    if (e.isTracked()) {
+      // results may depend on what onEnterImpl() set up, start from a fresh evaluation
+      e.resolveInputs(typed_blackboard_.get(), dirty_);
+      e.forget();
+    }
+  }
+  dirty_->store(true, std::memory_order_release);
+}
+
+void StateBase::resume(const TimePoint& entered) {
+  entered_ = entered;
+  for (auto& e : events_) {
+    if (e.event()) {
+      e.event()->onResume(entered);
+    }
+    e.forget();
+  }
+  dirty_->store(true, std::memory_order_release);
 }
 
 void StateBase::onLeave() {
-  onLeaveImpl();
-  toc_ = timeNow();
-  duration_ = toc_ - tic_;
+  auto start = std::chrono::steady_clock::now();
+  {
+    OwnHook hook(own_hooks_);
+    onLeaveImpl();
+  }
+  for (auto& e : events_) {
+    if (e.event()) {
+      e.event()->onLeave();
+    }
+  }
+  is_enter_ = false;
+  left_ = clock_->now();
+  if (StateMetrics* metrics = activeMetrics()) {
+    metrics->leave.record(std::chrono::steady_clock::now() - start);
+    metrics->time_in_state.record(left_ - entered_);
+  }
 }
 
-void StateBase::update() { UpdateImpl(); }
+void StateBase::update() {
+  OwnHook hook(own_hooks_);
+  StateMetrics* metrics = activeMetrics();
+  if (!metrics) {
+    UpdateImpl();
+    return;
+  }
+  auto start = std::chrono::steady_clock::now();
+  UpdateImpl();
+  metrics->update.record(std::chrono::steady_clock::now() - start);
+}
 
 }  // namespace sm
\ No newline at end of file
@@ -0,0 +1,243 @@
+#include "state_machine/timing_wheel.h"
+
+namespace sm {
+
+TimingWheel::TimingWheel(const DurationType& resolution, const TimePoint& origin)
+    : resolution_(resolution),
+      origin_(origin),
+      current_tick_(0),
+      pending_(0),
+      free_head_(kNil),
+      due_head_(kNil),
+      firing_head_(kNil) {
+  if (resolution_.count() <= 0) {
+    throw LogicError("timing wheel resolution must be positive");
+  }
+  for (int level = 0; level < kLevels; level++) {
+    occupied_[level] = 0;
+    for (uint64_t slot = 0; slot < kSlots; slot++) {
+      heads_[level][slot] = kNil;
+    }
+  }
+}
+
+TimerId TimingWheel::schedule(const TimePoint& deadline, TimerCallback callback, void* context) {
+  uint32_t index;
+  if (free_head_ != kNil) {
+    index = free_head_;
+    free_head_ = nodes_[index].next;
+  } else {
+    index = static_cast<uint32_t>(nodes_.size());
+    nodes_.push_back(Node{0, nullptr, nullptr, 1, kNil, kNil, -1, 0});
+  }
+  Node& node = nodes_[index];
+  node.expiry = toTick(deadline, true);
+  node.callback = callback;
+  node.context = context;
+  pending_++;
+  place(index);
+  return (static_cast<TimerId>(node.generation) << 32) | index;
+}
+
+bool TimingWheel::cancel(TimerId id) {
+  uint32_t index = static_cast<uint32_t>(id & 0xffffffffULL);
+  uint32_t generation = static_cast<uint32_t>(id >> 32);
+  if (index >= nodes_.size() || nodes_[index].generation != generation ||
+      nodes_[index].level < 0) {
+    return false;
+  }
+  unlink(index);
+  release(index);
+  pending_--;
+  return true;
+}
+
+size_t TimingWheel::advance(const TimePoint& now) {
+  size_t fired = fire(kDueLevel, 0);
+  uint64_t target = toTick(now, false);
+  while (current_tick_ < target) {
+    uint64_t next = pending_ ? nextEventTick() : target;
+    if (next >= target) {
+      next = target;
+    }
+    current_tick_ = next;
+    // cascade from the top so timers moving down land in slots that are still ahead
+    for (int level = kLevels - 1; level > 0; level--) {
+      int shift = level * kLevelBits;
+      if ((current_tick_ & ((1ULL << shift) - 1)) == 0) {
+        cascade(level, static_cast<uint16_t>((current_tick_ >> shift) & (kSlots - 1)));
+      }
+    }
+    fired += fire(kDueLevel, 0);
+    fired += fire(0, static_cast<uint16_t>(current_tick_ & (kSlots - 1)));
+  }
+  return fired;
+}
+
+TimingWheel::TimePoint TimingWheel::nextDeadline() const {
+  if (due_head_ != kNil) {
+    return toTime(current_tick_);
+  }
+  if (pending_ == 0) {
+    return TimePoint::max();
+  }
+  return toTime(nextEventTick());
+}
+
+uint64_t TimingWheel::toTick(const TimePoint& time, bool round_up) const {
+  if (time <= origin_) {
+    return 0;
+  }
+  if (time == TimePoint::max()) {
+    return std::numeric_limits<uint64_t>::max();
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(time - origin_).count();
+  auto step = std::chrono::duration_cast<std::chrono::nanoseconds>(resolution_).count();
+  uint64_t tick = static_cast<uint64_t>(elapsed / step);
+  if (round_up && elapsed % step) {
+    tick++;
+  }
+  return tick;
+}
+
+TimingWheel::TimePoint TimingWheel::toTime(uint64_t tick) const {
+  return origin_ + std::chrono::duration_cast<Clock::duration>(resolution_ * tick);
+}
+
+uint64_t TimingWheel::nextEventTick() const {
+  uint64_t best = std::numeric_limits<uint64_t>::max();
+  for (int level = 0; level < kLevels; level++) {
+    uint64_t mask = occupied_[level];
+    if (!mask) {
+      continue;
+    }
+    int shift = level * kLevelBits;
+    uint64_t block = current_tick_ >> shift;
+    uint64_t index = block & (kSlots - 1);
+    uint64_t rotation = block & ~(kSlots - 1);
+    // slots after the current index come up in this rotation, the others in the next one
+    uint64_t ahead = (index == kSlots - 1) ? 0 : (mask & (~0ULL << (index + 1)));
+    uint64_t slot = ahead ? __builtin_ctzll(ahead) : kSlots + __builtin_ctzll(mask);
+    uint64_t tick = (rotation + slot) << shift;
+    if (tick < best) {
+      best = tick;
+    }
+  }
+  return best;
+}
+
+void TimingWheel::place(uint32_t index) {
+  Node& node = nodes_[index];
+  if (node.expiry <= current_tick_) {
+    link(index, kDueLevel, 0);
+    return;
+  }
+  uint64_t delta = node.expiry - current_tick_;
+  for (int level = 0; level < kLevels; level++) {
+    int shift = level * kLevelBits;
+    uint64_t span = 1ULL << (shift + kLevelBits);
+    if (delta < span || level == kLevels - 1) {
+      // beyond the wheel's range: park in the last reachable slot, it is placed again later
+      uint64_t at = (delta < span) ? node.expiry : current_tick_ + span - 1;
+      link(index, level, static_cast<uint16_t>((at >> shift) & (kSlots - 1)));
+      return;
+    }
+  }
+}
+
+void TimingWheel::link(uint32_t index, int level, uint16_t slot) {
+  uint32_t& head = headOf(level, slot);
+  Node& node = nodes_[index];
+  node.level = static_cast<int16_t>(level);
+  node.slot = slot;
+  node.prev = kNil;
+  node.next = head;
+  if (head != kNil) {
+    nodes_[head].prev = index;
+  }
+  head = index;
+  if (level < kLevels) {
+    occupied_[level] |= (1ULL << slot);
+  }
+}
+
+void TimingWheel::unlink(uint32_t index) {
+  Node& node = nodes_[index];
+  uint32_t& head = headOf(node.level, node.slot);
+  if (node.prev != kNil) {
+    nodes_[node.prev].next = node.next;
+  } else {
+    head = node.next;
+  }
+  if (node.next != kNil) {
+    nodes_[node.next].prev = node.prev;
+  }
+  if (head == kNil && node.level < kLevels) {
+    occupied_[node.level] &= ~(1ULL << node.slot);
+  }
+  node.level = -1;
+}
+
+void TimingWheel::cascade(int level, uint16_t slot) {
+  uint32_t index = heads_[level][slot];
+  heads_[level][slot] = kNil;
+  occupied_[level] &= ~(1ULL << slot);
+  while (index != kNil) {
+    uint32_t next = nodes_[index].next;
+    place(index);
+    index = next;
+  }
+}
+
+void TimingWheel::release(uint32_t index) {
+  Node& node = nodes_[index];
+  node.level = -1;
+  node.callback = nullptr;
+  node.context = nullptr;
+  if (++node.generation == 0) {
+    node.generation = 1;
+  }
+  node.next = free_head_;
+  free_head_ = index;
+}
+
+uint32_t& TimingWheel::headOf(int level, uint16_t slot) {
+  if (level == kDueLevel) {
+    return due_head_;
+  }
+  if (level == kFiringLevel) {
+    return firing_head_;
+  }
+  return heads_[level][slot];
+}
+
+size_t TimingWheel::fire(int level, uint16_t slot) {
+  // Move the list aside first: callbacks may cancel timers that are about to fire, and timers
+  // they schedule must not join this batch.
+  uint32_t& head = headOf(level, slot);
+  if (head == kNil) {
+    return 0;
+  }
+  firing_head_ = head;
+  head = kNil;
+  if (level < kLevels) {
+    occupied_[level] &= ~(1ULL << slot);
+  }
+  for (uint32_t i = firing_head_; i != kNil; i = nodes_[i].next) {
+    nodes_[i].level = kFiringLevel;
+  }
+  size_t fired = 0;
+  while (firing_head_ != kNil) {
+    uint32_t index = firing_head_;
+    TimerCallback callback = nodes_[index].callback;
+    void* context = nodes_[index].context;
+    unlink(index);
+    release(index);
+    pending_--;
+    fired++;
+    callback(context);
+  }
+  return fired;
+}
+
+}  // namespace sm
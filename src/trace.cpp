@@ -0,0 +1,205 @@
+#include "state_machine/trace.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+namespace sm {
+
+namespace {
+
+constexpr char kTraceMagic[8] = {'S', 'M', 'T', 'R', 'A', 'C', 'E', '\0'};
+constexpr uint32_t kTraceVersion = 1;
+
+std::string systemError(const std::string& what, const std::string& path) {
+  return what + " " + path + ": " + std::strerror(errno);
+}
+
+void appendNames(std::string& blob, const NameTable& table) {
+  uint32_t number = static_cast<uint32_t>(table.size());
+  blob.append(reinterpret_cast<const char*>(&number), sizeof(number));
+  for (Handle handle = 0; handle < number; handle++) {
+    const std::string& name = table.name(handle);
+    uint32_t length = static_cast<uint32_t>(name.size());
+    blob.append(reinterpret_cast<const char*>(&length), sizeof(length));
+    blob.append(name);
+  }
+}
+
+// the record count is read by other processes while the machine runs
+inline std::atomic<uint64_t>& sharedCount(uint64_t& count) {
+  return *reinterpret_cast<std::atomic<uint64_t>*>(&count);
+}
+
+bool readNames(const std::string& data, size_t& offset, std::vector<std::string>& names) {
+  uint32_t number;
+  if (offset + sizeof(number) > data.size()) {
+    return false;
+  }
+  std::memcpy(&number, data.data() + offset, sizeof(number));
+  offset += sizeof(number);
+  for (uint32_t i = 0; i < number; i++) {
+    uint32_t length;
+    if (offset + sizeof(length) > data.size()) {
+      return false;
+    }
+    std::memcpy(&length, data.data() + offset, sizeof(length));
+    offset += sizeof(length);
+    if (offset + length > data.size()) {
+      return false;
+    }
+    names.emplace_back(data, offset, length);
+    offset += length;
+  }
+  return true;
+}
+
+}  // namespace
+
+// File layout: Header, capacity records (record i in slot i % capacity), then the names.
+struct TraceFile::Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t capacity;
+  uint64_t count;  // records ever appended, published after the record
+  uint64_t names_offset;
+  uint64_t names_size;
+  uint8_t reserved[16];
+};
+static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t) &&
+                  std::atomic<uint64_t>::is_always_lock_free,
+              "trace files are shared through a lock-free 64-bit counter");
+
+std::string TraceContents::stateName(Handle handle) const {
+  return handle < states.size() ? states[handle] : "#" + std::to_string(handle);
+}
+
+std::string TraceContents::eventName(Handle handle) const {
+  return handle < events.size() ? events[handle] : "#" + std::to_string(handle);
+}
+
+std::string TraceContents::describe(const TransitionRecord& record) const {
+  return fmt::format("[{:.6f}] {} -> {} by {} (after {:.3f} ms)", record.timestamp * 1e-9,
+                     stateName(record.from), stateName(record.to), eventName(record.event),
+                     record.duration * 1e-6);
+}
+
+TraceFile::TraceFile(const std::string& path, size_t capacity)
+    : path_(path), fd_(-1), capacity_(capacity), header_(nullptr), records_(nullptr) {
+  if (capacity == 0) {
+    throw LogicError("trace file capacity must be positive");
+  }
+  fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd_ < 0) {
+    throw RuntimeError(systemError("cannot open trace file", path));
+  }
+  mapped_size_ = sizeof(Header) + capacity * sizeof(TransitionRecord);
+  if (::ftruncate(fd_, static_cast<off_t>(mapped_size_)) != 0) {
+    ::close(fd_);
+    throw RuntimeError(systemError("cannot resize trace file", path));
+  }
+  void* mapping = ::mmap(nullptr, mapped_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (mapping == MAP_FAILED) {
+    ::close(fd_);
+    throw RuntimeError(systemError("cannot map trace file", path));
+  }
+  header_ = new (mapping) Header();
+  std::memcpy(header_->magic, kTraceMagic, sizeof(kTraceMagic));
+  header_->version = kTraceVersion;
+  header_->record_size = sizeof(TransitionRecord);
+  header_->capacity = capacity;
+  header_->names_offset = mapped_size_;
+  header_->names_size = 0;
+  sharedCount(header_->count).store(0, std::memory_order_release);
+  records_ = reinterpret_cast<TransitionRecord*>(static_cast<uint8_t*>(mapping) + sizeof(Header));
+}
+
+TraceFile::~TraceFile() {
+  ::msync(header_, mapped_size_, MS_ASYNC);
+  ::munmap(header_, mapped_size_);
+  ::close(fd_);
+}
+
+void TraceFile::append(const TransitionRecord& record) {
+  std::atomic<uint64_t>& shared = sharedCount(header_->count);
+  uint64_t count = shared.load(std::memory_order_relaxed);
+  records_[count % capacity_] = record;
+  shared.store(count + 1, std::memory_order_release);
+}
+
+void TraceFile::writeNames(const NameTable& states, const NameTable& events) {
+  std::string blob;
+  appendNames(blob, states);
+  appendNames(blob, events);
+  if (::ftruncate(fd_, static_cast<off_t>(mapped_size_ + blob.size())) != 0 ||
+      ::pwrite(fd_, blob.data(), blob.size(), static_cast<off_t>(mapped_size_)) !=
+          static_cast<ssize_t>(blob.size())) {
+    throw RuntimeError(systemError("cannot write names to trace file", path_));
+  }
+  header_->names_size = blob.size();
+}
+
+TraceContents TraceFile::load(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    throw RuntimeError(systemError("cannot open trace file", path));
+  }
+  std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+  Header header;
+  if (data.size() < sizeof(Header)) {
+    throw RuntimeError("not a trace file: " + path);
+  }
+  std::memcpy(&header, data.data(), sizeof(Header));
+  if (std::memcmp(header.magic, kTraceMagic, sizeof(kTraceMagic)) != 0 ||
+      header.version != kTraceVersion || header.record_size != sizeof(TransitionRecord) ||
+      header.capacity == 0 ||
+      data.size() < sizeof(Header) + header.capacity * sizeof(TransitionRecord)) {
+    throw RuntimeError("not a trace file: " + path);
+  }
+
+  TraceContents contents;
+  contents.recorded = header.count;
+  uint64_t kept = std::min<uint64_t>(contents.recorded, header.capacity);
+  const char* records = data.data() + sizeof(Header);
+  for (uint64_t i = contents.recorded - kept; i < contents.recorded; i++) {
+    TransitionRecord record;
+    std::memcpy(&record, records + (i % header.capacity) * sizeof(TransitionRecord),
+                sizeof(record));
+    contents.records.push_back(record);
+  }
+
+  if (header.names_size > 0) {
+    size_t offset = header.names_offset;
+    if (!readNames(data, offset, contents.states) || !readNames(data, offset, contents.events)) {
+      throw RuntimeError("truncated names in trace file: " + path);
+    }
+  }
+  return contents;
+}
+
+TransitionTrace::TransitionTrace(size_t capacity) : ring_(capacity), count_(0) {
+  if (capacity == 0) {
+    throw LogicError("transition trace capacity must be positive");
+  }
+}
+
+std::vector<TransitionRecord> TransitionTrace::records() const {
+  std::vector<TransitionRecord> records;
+  records.reserve(size());
+  for (uint64_t i = count_ - size(); i < count_; i++) {
+    records.push_back(ring_[i % ring_.size()]);
+  }
+  return records;
+}
+
+void TransitionTrace::clear() { count_ = 0; }
+
+}  // namespace sm
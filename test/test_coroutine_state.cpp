@@ -0,0 +1,74 @@
+// Built as C++20, separately from test_state_machine.cpp, since coroutine_state.h needs
+// coroutines.
+#include "state_machine/coroutine_state.h"
+#include "state_machine/sm.h"
+
+#include <gtest/gtest.h>
+
+namespace sm {
+
+class IdleState : public StateBase {
+ public:
+  IdleState(const std::string& id) : StateBase(id) {}
+
+  virtual void UpdateImpl() override {}
+  virtual void onEnterImpl() override {}
+  virtual void onLeaveImpl() override {}
+};
+
+class FetchState : public CoroutineState {
+ public:
+  FetchState(const std::string& id) : CoroutineState(id) {}
+
+  virtual void registerEventsImpl() override {
+    registerEvent<10>("fetched", "state_b", [this]() { return finished(); });
+  }
+
+  StateTask run() override {
+    progress = 1;
+    co_await sleepFor(std::chrono::milliseconds(20));
+    progress = 2;
+    co_await changed(typed_blackboard_->entry<int32_t>("request"));
+    progress = 3;
+    value = co_await result(reply);
+    progress = 4;
+  }
+
+  int progress = 0;
+  int value = 0;
+  std::future<int> reply;
+};
+
+TEST(CoroutineStateTest, ResumesWhenReady) {
+  StateMachineEngine sme;
+  sme.addState<FetchState>("state_fetch");
+  sme.addState<IdleState>("state_b");
+  sme.setInitialStateID("state_fetch");
+  auto fetch = std::static_pointer_cast<FetchState>(sme.getState("state_fetch"));
+  std::promise<int> reply;
+  fetch->reply = reply.get_future();
+
+  sme.step();
+  EXPECT_EQ(fetch->progress, 1);
+  // the sleep is a timer, so the engine knows when to come back (to the wheel's 1 ms)
+  auto deadline = sme.step();
+  EXPECT_EQ(fetch->progress, 1);
+  EXPECT_LE(deadline, std::chrono::steady_clock::now() + std::chrono::milliseconds(21));
+  std::this_thread::sleep_for(std::chrono::milliseconds(25));
+  sme.step();
+  EXPECT_EQ(fetch->progress, 2);
+  sme.step();
+  EXPECT_EQ(fetch->progress, 2);
+  sme.getTypedBlackboard()->set<int32_t>("request", 1);
+  sme.step();
+  EXPECT_EQ(fetch->progress, 3);
+  sme.step();
+  reply.set_value(42);
+  sme.step();
+  EXPECT_EQ(fetch->progress, 4);
+  EXPECT_EQ(fetch->value, 42);
+  sme.step();
+  EXPECT_EQ(sme.getCurrentStateID(), "state_b");
+}
+
+}  // namespace sm
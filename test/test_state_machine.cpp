@@ -1,6 +1,11 @@
+#include "state_machine/batch_sm.h"
 #include "state_machine/event.h"
+#include "state_machine/executor.h"
+#include "state_machine/loader.h"
+#include "state_machine/logging.h"
 #include "state_machine/sm.h"
 #include "state_machine/state.h"
+#include "state_machine/static_sm.h"
 
 #include <gtest/gtest.h>
 
@@ -49,10 +54,10 @@ class TimeoutEvent : public EventBase {
   TimeoutEvent(double timeout) : EventBase(), timeout_(timeout) {}
   virtual ~TimeoutEvent() = default;
 
-  void onStart() { tic_ = Clock::now(); }
+  void onStart() { tic_ = clock_->now(); }
 
   bool update() {
-    Duration duration = Clock::now() - tic_;
+    Duration duration = clock_->now() - tic_;
     std::cout << "duration: " << duration.count() << " of " << timeout_ << std::endl;
     if (duration.count() > timeout_) {
       return true;
@@ -60,7 +65,7 @@ class TimeoutEvent : public EventBase {
     return false;
   }
 
-  void onLeave() { tic_ = Clock::now(); }
+  void onLeave() { tic_ = clock_->now(); }
 
  private:
   TimePoint tic_;
@@ -74,15 +79,9 @@ class StateA : public StateBase {
   virtual void onEnterImpl() override {
     this->registerEvent<50>("dummy_event_a0", "state_b", &event0_);
     this->registerEvent<51>("dummy_event_a1", "state_b", &event1_);
-    event0_.onStart();
-    event1_.onStart();
     enterLog(StateA);
   }
-  virtual void onLeaveImpl() override {
-    event0_.onLeave();
-    event1_.onLeave();
-    leaveLog(StateA);
-  }
+  virtual void onLeaveImpl() override { leaveLog(StateA); }
 
  private:
   CountoutEvent event0_;
@@ -113,6 +112,7 @@ class StateC : public StateBase {
   virtual void onEnterImpl() override {
     std::function<bool()> ff = std::bind(&TimeoutEvent::update, &event_);
     this->registerEvent<88>("dummy_event_c0", "state_a", ff);
+    event_.setClock(clock_);
 
     event_.onStart();
     enterLog(StateC);
@@ -126,6 +126,206 @@ class StateC : public StateBase {
   TimeoutEvent event_;
 };
 
+class WaitFlagState : public StateBase {
+ public:
+  WaitFlagState(const std::string& id) : StateBase(id) {}
+
+  virtual void UpdateImpl() override {}
+  virtual void onEnterImpl() override {
+    auto flag_set = [this]() { return blackboard_->get<bool>("go"); };
+    this->registerEvent<10>("flag_set", "state_b", flag_set);
+  }
+  virtual void onLeaveImpl() override {}
+};
+
+class PriorityState : public StateBase {
+ public:
+  PriorityState(const std::string& id) : StateBase(id) {}
+
+  virtual void UpdateImpl() override {}
+  virtual void onEnterImpl() override {
+    // legacy registration on entry must replace, not duplicate, the frozen entry
+    this->registerEvent<20>("low", "state_c", [this]() { low_checks++; return true; });
+  }
+  virtual void onLeaveImpl() override {}
+  virtual void registerEventsImpl() override {
+    this->registerEvent<20>("low", "state_c", [this]() { low_checks++; return true; });
+    this->registerEvent<80>("high", "state_b", []() { return true; });
+    this->registerEvent<80>("high_tie", "state_c", []() { return true; });
+  }
+
+  int low_checks = 0;
+};
+
+class DeadlineState : public StateBase {
+ public:
+  DeadlineState(const std::string& id) : StateBase(id), deadline_(std::chrono::milliseconds(50)) {}
+
+  virtual void UpdateImpl() override { updates++; }
+  virtual void onEnterImpl() override {}
+  virtual void onLeaveImpl() override {}
+  virtual void registerEventsImpl() override {
+    this->registerEvent<30>("deadline", "state_b", &deadline_);
+  }
+
+  int updates = 0;
+
+ private:
+  DeadlineEvent deadline_;
+};
+
+class PingState : public StateBase {
+ public:
+  PingState(const std::string& id)
+      : StateBase(id), deadline_(std::chrono::milliseconds(1)),
+        to_(id == "ping" ? "pong" : "ping") {}
+
+  virtual void UpdateImpl() override {}
+  virtual void onEnterImpl() override {}
+  virtual void onLeaveImpl() override {}
+  virtual void registerEventsImpl() override {
+    this->registerEvent<30>("deadline", to_, &deadline_);
+  }
+
+ private:
+  DeadlineEvent deadline_;
+  std::string to_;
+};
+
+/// Registers its tracked events again on every visit.
+class RevisitState : public StateBase {
+ public:
+  RevisitState(const std::string& id) : StateBase(id), to_(id == "left" ? "right" : "left") {}
+
+  virtual void UpdateImpl() override {}
+  virtual void onEnterImpl() override {
+    this->registerExpression<10>("cross", to_, "x > 0");
+    this->registerEvent<5>("never", to_, []() { return false; }, {"x"});
+  }
+  virtual void onLeaveImpl() override {}
+
+ private:
+  std::string to_;
+};
+
+class IdleState : public StateBase {
+ public:
+  IdleState(const std::string& id) : StateBase(id) {}
+
+  virtual void UpdateImpl() override {}
+  virtual void onEnterImpl() override {}
+  virtual void onLeaveImpl() override {}
+};
+
+class BusyState : public StateBase {
+ public:
+  BusyState(const std::string& id) : StateBase(id), work(std::chrono::milliseconds(3)) {}
+
+  virtual void UpdateImpl() override {
+    ticks.push_back(clock_->now());
+    static_cast<VirtualClock&>(*clock_).advance(work);
+  }
+  virtual void onEnterImpl() override {}
+  virtual void onLeaveImpl() override {}
+
+  DurationType work;
+  std::vector<TimePoint> ticks;
+};
+
+class EmplacingState : public StateBase {
+ public:
+  EmplacingState(const std::string& id) : StateBase(id) {}
+
+  virtual void UpdateImpl() override {}
+  virtual void onEnterImpl() override {}
+  virtual void onLeaveImpl() override {}
+  virtual void registerEventsImpl() override {
+    deadline = this->emplaceEvent<30, DeadlineEvent>("deadline", "idle",
+                                                     std::chrono::milliseconds(1));
+  }
+
+  DeadlineEvent* deadline = nullptr;
+};
+
+/// Fires right away and counts its live instances.
+class LiveEvent : public EventBase {
+ public:
+  LiveEvent() { live++; }
+  ~LiveEvent() override { live--; }
+  bool update() override { return true; }
+
+  static int live;
+};
+
+int LiveEvent::live = 0;
+
+/// Emplaces its event again on every visit.
+class ReemplacingState : public StateBase {
+ public:
+  ReemplacingState(const std::string& id)
+      : StateBase(id), to_(id == "left" ? "right" : "left") {}
+
+  virtual void UpdateImpl() override {}
+  virtual void onEnterImpl() override { this->emplaceEvent<10, LiveEvent>("cross", to_); }
+  virtual void onLeaveImpl() override {}
+
+ private:
+  std::string to_;
+};
+
+class LoggedState : public StateBase {
+ public:
+  LoggedState(const std::string& id) : StateBase(id) {}
+
+  virtual void UpdateImpl() override { updates++; }
+  virtual void onEnterImpl() override { log.push_back("enter " + id_); }
+  virtual void onLeaveImpl() override { log.push_back("leave " + id_); }
+
+  static std::vector<std::string> log;
+  int updates = 0;
+};
+
+std::vector<std::string> LoggedState::log;
+
+template <int N>
+class CountTo {
+ public:
+  void onStart() { count_ = 0; }
+  bool update() { return ++count_ >= N; }
+
+ private:
+  int count_ = 0;
+};
+
+struct GoIsSet {
+  bool operator()(const BlackboardType::Ptr& bb) const { return bb->get<bool>("go"); }
+};
+
+struct ResetRequest {};
+
+class StaticA : public StaticStateBase {
+ public:
+  void onEnterImpl() { enters++; }
+  void UpdateImpl() { updates++; }
+  int enters = 0, updates = 0;
+};
+
+class StaticB : public StaticStateBase {
+ public:
+  void UpdateImpl() { blackboard_->set<bool>("go", true); }
+};
+
+class StaticC : public StaticStateBase {
+ public:
+  void onLeaveImpl() { leaves++; }
+  int leaves = 0;
+};
+
+using StaticTable = TransitionTable<
+    Transition<StaticA, CountTo<5>, StaticB>,
+    Transition<StaticB, Always, StaticC, GoIsSet>,
+    Transition<StaticC, ResetRequest, StaticA>>;
+
 class StateMachineTest : public ::testing::Test {
  protected:
   void SetUp() override {}
@@ -165,7 +365,249 @@ TEST(BlackboardTest, Test1) {
   EXPECT_EQ(bb_get->e, e);  
 }
 
+TEST(BlackboardTest, SmBlackboard) {
+  auto bb = Blackboard::create();
+  ASSERT_NE(bb, nullptr);
+  EXPECT_EQ(bb->getAny("missing"), nullptr);
+  EXPECT_THROW(bb->get<int>("missing"), RuntimeError);
+  bb->set<int>("count", 3);
+  bb->set<int>("count", 4);
+  EXPECT_EQ(bb->get<int>("count"), 4);
+}
+
+struct Pose {
+  double x, y, z, w;
+};
+
+TEST(TypedBlackboardTest, EntriesAreTypedAndNeverTorn) {
+  auto bb = TypedBlackboard::create();
+  auto speed = bb->entry<double>("speed");
+  auto pose = bb->entry<Pose>("pose");
+  auto name = bb->entry<std::string>("name");
+  EXPECT_FALSE(speed.isSet());
+  EXPECT_THROW(bb->entry<int>("speed"), LogicError);
+  EXPECT_EQ(bb->entry<double>("speed").index(), speed.index());
+  EXPECT_EQ(bb->size(), 3u);
+
+  speed.set(2.5);
+  name.set("vehicle_7");
+  EXPECT_EQ(bb->get<double>("speed"), 2.5);
+  EXPECT_EQ(name.get(), "vehicle_7");
+  EXPECT_EQ(speed.version(), 1u);
+
+  const int writes = 20000;
+  std::atomic<bool> torn(false);
+  std::thread writer([&pose]() {
+    for (int i = 1; i <= writes; i++) {
+      double v = i;
+      pose.set(Pose{v, v, v, v});
+    }
+  });
+  std::vector<std::thread> readers;
+  for (int r = 0; r < 3; r++) {
+    readers.emplace_back([&pose, &torn]() {
+      for (int i = 0; i < writes; i++) {
+        Pose p = pose.get();
+        if (p.x != p.y || p.y != p.z || p.z != p.w) {
+          torn = true;
+        }
+      }
+    });
+  }
+  writer.join();
+  for (auto& reader : readers) {
+    reader.join();
+  }
+  EXPECT_FALSE(torn);
+  EXPECT_EQ(pose.get().w, writes);
+  EXPECT_EQ(pose.version(), static_cast<uint64_t>(writes));
+}
+
+TEST(IdTableTest, InternIsDenseAndStable) {
+  NameTable table;
+  EXPECT_EQ(table.intern("state_a"), 0u);
+  EXPECT_EQ(table.intern("state_b"), 1u);
+  EXPECT_EQ(table.intern("state_a"), 0u);
+  EXPECT_EQ(table.find("state_c"), kInvalidHandle);
+  EXPECT_EQ(table.name(1), "state_b");
+  EXPECT_EQ(table.size(), 2u);
+}
+
+TEST(LoggingTest, RecordsAreFormattedByTheBackend) {
+  std::vector<std::string> messages;
+  logging::Logger& logger = logging::Logger::instance();
+  logger.flush();
+  logger.setSink([&messages](LogLevel level, int64_t, const std::string& message) {
+    if (level >= LogLevel::Info) {
+      messages.push_back(message);
+    }
+  });
+
+  auto producer = [](int id) {
+    for (int i = 0; i < 3; i++) {
+      SM_LOG_INFO("worker {} record {} from {}", id, i, std::string("state_a"));
+    }
+    SM_LOG_DEBUG("compiled out {}", id);
+  };
+  std::thread first(producer, 1), second(producer, 2);
+  first.join();
+  second.join();
+  logger.flush();
+  logger.setSink(nullptr);
+
+  ASSERT_EQ(messages.size(), 6u);
+  EXPECT_NE(std::find(messages.begin(), messages.end(), "worker 1 record 2 from state_a"),
+            messages.end());
+  EXPECT_NE(std::find(messages.begin(), messages.end(), "worker 2 record 0 from state_a"),
+            messages.end());
+  EXPECT_EQ(logger.droppedNumber(), 0u);
+}
+
+TEST(MetricsTest, HistogramPercentiles) {
+  LatencyHistogram histogram;
+  EXPECT_EQ(histogram.percentile(50), 0);
+  for (int64_t us = 1; us <= 10000; us++) {
+    histogram.record(std::chrono::microseconds(us));
+  }
+  EXPECT_EQ(histogram.count(), 10000u);
+  EXPECT_EQ(histogram.min(), 1000);
+  EXPECT_EQ(histogram.max(), 10000000);
+  EXPECT_DOUBLE_EQ(histogram.mean(), 5000500.);
+  // never below the real value, at most one sub-bucket (1/16) above it
+  EXPECT_GE(histogram.percentile(50), 5000000);
+  EXPECT_LE(histogram.percentile(50), 5000000 * 17 / 16);
+  EXPECT_GE(histogram.percentile(99), 9900000);
+  EXPECT_LE(histogram.percentile(99), 10000000);
+  EXPECT_EQ(histogram.percentile(100), 10000000);
+  histogram.reset();
+  EXPECT_EQ(histogram.count(), 0u);
+}
+
+struct CopyCounter {
+  CopyCounter(int* copies, int* calls) : copies(copies), calls(calls) {}
+  CopyCounter(const CopyCounter& other) : copies(other.copies), calls(other.calls) {
+    (*copies)++;
+  }
+  bool operator()() { return ++(*calls) > 1; }
+  int* copies;
+  int* calls;
+};
+
+struct Toggle {
+  bool flip() { return on = !on; }
+  bool on = false;
+};
+
+TEST(GuardTest, InvokesInPlace) {
+  int copies = 0, calls = 0;
+  Guard counted{CopyCounter(&copies, &calls)};
+  int stored_copies = copies;
+  EXPECT_FALSE(counted());
+  EXPECT_TRUE(counted());
+  EXPECT_EQ(calls, 2);
+  EXPECT_EQ(copies, stored_copies);
+
+  Guard copy(counted);
+  EXPECT_EQ(copies, stored_copies + 1);
+  EXPECT_TRUE(copy());
+
+  Toggle toggle;
+  Guard member = Guard::bind<&Toggle::flip>(&toggle);
+  EXPECT_TRUE(member());
+  EXPECT_FALSE(member());
+
+  int limit = 3;
+  Guard lambda([&limit]() { return --limit == 0; });
+  Guard moved(std::move(lambda));
+  EXPECT_FALSE(moved());
+  EXPECT_FALSE(moved());
+  EXPECT_TRUE(moved());
+
+  EXPECT_FALSE(Guard(std::function<bool()>()));
+  StateMachineEngine engine;
+  engine.addState<IdleState>("idle");
+  EXPECT_THROW(engine.getState("idle")->registerEvent<10>("never", "idle", std::function<bool()>()),
+               LogicError);
+}
+
+TEST(GuardExpressionTest, CompilesToFoldedBytecode) {
+  auto bb = TypedBlackboard::create();
+  bb->set<int32_t>("mode", 2);
+  bb->set<bool>("armed", false);
+  auto expr = GuardExpression::compile("speed > 2 * 5 && (mode == 2 || !armed)", *bb);
+  EXPECT_EQ(expr->inputs(), (std::vector<std::string>{"speed", "mode", "armed"}));
+  EXPECT_FALSE(expr->usesElapsed());
+  // 2 * 5 is folded into the comparison's constant
+  EXPECT_NE(expr->disassemble().find("greater 10\n"), std::string::npos);
+  EXPECT_EQ(expr->disassemble().find("mul"), std::string::npos);
+
+  // speed had no entry and was created as a double
+  EXPECT_FALSE((*expr)());
+  bb->set<double>("speed", 12.0);
+  EXPECT_TRUE((*expr)());
+  bb->set<int32_t>("mode", 1);
+  EXPECT_TRUE((*expr)());
+  bb->set<bool>("armed", true);
+  EXPECT_FALSE((*expr)());
+
+  EXPECT_EQ(GuardExpression::compile("1 < 2 || speed", *bb)->disassemble(), "0: const 1\n");
+  EXPECT_THROW(GuardExpression::compile("speed >", *bb), LogicError);
+  EXPECT_THROW(GuardExpression::compile("speed = 3", *bb), LogicError);
+  EXPECT_THROW(GuardExpression::compile("elapsed > 1", *bb), LogicError);
+  bb->set<std::string>("name", "robot");
+  EXPECT_THROW(GuardExpression::compile("name > 1", *bb), LogicError);
+}
+
+TEST(TimingWheelTest, FiresAtDeadline) {
+  using namespace std::chrono;
+  auto origin = TimingWheel::Clock::time_point() + hours(1);
+  TimingWheel wheel(milliseconds(1), origin);
+  std::vector<int64_t> fired;
+  struct Ctx {
+    std::vector<int64_t>* fired;
+    int64_t ms;
+  };
+  auto record = [](void* c) {
+    auto ctx = static_cast<Ctx*>(c);
+    ctx->fired->push_back(ctx->ms);
+  };
+
+  std::vector<int64_t> delays = {0, 1, 63, 64, 65, 4095, 4096, 300000, 20000000};
+  std::vector<Ctx> contexts;
+  for (auto ms : delays) {
+    contexts.push_back(Ctx{&fired, ms});
+  }
+  for (auto& ctx : contexts) {
+    wheel.schedule(origin + milliseconds(ctx.ms), record, &ctx);
+  }
+  Ctx cancelled{&fired, -1};
+  TimerId id = wheel.schedule(origin + milliseconds(10), record, &cancelled);
+  EXPECT_TRUE(wheel.cancel(id));
+  EXPECT_FALSE(wheel.cancel(id));
+  EXPECT_EQ(wheel.pendingNumber(), delays.size());
+
+  for (size_t i = 0; i < delays.size(); i++) {
+    auto ms = delays[i];
+    // never early: nothing fires until the deadline is reached
+    if (ms > 0) {
+      wheel.advance(origin + milliseconds(ms) - microseconds(1));
+      EXPECT_EQ(fired.size(), i);
+    }
+    EXPECT_LE(wheel.nextDeadline(), origin + milliseconds(ms));
+    wheel.advance(origin + milliseconds(ms));
+    ASSERT_FALSE(fired.empty());
+    EXPECT_EQ(fired.back(), ms);
+  }
+  EXPECT_EQ(fired.size(), delays.size());
+  EXPECT_EQ(wheel.pendingNumber(), 0u);
+  EXPECT_EQ(wheel.nextDeadline(), TimingWheel::TimePoint::max());
+}
+
 TEST_F(StateMachineTest, Test1) {
+  // state_c times out after 2 s, which a virtual clock skips instead of waiting for
+  auto clock = std::make_shared<VirtualClock>();
+  sme.setClock(clock);
+  auto tic = std::chrono::steady_clock::now();
 
   sme.setGlobalTickInterval(std::chrono::milliseconds(10));
   sme.getBlackboard()->set<std::shared_ptr<sm::DummyData>>("dummy_data", dd);
@@ -184,9 +626,12 @@ TEST_F(StateMachineTest, Test1) {
   ASSERT_NE(state_b, nullptr);
   ASSERT_NE(state_c, nullptr);
 
+  EXPECT_EQ(sme.getState(sme.getStateHandle("state_b")), state_b);
+
   sme.setInitialStateID("state_a");
   sme.spinUntilStateChange();
   EXPECT_EQ(sme.getCurrentStateID(), "state_b"); // state_a -> state_b
+  EXPECT_EQ(sme.getCurrentState(), state_b->getHandle());
   sme.spinUntilStateChange();
   EXPECT_EQ(sme.getCurrentStateID(), "state_c"); // state_b -> state_c
   sme.spinUntilStateChange();
@@ -194,6 +639,765 @@ TEST_F(StateMachineTest, Test1) {
   std::cout << "Duration a: " << state_a->getDuration() << std::endl;
   std::cout << "Duration b:" << state_b->getDuration() << std::endl;
   std::cout << "Duration c:" << state_c->getDuration() << std::endl;
+  EXPECT_GE(state_c->getDuration(), 2.0);
+  EXPECT_GE(clock->now() - TimePoint(), std::chrono::seconds(2));
+  EXPECT_LT(std::chrono::steady_clock::now() - tic, std::chrono::seconds(1));
+  EXPECT_THROW(sme.setClock(clock), LogicError);
+}
+
+TEST_F(StateMachineTest, FixedRateTicksKeepTheirPhase) {
+  using std::chrono::milliseconds;
+  auto clock = std::make_shared<VirtualClock>();
+  sme.setClock(clock);
+  sme.setGlobalTickInterval(milliseconds(10));
+  sme.setFixedRate(true);
+  sme.addState<BusyState>("busy");
+  sme.setInitialStateID("busy");
+  auto busy = std::static_pointer_cast<BusyState>(sme.getState("busy"));
+  auto run = [this](int ticks) {
+    for (int i = 0; i < ticks; i++) {
+      sme.waitUntil(sme.step());
+    }
+  };
+  auto at = [](std::initializer_list<int> ms) {
+    std::vector<TimePoint> ticks;
+    for (int t : ms) {
+      ticks.push_back(TimePoint(milliseconds(t)));
+    }
+    return ticks;
+  };
+
+  // 3 ms of work per tick does not delay the following ticks
+  run(5);
+  EXPECT_EQ(busy->ticks, at({0, 10, 20, 30, 40}));
+  EXPECT_EQ(sme.getOverrunCount(), 0u);
+
+  // a 25 ms tick skips the periods it ran into
+  busy->work = milliseconds(25);
+  run(1);
+  busy->work = milliseconds(3);
+  run(1);
+  EXPECT_EQ(busy->ticks, at({0, 10, 20, 30, 40, 50, 80}));
+  EXPECT_EQ(sme.getOverrunCount(), 1u);
+
+  // or runs them back to back: periods 100, 110 and 120 are caught up by 130
+  sme.setFixedRate(true, OverrunPolicy::kCatchUp);
+  busy->ticks.clear();
+  busy->work = milliseconds(25);
+  run(1);
+  busy->work = milliseconds(3);
+  run(4);
+  EXPECT_EQ(busy->ticks, at({90, 115, 118, 121, 130}));
+  EXPECT_EQ(sme.getOverrunCount(), 4u);
+}
+
+TEST_F(StateMachineTest, PostedEventsTakeTheirTransition) {
+  sme.setEventQueueCapacity(512);
+  sme.addState<IdleState>("idle");
+  sme.addState<IdleState>("moving");
+  sme.addState<IdleState>("fault");
+  sme.getState("idle")->registerEvent<10>("go", "moving");
+  sme.getState("moving")->registerEvent<10>("stop", "idle", []() { return false; });
+  sme.setInitialStateID("idle");
+
+  // only posting fires an event registered without a guard
+  sme.step();
+  sme.step();
+  EXPECT_EQ(sme.getCurrentStateID(), "idle");
+  EXPECT_FALSE(sme.post("fly"));
+  EXPECT_TRUE(sme.post("go"));
+  sme.step();
+  EXPECT_EQ(sme.getCurrentStateID(), "moving");
+  // a posted event does not check the guard of its transition
+  EXPECT_TRUE(sme.post(sme.getEventHandle("stop")));
+  sme.step();
+  EXPECT_EQ(sme.getCurrentStateID(), "idle");
+
+  // events idle has no transition for are dropped, the rest wait for the next step
+  std::vector<std::thread> producers;
+  for (int i = 0; i < 4; i++) {
+    producers.emplace_back([this]() {
+      for (int j = 0; j < 100; j++) {
+        sme.post("stop");
+      }
+    });
+  }
+  for (auto& producer : producers) {
+    producer.join();
+  }
+  sme.post("go");
+  sme.post("stop");
+  sme.step();
+  EXPECT_EQ(sme.getCurrentStateID(), "moving");
+  sme.step();
+  EXPECT_EQ(sme.getCurrentStateID(), "idle");
+  EXPECT_EQ(sme.getDroppedEventCount(), 0u);
+}
+
+TEST_F(StateMachineTest, EventDrivenWakeup) {
+  // A tick this long would stall the test if the state still slept between ticks.
+  sme.setGlobalTickInterval(std::chrono::seconds(30));
+  sme.setEventDriven(true);
+  sme.getBlackboard()->set<bool>("go", false);
+
+  sme.addState<WaitFlagState>("state_wait");
+  sme.addState<StateB>("state_b");
+  sme.setInitialStateID("state_wait");
+
+  auto tic = std::chrono::steady_clock::now();
+  std::thread writer([this]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    sme.writeBlackboard<bool>("go", true);
+  });
+  sme.spinUntilStateChange();
+  writer.join();
+  auto elapsed = std::chrono::steady_clock::now() - tic;
+
+  EXPECT_EQ(sme.getCurrentStateID(), "state_b");
+  EXPECT_LT(elapsed, std::chrono::seconds(5));
+}
+
+TEST(StaticStateMachineTest, TransitionTable) {
+  StaticStateMachine<StaticTable> machine;
+  machine.getBlackboard()->set<bool>("go", false);
+  EXPECT_EQ(machine.StateNumber(), 3u);
+
+  int ticks = 1;
+  while (!machine.tick()) {
+    ticks++;
+  }
+  EXPECT_EQ(ticks, 5);
+  EXPECT_TRUE(machine.isIn<StaticB>());
+  EXPECT_EQ(machine.state<StaticA>().updates, 4);
+
+  EXPECT_FALSE(machine.tick());  // guard fails, StaticB sets "go"
+  EXPECT_TRUE(machine.tick());
+  EXPECT_TRUE(machine.isIn<StaticC>());
+
+  EXPECT_FALSE(machine.tick());  // StaticC only leaves on a tag event
+  EXPECT_TRUE(machine.processEvent(ResetRequest{}));
+  EXPECT_TRUE(machine.isIn<StaticA>());
+  EXPECT_EQ(machine.state<StaticA>().enters, 2);
+  EXPECT_EQ(machine.state<StaticC>().leaves, 1);
+  EXPECT_FALSE(machine.processEvent(ResetRequest{}));
+}
+
+TEST_F(StateMachineTest, FirstMatchByPriority) {
+  sme.setGlobalTickInterval(std::chrono::milliseconds(1));
+  sme.addState<PriorityState>("state_p");
+  sme.addState<StateB>("state_b");
+  auto state_p = std::dynamic_pointer_cast<PriorityState>(sme.getState("state_p"));
+  ASSERT_NE(state_p, nullptr);
+  EXPECT_EQ(state_p->EventNumber(), 3u);
+
+  for (int i = 0; i < 3; i++) {
+    sme.setInitialStateID("state_p");
+    sme.spinUntilStateChange();
+    // highest priority wins, ties go to the first registered, lower ones are not evaluated
+    EXPECT_EQ(sme.getCurrentStateID(), "state_b");
+    EXPECT_EQ(state_p->low_checks, 0);
+    EXPECT_EQ(state_p->EventNumber(), 3u);
+  }
+}
+
+TEST_F(StateMachineTest, DeadlineEventWakesExactly) {
+  sme.setGlobalTickInterval(std::chrono::seconds(30));
+  sme.setEventDriven(true);
+  sme.addState<DeadlineState>("state_deadline");
+  sme.addState<StateB>("state_b");
+  sme.setInitialStateID("state_deadline");
+
+  auto tic = std::chrono::steady_clock::now();
+  sme.spinUntilStateChange();
+  auto elapsed = std::chrono::steady_clock::now() - tic;
+
+  EXPECT_EQ(sme.getCurrentStateID(), "state_b");
+  EXPECT_GE(elapsed, std::chrono::milliseconds(50));
+  EXPECT_LT(elapsed, std::chrono::seconds(5));
+  // the state slept until the deadline instead of ticking
+  auto state = std::dynamic_pointer_cast<DeadlineState>(sme.getState("state_deadline"));
+  EXPECT_LE(state->updates, 2);
+  EXPECT_EQ(sme.getTimingWheel()->pendingNumber(), 0u);
+}
+
+TEST_F(StateMachineTest, TraceKeepsTheLatestTransitions) {
+  std::string path = testing::TempDir() + "state_machine_trace.bin";
+  sme.setGlobalTickInterval(std::chrono::seconds(30));
+  sme.setEventDriven(true);
+  sme.addState<PingState>("ping");
+  sme.addState<PingState>("pong");
+  sme.setInitialStateID("ping");
+  sme.setTraceCapacity(4);
+  sme.recordTrace(path);
+  for (int i = 0; i < 6; i++) {
+    sme.spinUntilStateChange();
+  }
+
+  const auto& trace = sme.getTrace();
+  EXPECT_EQ(trace.recordedNumber(), 6u);
+  auto records = trace.records();
+  ASSERT_EQ(records.size(), 4u);
+  Handle ping = sme.getStateHandle("ping"), pong = sme.getStateHandle("pong");
+  for (size_t i = 0; i < records.size(); i++) {
+    EXPECT_EQ(records[i].from, i % 2 ? pong : ping);
+    EXPECT_EQ(records[i].to, i % 2 ? ping : pong);
+    EXPECT_EQ(records[i].event, sme.getEventIdTable()->find("deadline"));
+    EXPECT_GE(records[i].duration, 1000000);
+    if (i > 0) {
+      EXPECT_GT(records[i].timestamp, records[i - 1].timestamp);
+    }
+  }
+  EXPECT_EQ(sme.generateFootprint(), "[ping] -> [pong] -> [ping] -> [pong] -> [ping]");
+
+  sme.stopRecordingTrace();
+  auto contents = TraceFile::load(path);
+  EXPECT_EQ(contents.recorded, 6u);
+  ASSERT_EQ(contents.records.size(), 4u);
+  EXPECT_EQ(contents.records.back().timestamp, records.back().timestamp);
+  EXPECT_EQ(contents.stateName(contents.records.back().to), "ping");
+  EXPECT_EQ(contents.eventName(contents.records.back().event), "deadline");
+  std::remove(path.c_str());
+}
+
+TEST_F(StateMachineTest, SnapshotResumesStateTimersAndEntries) {
+  auto build = [](StateMachineEngine& engine) {
+    engine.addState<DeadlineState>("state_wait");
+    engine.addState<IdleState>("state_b");
+    engine.getTypedBlackboard()->entry<double>("speed");
+    engine.getTypedBlackboard()->entry<int32_t>("mode");
+    engine.setInitialStateID("state_wait");
+  };
+  build(sme);
+  sme.getTypedBlackboard()->set<double>("speed", 3.5);
+  sme.getTypedBlackboard()->set<int32_t>("mode", 7);
+  sme.getTypedBlackboard()->set<std::string>("name", "robot");
+  static int target = 0;
+  sme.getTypedBlackboard()->set<int*>("target", &target);
+  sme.step();
+  std::this_thread::sleep_for(std::chrono::milliseconds(30));
+
+  std::string path = testing::TempDir() + "state_machine_snapshot.bin";
+  auto snapshot = sme.snapshot();
+  ASSERT_EQ(snapshot.path.size(), 1u);
+  EXPECT_GE(snapshot.path[0].in_state, std::chrono::milliseconds(30));
+  // strings and pointers stay out of the snapshot
+  EXPECT_EQ(snapshot.entries.size(), 2u);
+  snapshot.save(path);
+
+  StateMachineEngine restarted;
+  build(restarted);
+  restarted.restore(Snapshot::load(path));
+  std::remove(path.c_str());
+  EXPECT_EQ(restarted.getCurrentStateID(), "state_wait");
+  EXPECT_EQ(restarted.getTypedBlackboard()->get<double>("speed"), 3.5);
+  EXPECT_EQ(restarted.getTypedBlackboard()->get<int32_t>("mode"), 7);
+  restarted.step();
+  EXPECT_EQ(restarted.getCurrentStateID(), "state_wait");
+  // the 50 ms deadline counts from the first visit, not from the restore
+  std::this_thread::sleep_for(std::chrono::milliseconds(30));
+  restarted.step();
+  EXPECT_EQ(restarted.getCurrentStateID(), "state_b");
+
+  EXPECT_THROW(Snapshot::parse("SMTRACE", 7), RuntimeError);
+}
+
+TEST_F(StateMachineTest, MetricsCoverHooksEventsAndTicks) {
+  sme.setGlobalTickInterval(std::chrono::seconds(30));
+  sme.setEventDriven(true);
+  sme.addState<PingState>("ping");
+  sme.enableMetrics();
+  sme.addState<PingState>("pong");
+  sme.setInitialStateID("ping");
+  for (int i = 0; i < 4; i++) {
+    sme.spinUntilStateChange();
+  }
+
+  for (const std::string id : {"ping", "pong"}) {
+    auto metrics = sme.getMetrics(id);
+    ASSERT_NE(metrics, nullptr);
+    EXPECT_EQ(metrics->enter.count(), 2u);
+    EXPECT_EQ(metrics->leave.count(), 2u);
+    EXPECT_EQ(metrics->time_in_state.count(), 2u);
+    EXPECT_GE(metrics->time_in_state.min(), 1000000);
+    // the deadline woke the state, which then ticked once more to fire the event
+    auto condition = metrics->findCondition(sme.getEventIdTable()->find("deadline"));
+    ASSERT_NE(condition, nullptr);
+    EXPECT_GE(condition->count(), 2u);
+    EXPECT_GE(metrics->update.count(), 2u);
+    EXPECT_GE(metrics->tick_lateness.count(), 1u);
+    EXPECT_EQ(metrics->overruns.load(), 0u);
+  }
+  auto report = sme.metricsReport();
+  EXPECT_NE(report.find("pong (0 overrun(s))"), std::string::npos);
+  EXPECT_NE(report.find("event deadline"), std::string::npos);
+
+  sme.enableMetrics(false);
+  EXPECT_EQ(sme.getMetrics("ping"), nullptr);
+}
+
+TEST_F(StateMachineTest, ParentEventsCoverTheirSubtree) {
+  bool estop = false, go = false, reset = false;
+  int estop_checks = 0;
+  sme.addState<LoggedState>("operational");
+  sme.addState<LoggedState>("idle", "operational");
+  sme.addState<LoggedState>("moving", "operational");
+  sme.addState<LoggedState>("fault");
+  sme.getState("operational")->registerEvent<90>("estop", "fault", [&]() {
+    estop_checks++;
+    return estop;
+  });
+  sme.getState("idle")->registerEvent<10>("go", "moving", [&go]() { return go; });
+  sme.getState("fault")->registerEvent<10>("reset", "operational", [&reset]() { return reset; });
+  sme.setInitialStateID("operational");
+  LoggedState::log.clear();
+
+  // entering the parent enters its first child
+  sme.step();
+  EXPECT_EQ(sme.getCurrentStateID(), "idle");
+  EXPECT_TRUE(sme.isInState("operational"));
+  EXPECT_EQ(LoggedState::log, std::vector<std::string>({"enter operational", "enter idle"}));
+  EXPECT_EQ(sme.getState("operational")->getTriggerEvent(), kInvalidHandle);
+  EXPECT_EQ(std::dynamic_pointer_cast<LoggedState>(sme.getState("operational"))->updates, 1);
+
+  // a sibling transition leaves the parent active
+  LoggedState::log.clear();
+  go = true;
+  sme.step();
+  sme.step();
+  EXPECT_EQ(sme.getCurrentStateID(), "moving");
+  EXPECT_EQ(LoggedState::log, std::vector<std::string>({"leave idle", "enter moving"}));
+
+  // the parent's guard ran once per tick, whichever child was active
+  EXPECT_EQ(estop_checks, 3);
+  LoggedState::log.clear();
+  estop = true;
+  sme.step();
+  EXPECT_EQ(sme.getCurrentStateID(), "fault");
+  EXPECT_FALSE(sme.isInState("operational"));
+  EXPECT_EQ(LoggedState::log, std::vector<std::string>({"leave moving", "leave operational"}));
+
+  LoggedState::log.clear();
+  estop = false;
+  go = false;
+  reset = true;
+  sme.step();
+  sme.step();
+  EXPECT_EQ(sme.getCurrentStateID(), "idle");
+  EXPECT_EQ(LoggedState::log, std::vector<std::string>(
+                                  {"enter fault", "leave fault", "enter operational", "enter idle"}));
+  EXPECT_EQ(sme.getTrace().records().back().from, sme.getStateHandle("fault"));
+  EXPECT_EQ(sme.getTrace().records().back().to, sme.getStateHandle("idle"));
+}
+
+TEST_F(StateMachineTest, ParallelGuardsKeepPriorityOrder) {
+  using std::chrono::milliseconds;
+  std::atomic<int> started(0), cancelled(0);
+  auto slow = [&](milliseconds cost, bool result) {
+    return [&started, &cancelled, cost, result]() {
+      started++;
+      auto until = std::chrono::steady_clock::now() + cost;
+      while (std::chrono::steady_clock::now() < until) {
+        if (guardCancelled()) {
+          cancelled++;
+          return false;
+        }
+        std::this_thread::sleep_for(milliseconds(1));
+      }
+      return result;
+    };
+  };
+  sme.addState<IdleState>("state_busy");
+  sme.addState<IdleState>("state_a");
+  sme.addState<IdleState>("state_b");
+  auto busy = sme.getState("state_busy");
+  busy->registerEvent<90>("map_query", "state_a", slow(milliseconds(40), false));
+  busy->registerEvent<80>("geometry", "state_b", slow(milliseconds(60), true));
+  // cancelled once geometry fires
+  busy->registerEvent<70>("heavy", "state_a", slow(milliseconds(2000), true));
+  // fires first in wall time, but loses to the higher priority geometry check
+  busy->registerEvent<60>("quick", "state_a", slow(milliseconds(0), true));
+  // after quick fired, it can no longer win and is never started
+  busy->registerEvent<50>("never_started", "state_a", slow(milliseconds(0), true));
+  sme.setGuardPool(std::make_shared<GuardPool>(3));
+  sme.setInitialStateID("state_busy");
+
+  auto tic = std::chrono::steady_clock::now();
+  sme.step();
+  auto elapsed = std::chrono::steady_clock::now() - tic;
+
+  EXPECT_EQ(sme.getCurrentStateID(), "state_b");
+  EXPECT_EQ(busy->getTriggerEvent(), sme.getEventIdTable()->find("geometry"));
+  // bounded by the slowest guard that matters, not by the sum of all of them
+  EXPECT_LT(elapsed, milliseconds(1000));
+  EXPECT_EQ(cancelled, 1);
+  EXPECT_EQ(started, 4);
+}
+
+TEST_F(StateMachineTest, EventsRegisteredOnEveryVisitSubscribeOnce) {
+  sme.addState<RevisitState>("left");
+  sme.addState<RevisitState>("right");
+  sme.setInitialStateID("left");
+  sme.getTypedBlackboard()->set<double>("x", 1.0);
+  const SlotBase* x = sme.getTypedBlackboard()->find("x");
+
+  for (int i = 0; i < 4; i++) {
+    sme.step();
+  }
+  size_t subscribers = x->subscriberNumber();
+  EXPECT_EQ(subscribers, 4u);
+  uint64_t transitions = sme.getTransitionCount();
+  for (int i = 0; i < 200; i++) {
+    sme.step();
+  }
+  EXPECT_GE(sme.getTransitionCount(), transitions + 90);
+  EXPECT_EQ(x->subscriberNumber(), subscribers);
+}
+
+TEST_F(StateMachineTest, GuardsRunAgainOnlyWhenTheirInputsChange) {
+  int evaluations = 0;
+  sme.addState<IdleState>("state_cruise");
+  sme.addState<IdleState>("state_b");
+  auto speed = sme.getTypedBlackboard()->entry<double>("speed");
+  speed.set(1.0);
+  auto cruise = sme.getState("state_cruise");
+  cruise->registerEvent<10>(
+      "too_fast", "state_b",
+      [&evaluations, speed]() {
+        evaluations++;
+        return speed.get() > 10.0;
+      },
+      {"speed"});
+  sme.setInitialStateID("state_cruise");
+
+  for (int i = 0; i < 5; i++) {
+    sme.step();
+  }
+  EXPECT_EQ(evaluations, 1);
+
+  speed.set(2.0);
+  sme.step();
+  sme.step();
+  EXPECT_EQ(evaluations, 2);
+  EXPECT_EQ(sme.getCurrentStateID(), "state_cruise");
+
+  // an input created during the visit is picked up, after which the result is cached
+  int armed_evaluations = 0;
+  cruise->registerEvent<5>(
+      "armed", "state_b",
+      [&armed_evaluations, this]() {
+        armed_evaluations++;
+        auto bb = sme.getTypedBlackboard();
+        return bb->has("armed") && bb->get<bool>("armed");
+      },
+      {"armed"});
+  sme.step();
+  sme.step();
+  EXPECT_EQ(armed_evaluations, 2);
+  sme.getTypedBlackboard()->set<bool>("armed", false);
+  sme.step();
+  sme.step();
+  sme.step();
+  EXPECT_EQ(armed_evaluations, 3);
+  EXPECT_EQ(evaluations, 2);
+
+  speed.set(20.0);
+  sme.step();
+  EXPECT_EQ(evaluations, 3);
+  EXPECT_EQ(sme.getCurrentStateID(), "state_b");
+}
+
+TEST_F(StateMachineTest, ExpressionGuardsReadTheTypedBlackboard) {
+  sme.addState<IdleState>("state_cruise");
+  sme.addState<IdleState>("state_b");
+  sme.addState<IdleState>("state_c");
+  auto cruise = sme.getState("state_cruise");
+  cruise->registerExpression<20>("overspeed", "state_b", "speed > limit + 5");
+  cruise->registerExpression<10>("settled", "state_c", "elapsed >= 0.02 && speed < 1");
+  sme.getState("state_b")->registerExpression<10>("slowed", "state_cruise", "speed < 1");
+  sme.getTypedBlackboard()->set<double>("limit", 10.0);
+  sme.getTypedBlackboard()->set<double>("speed", 14.0);
+  sme.setInitialStateID("state_cruise");
+
+  sme.step();
+  EXPECT_EQ(sme.getCurrentStateID(), "state_cruise");
+  sme.getTypedBlackboard()->set<double>("speed", 16.0);
+  sme.step();
+  EXPECT_EQ(sme.getCurrentStateID(), "state_b");
+
+  sme.getTypedBlackboard()->set<double>("speed", 0.5);
+  sme.step();
+  EXPECT_EQ(sme.getCurrentStateID(), "state_cruise");
+  // elapsed counts from entering state_cruise again
+  sme.step();
+  EXPECT_EQ(sme.getCurrentStateID(), "state_cruise");
+  std::this_thread::sleep_for(std::chrono::milliseconds(30));
+  sme.step();
+  EXPECT_EQ(sme.getCurrentStateID(), "state_c");
+}
+
+TEST_F(StateMachineTest, DefinitionsLoadFromTextAndImages) {
+  const std::string text = R"(
+    # a patrol robot
+    state idle Idle
+    state active Idle
+    state moving Idle active
+    state docked Idle active
+    initial idle
+    transition idle start moving 50 if speed > 1 && !stopped
+    transition active abort idle 90 if stopped
+    transition moving dock docked 40 use deadline 20ms
+  )";
+  MachineFactory factory;
+  factory.registerState<IdleState>("Idle");
+  auto image = MachineImage::compile(MachineDefinition::parse(text));
+  std::string path = testing::TempDir() + "state_machine_image.bin";
+  image.save(path);
+  auto mapped = MachineImage::load(path);
+  std::remove(path.c_str());
+
+  ASSERT_EQ(mapped.stateNumber(), 4u);
+  for (Handle i = 0; i < mapped.stateNumber(); i++) {
+    EXPECT_EQ(mapped.findState(mapped.state(i).id), i);
+  }
+  EXPECT_EQ(mapped.findState("flying"), kInvalidHandle);
+
+  factory.build(mapped, sme);
+  auto bb = sme.getTypedBlackboard();
+  sme.step();
+  EXPECT_EQ(sme.getCurrentStateID(), "idle");
+  bb->set<double>("speed", 2.0);
+  sme.step();
+  EXPECT_EQ(sme.getCurrentStateID(), "moving");
+  // enters moving, which starts the deadline
+  sme.step();
+  std::this_thread::sleep_for(std::chrono::milliseconds(25));
+  sme.step();
+  EXPECT_EQ(sme.getCurrentStateID(), "docked");
+  bb->set<double>("stopped", 1.0);
+  sme.step();
+  EXPECT_EQ(sme.getCurrentStateID(), "idle");
+
+  EXPECT_THROW(MachineDefinition::parse("state a Idle\ntransition a go b 101 if x"), LogicError);
+  EXPECT_THROW(MachineImage::compile(MachineDefinition::parse("state a Idle\ninitial b")),
+               LogicError);
+  StateMachineEngine other;
+  EXPECT_THROW(factory.build(MachineDefinition::parse("state a Drive"), other), LogicError);
+}
+
+TEST(MachineArenaTest, EnginesStatesAndEventsComeFromTheArena) {
+  std::weak_ptr<MachineArena> weak;
+  std::vector<StateMachineEngine::SharedPtr> engines;
+  {
+    auto arena = MachineArena::create();
+    weak = arena;
+    for (int i = 0; i < 100; i++) {
+      auto engine = arena->make<StateMachineEngine>(arena);
+      engine->addState<EmplacingState>("timed");
+      engine->addState<IdleState>("idle");
+      engine->setInitialStateID("timed");
+      engines.push_back(engine);
+    }
+  }
+  // everything allocated from the arena keeps it alive
+  EXPECT_FALSE(weak.expired());
+
+  auto first = std::static_pointer_cast<EmplacingState>(engines[0]->getState("timed"));
+  auto second = std::static_pointer_cast<EmplacingState>(engines[1]->getState("timed"));
+  EXPECT_LT(first->deadline->getId(), second->deadline->getId());
+  first.reset();
+  second.reset();
+
+  for (auto& engine : engines) {
+    engine->step();
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  for (auto& engine : engines) {
+    engine->step();
+    EXPECT_EQ(engine->getCurrentStateID(), "idle");
+  }
+  engines.clear();
+  EXPECT_TRUE(weak.expired());
+}
+
+TEST(MachineArenaTest, EventsEmplacedOnEveryVisitAreReleased) {
+  auto arena = MachineArena::create();
+  {
+    auto engine = arena->make<StateMachineEngine>(arena);
+    engine->addState<ReemplacingState>("left");
+    engine->addState<ReemplacingState>("right");
+    engine->setInitialStateID("left");
+    for (int i = 0; i < 200; i++) {
+      engine->step();
+    }
+    EXPECT_GE(engine->getTransitionCount(), 90u);
+    // the latest event of each state, not one per visit
+    EXPECT_EQ(LiveEvent::live, 2);
+  }
+  EXPECT_EQ(LiveEvent::live, 0);
+}
+
+TEST(StateMachineEngineTest, ClonesShareTheDefinitionButNotTheirState) {
+  StateMachineEngine prototype;
+  prototype.addState<IdleState>("patrol");
+  prototype.addState<PingState>("ping", "patrol");
+  prototype.addState<PingState>("pong", "patrol");
+  prototype.setInitialStateID("patrol");
+
+  std::vector<StateMachineEngine::SharedPtr> clones;
+  for (int i = 0; i < 10; i++) {
+    clones.push_back(prototype.clone(i % 2 ? MachineArena::create() : nullptr));
+  }
+  for (auto& clone : clones) {
+    EXPECT_EQ(clone->StateNumber(), 3);
+    EXPECT_EQ(clone->getStateIdTable(), prototype.getStateIdTable());
+    EXPECT_EQ(clone->getStateHandle("pong"), prototype.getStateHandle("pong"));
+    EXPECT_NE(clone->getState("ping"), prototype.getState("ping"));
+    EXPECT_NE(clone->getTypedBlackboard(), prototype.getTypedBlackboard());
+    clone->step();
+    EXPECT_EQ(clone->getCurrentStateID(), "ping");
+    EXPECT_TRUE(clone->isInState("patrol"));
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(3));
+  clones[0]->step();
+  EXPECT_EQ(clones[0]->getCurrentStateID(), "pong");
+  EXPECT_EQ(clones[1]->getCurrentStateID(), "ping");
+  EXPECT_EQ(prototype.getTransitionCount(), 0u);
+
+  // a stepped engine still clones into its initial state
+  auto again = clones[0]->clone();
+  again->step();
+  EXPECT_EQ(again->getCurrentStateID(), "ping");
+}
+
+TEST(StateMachineEngineTest, ClonesOfBuiltEnginesKeepTheirLoadedTransitions) {
+  MachineFactory factory;
+  factory.registerState<IdleState>("Idle");
+  StateMachineEngine prototype;
+  factory.build(MachineDefinition::parse(R"(
+    state a Idle
+    state b Idle
+    state c Idle
+    initial a
+    transition a go b 10 if x > 1
+    transition b done c 10 use deadline 5ms
+  )"),
+                prototype);
+
+  auto clone = prototype.clone();
+  clone->step();
+  EXPECT_EQ(clone->getCurrentStateID(), "a");
+  // the expression reads the clone's blackboard, not the prototype's
+  prototype.getTypedBlackboard()->set<double>("x", 2.0);
+  clone->step();
+  EXPECT_EQ(clone->getCurrentStateID(), "a");
+  clone->getTypedBlackboard()->set<double>("x", 2.0);
+  clone->step();
+  EXPECT_EQ(clone->getCurrentStateID(), "b");
+  clone->step();
+  std::this_thread::sleep_for(std::chrono::milliseconds(8));
+  clone->step();
+  EXPECT_EQ(clone->getCurrentStateID(), "c");
+  EXPECT_EQ(prototype.getCurrentStateID(), "a");
+
+  // a lambda added from outside cannot be repeated on a new instance
+  prototype.getState("c")->registerEvent<10>("back", "a", []() { return true; });
+  EXPECT_THROW(prototype.clone(), LogicError);
+}
+
+TEST(BatchStateMachineTest, InstancesStepIndependently) {
+  auto definition = std::make_shared<BatchDefinition>();
+  definition->addState("idle");
+  definition->addState("moving");
+  definition->addState("stopped");
+  definition->addTransition<10>("start", "idle", "moving", "speed", Compare::Greater, 0.5f);
+  definition->addTransition<20>("brake", "moving", "stopped", "obstacle", Compare::Less, 2.0f);
+  definition->addTransition<10>("park", "moving", "idle", "speed", Compare::LessEqual, 0.5f);
+  definition->addTimeout<10>("resume", "stopped", "idle", std::chrono::milliseconds(100));
+
+  // not a multiple of the vector width, so the scalar tail runs too
+  BatchStateMachine batch(definition, 11, "idle");
+  float* speed = batch.input("speed");
+  float* obstacle = batch.input("obstacle");
+  for (size_t i = 0; i < batch.size(); i++) {
+    speed[i] = (i % 2 == 0) ? 1.0f : 0.0f;
+    obstacle[i] = 10.0f;
+  }
+  EXPECT_EQ(batch.step(std::chrono::milliseconds(10)), 6u);
+  for (size_t i = 0; i < batch.size(); i++) {
+    EXPECT_EQ(batch.getStateID(i), (i % 2 == 0) ? "moving" : "idle");
+  }
+  EXPECT_EQ(batch.changed().front(), 0u);
+
+  // brake outranks park for instance 10 even though both hold
+  obstacle[4] = 1.0f;
+  obstacle[10] = 1.0f;
+  speed[10] = 0.0f;
+  speed[8] = 0.0f;
+  EXPECT_EQ(batch.step(std::chrono::milliseconds(10)), 3u);
+  EXPECT_EQ(batch.getStateID(4), "stopped");
+  EXPECT_EQ(batch.getStateID(10), "stopped");
+  EXPECT_EQ(batch.getTriggerEvent(10), definition->getEventIdTable()->find("brake"));
+  EXPECT_EQ(batch.getStateID(8), "idle");
+  EXPECT_EQ(batch.getStateID(2), "moving");
+
+  // one transition per step: stopped instances wait out their timeout
+  batch.step(std::chrono::milliseconds(60));
+  EXPECT_EQ(batch.getStateID(4), "stopped");
+  batch.step(std::chrono::milliseconds(60));
+  EXPECT_EQ(batch.getStateID(4), "idle");
+  EXPECT_FLOAT_EQ(batch.getElapsed(4), 0.0f);
+
+  EXPECT_THROW(batch.input("altitude"), LogicError);
+}
+
+TEST(ExecutorTest, StepsManyEnginesOnFewThreads) {
+  const size_t engine_number = 200;
+  std::vector<StateMachineEngine::SharedPtr> engines;
+  for (size_t i = 0; i < engine_number; i++) {
+    auto engine = std::make_shared<StateMachineEngine>();
+    engine->setGlobalTickInterval(std::chrono::seconds(30));
+    engine->addState<PingState>("ping");
+    engine->addState<PingState>("pong");
+    engine->setInitialStateID("ping");
+    engines.push_back(engine);
+  }
+  auto waiter = std::make_shared<StateMachineEngine>();
+  waiter->setGlobalTickInterval(std::chrono::seconds(30));
+  waiter->getBlackboard()->set<bool>("go", false);
+  waiter->addState<WaitFlagState>("state_wait");
+  waiter->addState<IdleState>("state_b");
+  waiter->setInitialStateID("state_wait");
+
+  Executor executor(2);
+  for (auto& engine : engines) {
+    executor.add(engine);
+  }
+  executor.add(waiter);
+  EXPECT_EQ(executor.EngineNumber(), engine_number + 1);
+  executor.start();
+
+  auto all_cycled = [&engines]() {
+    for (auto& engine : engines) {
+      if (engine->getTransitionCount() < 10) {
+        return false;
+      }
+    }
+    return true;
+  };
+  auto timeout = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (!all_cycled() && std::chrono::steady_clock::now() < timeout) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  EXPECT_TRUE(all_cycled());
+
+  // a notify() reschedules a sleeping engine without waiting for its 30 s tick
+  EXPECT_EQ(waiter->getTransitionCount(), 0u);
+  waiter->writeBlackboard<bool>("go", true);
+  while (waiter->getTransitionCount() == 0 && std::chrono::steady_clock::now() < timeout) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  executor.stop();
+  EXPECT_GE(waiter->getTransitionCount(), 1u);
 }
 
 }  // namespace sm
\ No newline at end of file
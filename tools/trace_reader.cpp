@@ -0,0 +1,49 @@
+// Print or replay a transition trace written by StateMachineEngine::recordTrace().
+//
+//   trace_reader <file>                  print every kept transition
+//   trace_reader <file> --replay [speed] print them with their original spacing,
+//                                        speed times faster (1 by default)
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#include "state_machine/trace.h"
+
+int main(int argc, char** argv) {
+  if (argc < 2 || (argc > 2 && std::strcmp(argv[2], "--replay") != 0)) {
+    std::fprintf(stderr, "usage: %s <trace file> [--replay [speed]]\n", argv[0]);
+    return 2;
+  }
+  bool replay = argc > 2;
+  double speed = argc > 3 ? std::atof(argv[3]) : 1.0;
+  if (speed <= 0) {
+    std::fprintf(stderr, "speed must be positive\n");
+    return 2;
+  }
+
+  sm::TraceContents trace;
+  try {
+    trace = sm::TraceFile::load(argv[1]);
+  } catch (const sm::StateMachineException& e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  std::printf("%zu of %llu transition(s), %zu state(s), %zu event(s)\n", trace.records.size(),
+              static_cast<unsigned long long>(trace.recorded), trace.states.size(),
+              trace.events.size());
+
+  auto start = std::chrono::steady_clock::now();
+  for (const auto& record : trace.records) {
+    if (replay) {
+      auto offset = std::chrono::nanoseconds(
+          static_cast<int64_t>((record.timestamp - trace.records.front().timestamp) / speed));
+      std::this_thread::sleep_until(start + offset);
+    }
+    std::printf("%s\n", trace.describe(record).c_str());
+    std::fflush(stdout);
+  }
+  return 0;
+}